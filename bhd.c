@@ -30,7 +30,6 @@ int main(int argc, char** argv)
         struct bhd_srv srv;
         char* cfgp = "/etc/bhdns";
         struct bhd_cfg cfg;
-        struct bhd_bl* bl;
         int d = 0;
         int c;
 
@@ -62,10 +61,10 @@ int main(int argc, char** argv)
                 syslog(LOG_ERR, "No configuration found, exiting");
                 return 1;
         }
-        bl = bhd_bl_create(cfg.bp);
 
+        /* The block list is loaded once the server is started */
         syslog(LOG_INFO, "Starting");
-        if (bhd_srv_init(&srv, &cfg, bl, d) < 0)
+        if (bhd_srv_init(&srv, &cfg, d) < 0)
         {
                 syslog(LOG_ERR, "Can't initialize");
                 return 1;
@@ -100,16 +99,33 @@ int main(int argc, char** argv)
                 printf("lport: %d\n", cfg.lport);
                 printf("sport: %d\n", cfg.sport);
                 printf("bp: %s\n", cfg.bp);
+                printf("blist-engine: %u\n", cfg.bl_engine);
+                printf("blist-fail: %s\n",
+                       cfg.bl_fail_closed ? "closed" : "open");
+                printf("blist-threads: %d\n", cfg.bl_threads);
+                printf("blist-mode: %s\n",
+                       cfg.bl_nxdomain ? "nxdomain" : "nodata");
                 printf("baddr: %s\n", cfg.baddr);
-                printf("faddr: %s\n", cfg.faddr);
-                printf("fport: %d\n", cfg.fport);
+                printf("baddr6: %s\n", cfg.baddr6);
+                for (int i = 0; i < cfg.nforward; i++)
+                {
+                        printf("faddr: %s@%d\n", cfg.faddr[i], cfg.fports[i]);
+                }
                 printf("user: %s\n", cfg.user);
+                printf("workers: %d\n", cfg.workers);
+                printf("cache-size: %u\n", cfg.cache_size);
+                printf("hedge-percentile: %u\n", cfg.hedge_pct);
+                printf("prefetch: %u\n", cfg.prefetch);
+                printf("prefetch-limit: %u\n", cfg.prefetch_limit);
+                printf("serve-stale: %u\n", cfg.stale);
+                printf("edns-size: %u\n", cfg.edns_size);
         }
 #endif
 
         bhd_serve(&srv);
         syslog(LOG_INFO, "Stopping");
-        bhd_bl_free(bl);
+        /* The block list may have been reloaded */
+        bhd_bl_free(srv.bl);
 
         return 0;
 }
@@ -12,280 +12,2681 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "bhd_dns.h"
 #include "bhd_bl.h"
-#include "vendor/hmap.h"
-#include "vendor/strutil.h"
-#include "vendor/stack.h"
 #include "vendor/timing.h"
 
+/* The block list is a trie of labels, read from the TLD and down. It
+   is built once and then frozen into a single arena holding the nodes,
+   the children tables and a pool of interned labels. All references
+   are 32 bit indices into the arena, so the arena can be saved as an
+   image and mapped read only by later runs.
+
+   The arena starts with a blocked Bloom filter over the hashes of all
+   names in the trie. Most queries are not blocked and leave the trie
+   right below the TLD, the filter is a fraction of the size of the
+   children tables and tells that with one cache line.
+
+   With the hash engine the trie is only used to build a perfect hash
+   table (CHD, hash and displace) of the hashes of the blocked names,
+   and is then released. Each parent domain of a name is looked up with
+   one probe in the table and a compare of the stored hash. */
+
+/* A node in the frozen trie. The children are found through an open
+   addressing table of nslots slots, indexed by the hash of the child's
+   label. */
+struct bhd_bl_node
+{
+        /* Offset of the label in the pool, stored as a length byte
+           followed by the label in lower case */
+        uint32_t label;
+        /* First slot of the children table */
+        uint32_t slots;
+        /* Number of slots, a power of two, 0 for a leaf */
+        uint32_t nslots;
+        /* Set if an entry ends at this node */
+        uint32_t term;
+};
+
+struct bhd_bl_slot
+{
+        /* Hash of the child's label */
+        uint32_t hash;
+        /* Child node + 1, 0 if the slot is empty */
+        uint32_t node;
+};
+
 struct bhd_bl
 {
-        struct hmap* tree;
+        /* Filter, nodes, slots and the label pool in one allocation, or
+           in a mapped image */
+        void* arena;
+        const uint64_t* filter;
+        const struct bhd_bl_node* nodes;
+        const struct bhd_bl_slot* slots;
+        const unsigned char* pool;
+        size_t size;
+        size_t npool;
+        /* The mapped image, NULL if the arena is allocated */
+        void* map;
+        size_t maplen;
+        uint32_t nnodes;
+        uint32_t nslots;
+        /* Number of filter blocks */
+        uint32_t nfilter;
+        /* Number of entries */
+        uint32_t count;
+        /* Estimated false positive rate of the filter */
+        double fpr;
+        enum bhd_bl_engine engine;
+        /* Hash engine, a seed per bucket and the hash of the name in
+           each slot, 0 if the slot is empty */
+        uint16_t* seeds;
+        uint64_t* names;
+        uint32_t nbuckets;
+        uint32_t nnames;
+};
+
+/* Header of a block list image, followed by the arena. Integers are
+   in host byte order, an image is rejected on a host with another byte
+   order or with another version. */
+struct bhd_bl_image
+{
+        char magic[8];
+        uint32_t version;
+        /* BHD_BL_BOM as written by the host */
+        uint32_t bom;
+        uint32_t nnodes;
+        uint32_t nslots;
+        uint32_t npool;
+        uint32_t nfilter;
+        uint32_t count;
+        /* Checksum of the arena */
+        uint64_t sum;
+        /* Pad to a cache line, so the filter blocks are aligned */
+        uint32_t reserved[4];
+};
+
+/* A node while the trie is built */
+struct bhd_bl_bnode
+{
+        /* Hash of the name ending at the node */
+        uint64_t name;
+        uint32_t parent;
+        uint32_t label;
+        uint32_t hash;
+        uint32_t nchild;
+        uint32_t term;
+};
+
+/* An edge from a parent to a child with an interned label */
+struct bhd_bl_edge
+{
+        uint32_t parent;
+        uint32_t label;
+        /* Child node + 1, 0 if the slot is empty */
+        uint32_t child;
+};
+
+struct bhd_bl_build
+{
+        struct bhd_bl_bnode* nodes;
+        size_t nnodes;
+        size_t capnodes;
+        /* Open addressing table of edges, keyed on parent and label */
+        struct bhd_bl_edge* edges;
+        size_t capedges;
+        /* Label pool, and open addressing table of pool offset + 1 of
+           the interned labels */
+        unsigned char* pool;
+        size_t npool;
+        size_t cappool;
+        uint32_t* labels;
+        size_t nlabels;
+        size_t caplabels;
 };
 
 #define MAX_LINE 256
+/* Min size of the text parsed per thread */
+#define BHD_BL_MIN_CHUNK (256 * 1024)
+/* Bytes of text classified at once, in blocks of 64 bytes */
+#define BHD_BL_WINDOW 4096
+/* Byte classes of the scalar classifier */
+#define BHD_BL_C_NL 1
+#define BHD_BL_C_SEP 2
+#define BHD_BL_C_DOT 4
+/* A name of 255 bytes has at most 127 labels */
+#define BHD_BL_MAX_LABELS 128
+#define BHD_BL_INIT_CAP 1024
+#define BHD_BL_MAGIC "BHDBLIMG"
+#define BHD_BL_VERSION 2
+/* A filter block is a cache line of 512 bits, each name sets
+   BHD_BL_FILTER_K bits in one block. Sized for BHD_BL_FILTER_BITS bits
+   per name, which gives a false positive rate below 1%. */
+#define BHD_BL_BLOCK 8
+#define BHD_BL_FILTER_K 7
+#define BHD_BL_FILTER_BITS 12
+#define BHD_BL_BOM 0x01020304u
+#define BHD_BL_ROOT 0x9e3779b97f4a7c15ULL
+/* Average number of names per bucket and percent of the slots used by
+   the hash engine, a seed is tried for each bucket until its names are
+   placed in free slots */
+#define BHD_BL_BUCKET 4
+#define BHD_BL_LOAD 99
+#define BHD_BL_MAX_SEED UINT16_MAX
+/* Lookups in flight in bhd_bl_match_batch */
+#define BHD_BL_BATCH 16
+
+#if defined(__GNUC__)
+#define BHD_BL_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define BHD_BL_PREFETCH(p) ((void)(p))
+#endif
+
+struct bhd_bl_buf
+{
+        unsigned char* buf;
+        size_t len;
+        size_t cap;
+};
+
+/* A newline aligned part of a text block list. The entries are
+   normalized to length prefixed labels ending with an empty label, as
+   names in wire format, and put in the buffer of their shard. */
+struct bhd_bl_chunk
+{
+        const char* start;
+        const char* end;
+        struct bhd_bl_buf out[BHD_BL_MAX_THREADS];
+        int nshards;
+        int count;
+        int err;
+};
+
+/* Masks of the newlines, field separators and comment markers, and
+   dots in a window of text, a bit per byte. Fields are separated by
+   white space, and by ^ / $ * in adblock and dnsmasq rules. */
+struct bhd_bl_window
+{
+        const char* base;
+        uint64_t nl[BHD_BL_WINDOW / 64];
+        uint64_t sep[BHD_BL_WINDOW / 64];
+        uint64_t dot[BHD_BL_WINDOW / 64];
+};
+
+#if !defined(__SSE2__)
+static const unsigned char bhd_bl_class[256] = {
+        ['\n'] = BHD_BL_C_NL,
+        [' '] = BHD_BL_C_SEP,
+        ['\t'] = BHD_BL_C_SEP,
+        ['\r'] = BHD_BL_C_SEP,
+        ['#'] = BHD_BL_C_SEP,
+        ['^'] = BHD_BL_C_SEP,
+        ['/'] = BHD_BL_C_SEP,
+        ['$'] = BHD_BL_C_SEP,
+        ['*'] = BHD_BL_C_SEP,
+        ['.'] = BHD_BL_C_DOT,
+};
+#endif
+
+/* A shard holds all names below a set of second level domains, so
+   shards share no nodes below the TLDs. */
+struct bhd_bl_shard
+{
+        struct bhd_bl_build b;
+        const struct bhd_bl_chunk* chunks;
+        int nchunks;
+        int idx;
+        int err;
+};
+
+/* A lookup of bhd_bl_match_batch. Each step ends by prefetching the
+   memory the next step reads. */
+struct bhd_bl_lookup
+{
+        /* The name, NULL if no lookup is in flight */
+        const unsigned char* name;
+        /* Trie node of the labels matched so far */
+        const struct bhd_bl_node* node;
+        /* Hash of the name matched so far, ending with the label being
+           looked up */
+        uint64_t hash;
+        /* Hash of the label being looked up in the trie */
+        uint32_t label;
+        /* Slot being looked up in the hash table, or the child + 1
+           being looked up in the trie */
+        uint32_t slot;
+        /* Index of the name in the batch */
+        size_t idx;
+        /* Labels left to look up */
+        int n;
+        int stage;
+        /* Offset of each label in the name */
+        uint8_t offs[BHD_BL_MAX_LABELS];
+};
+
+/**
+ * Create a block list using the trie engine from a text file or an
+ * image.
+ * @return the block list, or NULL on error.
+ */
+static struct bhd_bl* bhd_bl_load(const char* p, int threads);
+
+/**
+ * Parse a text block list into a trie. The text is split in newline
+ * aligned chunks that are parsed on their own threads, and sorted into
+ * shards by the name below the TLD. Each shard is built into a trie on
+ * its own thread, and the shards are merged.
+ * @param b the trie to build.
+ * @param text of the block list.
+ * @param len of the text.
+ * @param threads to use, 0 for one per online CPU.
+ * @return the number of entries, or -1 on error.
+ */
+static int bhd_bl_parse(struct bhd_bl_build* b,
+                        const char* text,
+                        size_t len,
+                        int threads);
+
+/**
+ * Parse the entries of a chunk, thread main.
+ */
+static void* bhd_bl_parse_chunk(void* arg);
+
+/**
+ * Parse a line of a chunk. Plain names, hosts files (an address
+ * followed by names), adblock rules (||name^) and dnsmasq rules
+ * (address=/name/) are read, with # comments.
+ * @param c the chunk.
+ * @param w the window holding the line.
+ * @param a start of the line in the window.
+ * @param e end of the line in the window.
+ */
+static void bhd_bl_parse_line(struct bhd_bl_chunk* c,
+                              const struct bhd_bl_window* w,
+                              size_t a,
+                              size_t e);
+
+/**
+ * Split a name in labels and put it in the buffer of its shard.
+ * @param hosts set if read from a hosts file, local names are skipped.
+ */
+static void bhd_bl_parse_name(struct bhd_bl_chunk* c,
+                              const struct bhd_bl_window* w,
+                              size_t s,
+                              size_t e,
+                              int hosts);
+
+/**
+ * Classify the text of a window, in blocks of 64 bytes.
+ */
+static void bhd_bl_window_fill(struct bhd_bl_window* w,
+                               const char* base,
+                               size_t len);
+
+/**
+ * Classify a block of 64 bytes, with SIMD instructions when available.
+ * @param p the block.
+ * @param nl set to the mask of newlines.
+ * @param sep set to the mask of field separators and comment markers.
+ * @param dot set to the mask of dots.
+ */
+static void bhd_bl_classify(const unsigned char* p,
+                            uint64_t* nl,
+                            uint64_t* sep,
+                            uint64_t* dot);
+
+/**
+ * Find the first set bit of a mask of a window.
+ * @return the offset of the bit, or to if no bit is set before it.
+ */
+static size_t bhd_bl_next(const uint64_t* m, size_t from, size_t to);
+
+/**
+ * Check if a field is an IPv4 or IPv6 address.
+ * @return 1 if it looks like an address.
+ */
+static int bhd_bl_is_addr(const char* p, size_t len);
+static int bhd_bl_blank(char ch);
+static unsigned int bhd_bl_ctz(uint64_t x);
+
+/**
+ * Build the trie of a shard, thread main.
+ */
+static void* bhd_bl_build_shard(void* arg);
+
+/**
+ * Merge the tries of the shards. Only the TLDs may be shared between
+ * shards, other nodes are copied as is.
+ * @return 0 on success.
+ */
+static int bhd_bl_merge(struct bhd_bl_build* b,
+                        const struct bhd_bl_shard* shards,
+                        int n);
+
+/**
+ * Append to a buffer.
+ * @return 0 on success.
+ */
+static int bhd_bl_buf_put(struct bhd_bl_buf*, const void*, size_t);
+
+/**
+ * Build the perfect hash table of the blocked names in the trie, and
+ * release the trie.
+ * @return 0 on success.
+ */
+static int bhd_bl_hash_build(struct bhd_bl*);
+
+/**
+ * Place the names of the buckets in the table, trying seeds in order.
+ * @param keys the names sorted by bucket.
+ * @param start the end of each bucket in keys.
+ * @param taken a flag per slot.
+ * @return 0 on success, -1 if a bucket could not be placed.
+ */
+static int bhd_bl_hash_place(struct bhd_bl*,
+                             const uint64_t* keys,
+                             const uint32_t* start,
+                             uint8_t* taken);
+
+/**
+ * Slot of a name in the hash table.
+ */
+static uint32_t bhd_bl_hash_slot(const struct bhd_bl*, uint64_t name);
+
+static int bhd_bl_build_init(struct bhd_bl_build*);
+static void bhd_bl_build_free(struct bhd_bl_build*);
+
+/**
+ * Add an entry, the labels are given from left to right.
+ * @return 0 on success, 1 if a label is not valid and -1 on error.
+ */
+static int bhd_bl_add(struct bhd_bl_build*,
+                      const char** labels,
+                      const size_t* lens,
+                      int n);
+
+/**
+ * Find or add the child of a node with the provided label.
+ * @return the child or -1 on error.
+ */
+static long bhd_bl_add_child(struct bhd_bl_build*,
+                             uint32_t parent,
+                             const unsigned char* label,
+                             size_t len,
+                             uint32_t hash);
+
+/**
+ * Intern a label in lower case in the pool.
+ * @return the offset of the label, or -1 on error.
+ */
+static long bhd_bl_intern(struct bhd_bl_build*,
+                          const unsigned char* label,
+                          size_t len,
+                          uint32_t hash);
+
+/**
+ * Freeze a built trie into the arena of the block list.
+ * @return 0 on success.
+ */
+static int bhd_bl_freeze(struct bhd_bl*, const struct bhd_bl_build*);
+
+/**
+ * Map a block list image read only and validate it.
+ * @return the block list, or NULL on error.
+ */
+static struct bhd_bl* bhd_bl_map(const char* p);
+
+/**
+ * Estimate the false positive rate of the filter from the fraction of
+ * set bits.
+ */
+static double bhd_bl_filter_fpr(const uint64_t* filter, uint32_t nfilter);
+
+/**
+ * FNV-1a hash over 64 bit words, used as checksum of an image.
+ */
+static uint64_t bhd_bl_sum(const unsigned char* buf, size_t len);
+
+/**
+ * Size of the children table of a node, a power of two that keeps the
+ * table at most two thirds full.
+ * @return the number of slots, 0 for a leaf.
+ */
+static uint32_t bhd_bl_nslots(uint32_t nchild);
+
+/**
+ * Find the child of a node with the provided label.
+ * @return the child + 1, or 0 if not found.
+ */
+static uint32_t bhd_bl_child(const struct bhd_bl*,
+                             const struct bhd_bl_node*,
+                             const unsigned char* label,
+                             size_t len,
+                             uint32_t hash);
 
-static int bhd_bl_add_labels(struct bhd_bl*, struct stack*);
+/**
+ * Walk the trie from the TLD until an entry ends (an exact match or a
+ * sub domain) or a label is not found. The labels are given from left
+ * to right, with their hashes.
+ * @return 1 if an entry ends at or above the last label.
+ */
+static int bhd_bl_walk(const struct bhd_bl*,
+                       const unsigned char** labels,
+                       const size_t* lens,
+                       const uint32_t* hashes,
+                       int n);
 
-struct bhd_bl* bhd_bl_create(const char* p)
+/**
+ * Start the lookup of the next valid name of a batch. The verdict of
+ * an invalid name is set to 0.
+ * @param lookup to start.
+ * @param next name of the batch, updated.
+ * @return 1 if a lookup was started, 0 if the batch is done.
+ */
+static int bhd_bl_lookup_next(const struct bhd_bl*,
+                              struct bhd_bl_lookup*,
+                              const unsigned char* const* names,
+                              const size_t* lens,
+                              int* verdicts,
+                              size_t n,
+                              size_t* next);
+
+/**
+ * Advance a lookup one step.
+ * @return -1 if the lookup is not done, else 1 if the name is blocked
+ *         and 0 if it is not.
+ */
+static int bhd_bl_lookup_step(const struct bhd_bl*, struct bhd_bl_lookup*);
+
+/**
+ * Compare a label of the pool with a label in any case.
+ * @return 1 if the labels are equal.
+ */
+static int bhd_bl_label_eq(const unsigned char* pooled,
+                           const unsigned char* label,
+                           size_t len);
+
+/**
+ * FNV-1a hash of a label in lower case.
+ */
+static uint32_t bhd_bl_hash(const unsigned char* label, size_t len);
+static uint32_t bhd_bl_edge_hash(uint32_t parent, uint32_t label);
+
+/**
+ * Hash of a name, from the hash of its parent domain and of the name's
+ * first label. The root's hash is BHD_BL_ROOT.
+ */
+static uint64_t bhd_bl_name_hash(uint64_t parent, uint64_t label);
+
+/**
+ * 64 bit FNV-1a of a label in lower case, used by the hash engine.
+ */
+static uint64_t bhd_bl_hash64(const unsigned char* label, size_t len);
+static void bhd_bl_filter_add(uint64_t* filter, uint32_t nfilter, uint64_t h);
+static int bhd_bl_filter_has(const uint64_t* filter,
+                             uint32_t nfilter,
+                             uint64_t h);
+static uint64_t bhd_bl_mix(uint64_t k);
+static unsigned char bhd_bl_lower(unsigned char c);
+
+struct bhd_bl* bhd_bl_create(const char* p,
+                             enum bhd_bl_engine engine,
+                             int threads)
+{
+        struct bhd_bl* bl = bhd_bl_load(p, threads);
+
+        if (!bl)
+        {
+                return NULL;
+        }
+        bl->engine = BHD_BL_TRIE;
+        bl->seeds = NULL;
+        bl->names = NULL;
+        if (engine == BHD_BL_HASH && bhd_bl_hash_build(bl))
+        {
+                syslog(LOG_ERR, "Could not create block list hash: %m");
+                bhd_bl_free(bl);
+                return NULL;
+        }
+
+        return bl;
+}
+
+static struct bhd_bl* bhd_bl_load(const char* p, int threads)
 {
-        char line[MAX_LINE];
+        struct bhd_bl_build b;
         struct timing t;
-        FILE* f;
+        struct stat st;
         struct bhd_bl* bl;
-        int count = 0;
-        struct stack* s;
+        char* text = NULL;
+        int count;
+        int fd;
 
         timing_start(&t);
-        f = fopen(p, "r");
-        if (!f)
+        fd = open(p, O_RDONLY);
+        if (fd < 0)
         {
                 syslog(LOG_ERR, "%s:open '%s': %m", __func__, p);
                 return NULL;
         }
+        if (fstat(fd, &st))
+        {
+                syslog(LOG_ERR, "%s:fstat '%s': %m", __func__, p);
+                close(fd);
+                return NULL;
+        }
+        if (st.st_size > 0)
+        {
+                text = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (text == MAP_FAILED)
+                {
+                        syslog(LOG_ERR, "%s:mmap '%s': %m", __func__, p);
+                        close(fd);
+                        return NULL;
+                }
+                posix_madvise(text, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+        }
+        close(fd);
+
+        /* A compiled image is mapped instead of parsed */
+        if ((size_t)st.st_size >= sizeof(BHD_BL_MAGIC) - 1 &&
+            memcmp(text, BHD_BL_MAGIC, sizeof(BHD_BL_MAGIC) - 1) == 0)
+        {
+                munmap(text, (size_t)st.st_size);
+                bl = bhd_bl_map(p);
+                if (bl)
+                {
+                        syslog(LOG_DEBUG,
+                               "mapped %u items in %ldms, %zu KiB, "
+                               "filter %zu KiB fpr %.2f%%",
+                               bl->count,
+                               timing_dur_msec(&t),
+                               bl->size / 1024,
+                               (size_t)bl->nfilter * 64 / 1024,
+                               bl->fpr * 100.0);
+                }
+                return bl;
+        }
 
         bl = malloc(sizeof(struct bhd_bl));
         if (!bl)
         {
                 syslog(LOG_ERR, "%s:malloc: %m", __func__);
+                if (text)
+                {
+                        munmap(text, (size_t)st.st_size);
+                }
                 return NULL;
         }
-        bl->tree = hmap_create(NULL, NULL, 16, 0.7f);
-        if (!bl->tree)
+        count = bhd_bl_parse(&b, text, (size_t)st.st_size, threads);
+        if (text)
         {
-                syslog(LOG_ERR, "hmap_create: %m");
-                free(bl);
-                return NULL;
+                munmap(text, (size_t)st.st_size);
         }
-        s = stack_create(10, STACK_AUTO_EXPAND);
-        if (!s)
+        if (count < 0)
         {
-                syslog(LOG_ERR, "stack_create: %m");
-                hmap_destroy(bl->tree);
+                syslog(LOG_ERR, "Could not parse block list: %m");
                 free(bl);
                 return NULL;
         }
 
-        while (fgets(line, MAX_LINE, f))
+        if (bhd_bl_freeze(bl, &b))
         {
-                char* pos;
-                char* start = line;
-                line[MAX_LINE-1] = '\0';
-                strrstrip(line);
-                strlstrip(line);
-
-                if (line[0] == '#' || line[0] == '\0')
-                {
-                        continue;
-                }
-
-                count++;
-                pos = strchr(line, '.');
-                while (pos)
-                {
-                        size_t len = pos - start;
-                        char* label = malloc(len + 1);
-
-                        if (!label)
-                        {
-                                syslog(LOG_WARNING,
-                                       "Could not add entry block list: %m");
-                                goto done;
-                        }
-
-                        *pos = '\0';
-                        memcpy(label, start, len + 1);
-                        if (stack_push(s, label))
-                        {
-                                syslog(LOG_WARNING,
-                                       "Could not add entry block list: %m");
-                                free(label);
-                                goto done;
-                        }
-                        start = pos + 1;
-                        pos = strchr(start, '.');
-                        if (!pos)
-                        {
-                                /* Last label */
-                                len = strlen(start);
-                                label = malloc(len + 1);
-                                if (!label)
-                                {
-                                        syslog(LOG_WARNING,
-                                               "Could not add entry block list: %m");
-                                        goto done;
-                                }
-                                memcpy(label, start, len + 1);
-                                if (stack_push(s, label))
-                                {
-                                        syslog(LOG_WARNING,
-                                               "Could not add entry block list: %m");
-                                        free(label);
-                                        goto done;
-                                }
-                        }
-                }
-
-                bhd_bl_add_labels(bl, s);
+                syslog(LOG_ERR, "Could not create block list: %m");
+                bhd_bl_build_free(&b);
+                free(bl);
+                return NULL;
         }
+        bhd_bl_build_free(&b);
+        bl->count = (uint32_t)count;
 
-done:
-        fclose(f);
-        stack_destroy(s);
         syslog(LOG_DEBUG,
-               "added %d items in %ldms",
+               "added %d items in %ldms, %u nodes, %zu KiB, "
+               "filter %zu KiB fpr %.2f%%",
                count,
-               timing_dur_msec(&t));
+               timing_dur_msec(&t),
+               bl->nnodes,
+               bl->size / 1024,
+               (size_t)bl->nfilter * 64 / 1024,
+               bl->fpr * 100.0);
 
         return bl;
 }
 
-int bhd_bl_match(struct bhd_bl* bl, const struct bhd_dns_q_label* label)
+int bhd_bl_match(const struct bhd_bl* bl, const struct bhd_dns_q_label* label)
 {
-        struct stack* s;
-        char* l;
-        int ret = 1;
+        const unsigned char* labels[BHD_BL_MAX_LABELS];
+        size_t lens[BHD_BL_MAX_LABELS];
+        uint32_t hashes[BHD_BL_MAX_LABELS];
+        int n = 0;
 
         if (!bl)
         {
                 return 0;
         }
 
-        s = stack_create(8, STACK_AUTO_EXPAND);
-        if (!s)
+        for (; label; label = label->next)
+        {
+                if (n == BHD_BL_MAX_LABELS)
+                {
+                        return 0;
+                }
+                labels[n] = (const unsigned char*)label->label;
+                lens[n] = strlen(label->label);
+                hashes[n] = bhd_bl_hash(labels[n], lens[n]);
+                n++;
+        }
+
+        return bhd_bl_walk(bl, labels, lens, hashes, n);
+}
+
+int bhd_bl_match_name(const struct bhd_bl* bl,
+                      const unsigned char* name,
+                      size_t len)
+{
+        const unsigned char* labels[BHD_BL_MAX_LABELS];
+        size_t lens[BHD_BL_MAX_LABELS];
+        uint32_t hashes[BHD_BL_MAX_LABELS];
+        size_t off = 0;
+        int n = 0;
+
+        if (!bl)
         {
                 return 0;
         }
-        while(label)
+
+        /* Hash the labels left to right, they are matched right to
+           left. Format is 3www7openbsd3org0 */
+        for (;;)
         {
-                if (stack_push(s, label->label))
+                size_t l;
+
+                if (off >= len || off > BHD_DNS_MAX_NAME)
+                {
+                        return 0;
+                }
+                l = name[off];
+                if (l == 0)
+                {
+                        break;
+                }
+                /* Compression pointers and extended labels */
+                if (l > BHD_DNS_MAX_LABEL ||
+                    off + 1 + l > len ||
+                    n == BHD_BL_MAX_LABELS)
                 {
-                        syslog(LOG_WARNING, "%s:stack_push: %m", __func__);
-                        ret = 0;
-                        goto done;
+                        return 0;
                 }
-                label = label->next;
+                labels[n] = name + off + 1;
+                lens[n] = l;
+                hashes[n] = bhd_bl_hash(labels[n], l);
+                n++;
+                off += l + 1;
+        }
+
+        return bhd_bl_walk(bl, labels, lens, hashes, n);
+}
+
+int bhd_bl_match_batch(const struct bhd_bl* bl,
+                       const unsigned char* const* names,
+                       const size_t* lens,
+                       int* verdicts,
+                       size_t n)
+{
+        struct bhd_bl_lookup l[BHD_BL_BATCH];
+        size_t next = 0;
+        int active = 0;
+        int blocked = 0;
+
+        if (!bl)
+        {
+                memset(verdicts, 0, n * sizeof(int));
+                return 0;
         }
 
-        struct hmap* hm = bl->tree;
-        while ((l = stack_pop(s)))
+        for (int i = 0; i < BHD_BL_BATCH; i++)
         {
-                hm = hmap_get(hm, l);
+                active += bhd_bl_lookup_next(bl,
+                                             &l[i],
+                                             names,
+                                             lens,
+                                             verdicts,
+                                             n,
+                                             &next);
+        }
 
-                if (hm)
+        /* Step the lookups round robin, when one is done the next name
+           takes its place */
+        while (active)
+        {
+                for (int i = 0; i < BHD_BL_BATCH; i++)
                 {
-                        size_t children = hmap_size(hm);
-                        size_t more = stack_size(s);
+                        int v;
 
-                        if (children == 0)
+                        if (!l[i].name)
                         {
-                                /* The provided domain is an exact match or
-                                   a subdomain. Block */
-                                break;
+                                continue;
                         }
-                        if (more == 0)
+                        v = bhd_bl_lookup_step(bl, &l[i]);
+                        if (v < 0)
                         {
-                                /* The provided domain is not fully matched */
-                                ret = 0;
-                                break;
+                                continue;
+                        }
+                        verdicts[l[i].idx] = v;
+                        blocked += v;
+                        if (!bhd_bl_lookup_next(bl,
+                                                &l[i],
+                                                names,
+                                                lens,
+                                                verdicts,
+                                                n,
+                                                &next))
+                        {
+                                active--;
                         }
-                }
-                else
-                {
-                        /* no match */
-                        ret = 0;
-                        break;
                 }
         }
-done:
-        stack_destroy(s);
 
-        return ret;
+        return blocked;
 }
 
-void bhd_bl_free(struct bhd_bl* bl)
+int bhd_bl_save(const struct bhd_bl* bl, const char* p)
+{
+        struct bhd_bl_image img;
+        char tmp[PATH_MAX];
+        FILE* f;
+
+        if (bl->engine != BHD_BL_TRIE)
+        {
+                errno = EINVAL;
+                return -1;
+        }
+        if (snprintf(tmp, sizeof(tmp), "%s.tmp", p) >= (int)sizeof(tmp))
+        {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+
+        memset(&img, 0, sizeof(img));
+        memcpy(img.magic, BHD_BL_MAGIC, sizeof(img.magic));
+        img.version = BHD_BL_VERSION;
+        img.bom = BHD_BL_BOM;
+        img.nnodes = bl->nnodes;
+        img.nslots = bl->nslots;
+        img.npool = (uint32_t)bl->npool;
+        img.nfilter = bl->nfilter;
+        img.count = bl->count;
+        img.sum = bhd_bl_sum(bl->arena, bl->size);
+
+        /* Write a new file and rename it, so a running server that maps
+           the old image is not affected */
+        f = fopen(tmp, "w");
+        if (!f)
+        {
+                return -1;
+        }
+        if (fwrite(&img, sizeof(img), 1, f) != 1 ||
+            fwrite(bl->arena, 1, bl->size, f) != bl->size)
+        {
+                fclose(f);
+                unlink(tmp);
+                return -1;
+        }
+        if (fclose(f) || rename(tmp, p))
+        {
+                unlink(tmp);
+                return -1;
+        }
+
+        return 0;
+}
+
+void bhd_bl_info(const struct bhd_bl* bl, struct bhd_bl_info* info)
 {
+        memset(info, 0, sizeof(*info));
         if (!bl)
         {
                 return;
         }
 
-        struct hmap_entry* d;
-        struct hmap* h;
-        struct stack* s = stack_create(256, STACK_AUTO_EXPAND);
-        size_t cnt;
+        info->count = bl->count;
+        if (bl->engine == BHD_BL_HASH)
+        {
+                info->size = (size_t)bl->nnames * sizeof(uint64_t) +
+                        (size_t)bl->nbuckets * sizeof(uint16_t);
+                return;
+        }
+        info->size = bl->size;
+        info->filter = (size_t)bl->nfilter * BHD_BL_BLOCK * sizeof(uint64_t);
+        info->fpr = bl->fpr;
+}
 
-        if (!s)
+void bhd_bl_free(struct bhd_bl* bl)
+{
+        if (!bl)
         {
-                syslog(LOG_WARNING, "%s:stack_create: %m", __func__);
                 return;
         }
 
-        /* each entry is key: label, and data: hmap */
-        stack_push(s, bl->tree);
+        if (bl->map)
+        {
+                munmap(bl->map, bl->maplen);
+        }
+        else
+        {
+                free(bl->arena);
+        }
+        free(bl->seeds);
+        free(bl->names);
+        free(bl);
+}
+
+static int bhd_bl_parse(struct bhd_bl_build* b,
+                        const char* text,
+                        size_t len,
+                        int threads)
+{
+        struct bhd_bl_chunk* chunks;
+        struct bhd_bl_shard* shards;
+        pthread_t tids[BHD_BL_MAX_THREADS];
+        int started[BHD_BL_MAX_THREADS];
+        int count = 0;
+        int err = 0;
+        int n = threads;
+
+        if (n <= 0)
+        {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+                n = cpus > 0 ? (int)cpus : 1;
+        }
+        if (n > BHD_BL_MAX_THREADS)
+        {
+                n = BHD_BL_MAX_THREADS;
+        }
+        /* Small lists are not worth the threads, unless asked for */
+        if (threads <= 0 && (size_t)n > len / BHD_BL_MIN_CHUNK + 1)
+        {
+                n = (int)(len / BHD_BL_MIN_CHUNK + 1);
+        }
+
+        chunks = calloc((size_t)n, sizeof(struct bhd_bl_chunk));
+        shards = calloc((size_t)n, sizeof(struct bhd_bl_shard));
+        if (!chunks || !shards)
+        {
+                free(chunks);
+                free(shards);
+                return -1;
+        }
 
-        while ((h = stack_pop(s)))
+        /* Split the text at newlines */
+        for (int i = 0; i < n; i++)
         {
-                d = hmap_iter(h, &cnt);
-                if (!d)
+                size_t start = len * (size_t)i / (size_t)n;
+                size_t end = len * (size_t)(i + 1) / (size_t)n;
+
+                while (start > 0 && start < len && text[start - 1] != '\n')
                 {
-                        syslog(LOG_WARNING, "Failed to purge sub-tree: %m");
-                        continue;
+                        start++;
                 }
-                for (size_t i = 0; i < cnt; i++)
+                while (end > 0 && end < len && text[end - 1] != '\n')
                 {
-                        free((void*)d[i].key);
-                        if (stack_push(s, d[i].data))
-                        {
-                                syslog(LOG_WARNING, "%s:stack_push: %m", __func__);
-                                break;
-                        }
+                        end++;
+                }
+                chunks[i].start = text + start;
+                chunks[i].end = text + (end > start ? end : start);
+                chunks[i].nshards = n;
+        }
 
+        /* A thread that can not be started is run on this thread */
+        for (int i = 0; i < n; i++)
+        {
+                started[i] = pthread_create(&tids[i],
+                                            NULL,
+                                            &bhd_bl_parse_chunk,
+                                            &chunks[i]) == 0;
+                if (!started[i])
+                {
+                        bhd_bl_parse_chunk(&chunks[i]);
                 }
-                free(d);
-                hmap_destroy(h);
         }
-        stack_destroy(s);
-        free(bl);
+        for (int i = 0; i < n; i++)
+        {
+                if (started[i])
+                {
+                        pthread_join(tids[i], NULL);
+                }
+                count += chunks[i].count;
+                err |= chunks[i].err;
+        }
+
+        for (int i = 0; i < n && !err; i++)
+        {
+                shards[i].chunks = chunks;
+                shards[i].nchunks = n;
+                shards[i].idx = i;
+                started[i] = pthread_create(&tids[i],
+                                            NULL,
+                                            &bhd_bl_build_shard,
+                                            &shards[i]) == 0;
+                if (!started[i])
+                {
+                        bhd_bl_build_shard(&shards[i]);
+                }
+        }
+        for (int i = 0; i < n && !err; i++)
+        {
+                if (started[i])
+                {
+                        pthread_join(tids[i], NULL);
+                }
+        }
+        for (int i = 0; i < n; i++)
+        {
+                err |= shards[i].err;
+                for (int j = 0; j < n; j++)
+                {
+                        free(chunks[i].out[j].buf);
+                }
+        }
+
+        /* A single shard is the whole trie */
+        if (!err && n == 1)
+        {
+                *b = shards[0].b;
+                memset(&shards[0].b, 0, sizeof(shards[0].b));
+        }
+        else if (!err && bhd_bl_merge(b, shards, n))
+        {
+                err = 1;
+        }
+        for (int i = 0; i < n; i++)
+        {
+                bhd_bl_build_free(&shards[i].b);
+        }
+        free(chunks);
+        free(shards);
+
+        if (err)
+        {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        return count;
 }
 
-static int bhd_bl_add_labels(struct bhd_bl* bl, struct stack* s)
+static void* bhd_bl_parse_chunk(void* arg)
 {
-        struct hmap* hm = bl->tree;
-        char* label;
+        struct bhd_bl_chunk* c = arg;
+        struct bhd_bl_window w;
+        const char* p = c->start;
 
-        while ((label = stack_pop(s)))
+        while (p < c->end && !c->err)
         {
-                struct hmap* next;
+                size_t len = (size_t)(c->end - p);
+                size_t a = 0;
 
-                next = hmap_get(hm, label);
-
-                if (next)
+                if (len > BHD_BL_WINDOW)
                 {
-                        free (label);
-                        hm = next;
+                        len = BHD_BL_WINDOW;
                 }
-                else
+                bhd_bl_window_fill(&w, p, len);
+
+                /* Parse the lines that end in the window, or at the end
+                   of the chunk */
+                while (a < len && !c->err)
                 {
-                        next = hmap_create(NULL, NULL, 16, 0.7f);
-                        if (!next)
-                        {
-                                syslog(LOG_WARNING, "Failed to create subtree: %m");
-                                free(label);
-                                return 1;
-                        }
-                        if (hmap_set(hm, label, next))
+                        size_t e = bhd_bl_next(w.nl, a, len);
+
+                        if (e == len && p + len < c->end)
                         {
-                                syslog(LOG_WARNING, "Failed to set label: %m");
-                                free(label);
-                                return 1;
+                                break;
                         }
-                        hm = next;
+                        bhd_bl_parse_line(c, &w, a, e);
+                        a = e + 1;
+                }
+                if (a == 0)
+                {
+                        /* A line longer than the window */
+                        const char* nl = memchr(p, '\n', (size_t)(c->end - p));
+
+                        syslog(LOG_WARNING,
+                               "Invalid block list entry '%.*s'",
+                               MAX_LINE,
+                               p);
+                        p = nl ? nl + 1 : c->end;
+                        continue;
+                }
+                p += a < len ? a : len;
+        }
+
+        return NULL;
+}
+
+static void bhd_bl_parse_line(struct bhd_bl_chunk* c,
+                              const struct bhd_bl_window* w,
+                              size_t a,
+                              size_t e)
+{
+        const char* t = w->base;
+        size_t te;
+
+        while (a < e && bhd_bl_blank(t[a]))
+        {
+                a++;
+        }
+        /* Comments, adblock headers and exceptions */
+        if (a == e ||
+            t[a] == '#' ||
+            t[a] == '!' ||
+            t[a] == '[' ||
+            t[a] == '@')
+        {
+                return;
+        }
+        if (e - a >= MAX_LINE)
+        {
+                syslog(LOG_WARNING,
+                       "Invalid block list entry '%.*s'",
+                       MAX_LINE,
+                       t + a);
+                return;
+        }
+
+        /* Adblock, ||name^ optionally followed by options. Other rules
+           match more than a name and are skipped. */
+        if (e - a > 2 && t[a] == '|' && t[a + 1] == '|')
+        {
+                te = bhd_bl_next(w->sep, a + 2, e);
+                if (te < e &&
+                    t[te] == '^' &&
+                    (te + 1 == e || t[te + 1] == '$' || bhd_bl_blank(t[te + 1])))
+                {
+                        bhd_bl_parse_name(c, w, a + 2, te, 0);
+                }
+                return;
+        }
+
+        /* dnsmasq, address=/name/address */
+        if (e - a > 9 && memcmp(t + a, "address=/", 9) == 0)
+        {
+                te = bhd_bl_next(w->sep, a + 9, e);
+                if (te < e && t[te] == '/')
+                {
+                        bhd_bl_parse_name(c, w, a + 9, te, 0);
+                }
+                return;
+        }
+
+        te = bhd_bl_next(w->sep, a, e);
+        if (te < e && bhd_bl_blank(t[te]) && bhd_bl_is_addr(t + a, te - a))
+        {
+                /* Hosts, an address followed by names up to a comment */
+                for (;;)
+                {
+                        a = te;
+                        while (a < e && bhd_bl_blank(t[a]))
+                        {
+                                a++;
+                        }
+                        if (a == e || t[a] == '#')
+                        {
+                                return;
+                        }
+                        te = bhd_bl_next(w->sep, a, e);
+                        if (te < e && !bhd_bl_blank(t[te]) && t[te] != '#')
+                        {
+                                break;
+                        }
+                        bhd_bl_parse_name(c, w, a, te, 1);
+                }
+        }
+        else if (te == e || bhd_bl_blank(t[te]) || t[te] == '#')
+        {
+                /* A name, possibly followed by a comment */
+                bhd_bl_parse_name(c, w, a, te, 0);
+                return;
+        }
+
+        syslog(LOG_WARNING,
+               "Invalid block list entry '%.*s'",
+               (int)(e - a),
+               t + a);
+}
+
+static void bhd_bl_parse_name(struct bhd_bl_chunk* c,
+                              const struct bhd_bl_window* w,
+                              size_t s,
+                              size_t e,
+                              int hosts)
+{
+        const char* labels[BHD_BL_MAX_LABELS];
+        size_t lens[BHD_BL_MAX_LABELS];
+        unsigned char rec[MAX_LINE + 1];
+        const char* t = w->base;
+        size_t nrec = 0;
+        uint64_t h = BHD_BL_ROOT;
+        int n = 0;
+
+        /* Split on dots, empty labels are skipped */
+        for (size_t l = s; l < e && n < BHD_BL_MAX_LABELS;)
+        {
+                size_t dot = bhd_bl_next(w->dot, l, e);
+
+                if (dot > l)
+                {
+                        labels[n] = t + l;
+                        lens[n] = dot - l;
+                        if (lens[n] > BHD_DNS_MAX_LABEL)
+                        {
+                                /* Not a valid name */
+                                n = 0;
+                                break;
+                        }
+                        n++;
+                }
+                l = dot + 1;
+        }
+        if (n == 0 || n == BHD_BL_MAX_LABELS)
+        {
+                syslog(LOG_WARNING,
+                       "Invalid block list entry '%.*s'",
+                       (int)(e - s),
+                       t + s);
+                return;
+        }
+        /* Hosts files map local names, such as localhost */
+        if (hosts &&
+            (n == 1 ||
+             bhd_bl_is_addr(t + s, e - s) ||
+             (e - s == 21 && memcmp(t + s, "localhost.localdomain", 21) == 0)))
+        {
+                return;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+                rec[nrec++] = (unsigned char)lens[i];
+                memcpy(rec + nrec, labels[i], lens[i]);
+                nrec += lens[i];
+        }
+        rec[nrec++] = 0;
+
+        /* The shard is chosen by the TLD and the label below */
+        for (int i = n - 1; i >= 0 && i >= n - 2; i--)
+        {
+                const unsigned char* l = (const unsigned char*)labels[i];
+
+                h = bhd_bl_name_hash(h, bhd_bl_hash(l, lens[i]));
+        }
+        if (bhd_bl_buf_put(&c->out[(h >> 32) * (uint64_t)c->nshards >> 32],
+                           rec,
+                           nrec))
+        {
+                c->err = 1;
+        }
+        c->count++;
+}
+
+static void bhd_bl_window_fill(struct bhd_bl_window* w,
+                               const char* base,
+                               size_t len)
+{
+        size_t i = 0;
+
+        w->base = base;
+        for (; i + 64 <= len; i += 64)
+        {
+                bhd_bl_classify((const unsigned char*)base + i,
+                                &w->nl[i / 64],
+                                &w->sep[i / 64],
+                                &w->dot[i / 64]);
+        }
+        if (i < len)
+        {
+                /* The last block is padded with zeros, which are in no
+                   class */
+                unsigned char pad[64];
+
+                memset(pad, 0, sizeof(pad));
+                memcpy(pad, base + i, len - i);
+                bhd_bl_classify(pad,
+                                &w->nl[i / 64],
+                                &w->sep[i / 64],
+                                &w->dot[i / 64]);
+        }
+}
+
+static void bhd_bl_classify(const unsigned char* p,
+                            uint64_t* nl,
+                            uint64_t* sep,
+                            uint64_t* dot)
+{
+#if defined(__AVX2__)
+        const __m256i cnl = _mm256_set1_epi8('\n');
+        const __m256i cdot = _mm256_set1_epi8('.');
+
+        *nl = 0;
+        *sep = 0;
+        *dot = 0;
+        for (int i = 0; i < 64; i += 32)
+        {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+                __m256i s;
+
+                s = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+                s = _mm256_or_si256(s, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+                s = _mm256_or_si256(s, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#')));
+                s = _mm256_or_si256(s, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('^')));
+                s = _mm256_or_si256(s, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+                s = _mm256_or_si256(s, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('$')));
+                s = _mm256_or_si256(s, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')));
+                *nl |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cnl)) << i;
+                *sep |= (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << i;
+                *dot |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cdot)) << i;
+        }
+#elif defined(__SSE2__)
+        const __m128i cnl = _mm_set1_epi8('\n');
+        const __m128i cdot = _mm_set1_epi8('.');
+
+        *nl = 0;
+        *sep = 0;
+        *dot = 0;
+        for (int i = 0; i < 64; i += 16)
+        {
+                __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+                __m128i s;
+
+                s = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+                s = _mm_or_si128(s, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+                s = _mm_or_si128(s, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+                s = _mm_or_si128(s, _mm_cmpeq_epi8(v, _mm_set1_epi8('^')));
+                s = _mm_or_si128(s, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+                s = _mm_or_si128(s, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+                s = _mm_or_si128(s, _mm_cmpeq_epi8(v, _mm_set1_epi8('*')));
+                *nl |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, cnl)) << i;
+                *sep |= (uint64_t)(uint16_t)_mm_movemask_epi8(s) << i;
+                *dot |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, cdot)) << i;
+        }
+#else
+        *nl = 0;
+        *sep = 0;
+        *dot = 0;
+        for (int i = 0; i < 64; i++)
+        {
+                unsigned char k = bhd_bl_class[p[i]];
+
+                *nl |= (uint64_t)(k & BHD_BL_C_NL) << i;
+                *sep |= (uint64_t)((k & BHD_BL_C_SEP) >> 1) << i;
+                *dot |= (uint64_t)((k & BHD_BL_C_DOT) >> 2) << i;
+        }
+#endif
+}
+
+static size_t bhd_bl_next(const uint64_t* m, size_t from, size_t to)
+{
+        size_t i = from / 64;
+        uint64_t bits = m[i] & (~0ULL << (from % 64));
+
+        while (!bits)
+        {
+                if (++i * 64 >= to)
+                {
+                        return to;
+                }
+                bits = m[i];
+        }
+        from = i * 64 + bhd_bl_ctz(bits);
+
+        return from < to ? from : to;
+}
+
+static int bhd_bl_is_addr(const char* p, size_t len)
+{
+        int colon = 0;
+        int alpha = 0;
+
+        for (size_t i = 0; i < len; i++)
+        {
+                unsigned char ch = (unsigned char)p[i];
+
+                if (ch == ':')
+                {
+                        colon = 1;
+                }
+                else if (isalpha(ch))
+                {
+                        if (!isxdigit(ch))
+                        {
+                                return 0;
+                        }
+                        alpha = 1;
+                }
+                else if (!isdigit(ch) && ch != '.')
+                {
+                        return 0;
+                }
+        }
+
+        /* IPv4 is digits and dots, IPv6 has colons */
+        return len > 0 && (colon || !alpha);
+}
+
+static int bhd_bl_blank(char ch)
+{
+        return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+static unsigned int bhd_bl_ctz(uint64_t x)
+{
+#if defined(__GNUC__)
+        return (unsigned int)__builtin_ctzll(x);
+#else
+        unsigned int n = 0;
+
+        while (!(x & 1))
+        {
+                x >>= 1;
+                n++;
+        }
+        return n;
+#endif
+}
+
+static void* bhd_bl_build_shard(void* arg)
+{
+        struct bhd_bl_shard* sh = arg;
+
+        if (bhd_bl_build_init(&sh->b))
+        {
+                sh->err = 1;
+                return NULL;
+        }
+
+        /* Chunks are taken in order, so the entries are added in the
+           order of the file */
+        for (int i = 0; i < sh->nchunks && !sh->err; i++)
+        {
+                const struct bhd_bl_buf* buf = &sh->chunks[i].out[sh->idx];
+                size_t off = 0;
+
+                while (off < buf->len)
+                {
+                        const char* labels[BHD_BL_MAX_LABELS];
+                        size_t lens[BHD_BL_MAX_LABELS];
+                        int n = 0;
+                        int ret;
+
+                        while (buf->buf[off])
+                        {
+                                labels[n] = (const char*)buf->buf + off + 1;
+                                lens[n] = buf->buf[off];
+                                off += lens[n] + 1;
+                                n++;
+                        }
+                        off++;
+                        ret = bhd_bl_add(&sh->b, labels, lens, n);
+                        if (ret < 0)
+                        {
+                                sh->err = 1;
+                                break;
+                        }
+                        if (ret)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid label in block list entry");
+                        }
+                }
+        }
+
+        return NULL;
+}
+
+static int bhd_bl_merge(struct bhd_bl_build* b,
+                        const struct bhd_bl_shard* shards,
+                        int n)
+{
+        uint32_t* tlds;
+        uint32_t* remap;
+        size_t nnodes = 1;
+        size_t npool = 0;
+        size_t maxnodes = 0;
+        size_t cap = 2;
+
+        for (int s = 0; s < n; s++)
+        {
+                nnodes += shards[s].b.nnodes - 1;
+                npool += shards[s].b.npool;
+                cap += 2 * shards[s].b.nodes[0].nchild;
+                if (shards[s].b.nnodes > maxnodes)
+                {
+                        maxnodes = shards[s].b.nnodes;
+                }
+        }
+        if (nnodes > UINT32_MAX - 1 || npool > UINT32_MAX - 1)
+        {
+                return -1;
+        }
+        /* The TLDs by label, as node + 1 */
+        cap = (size_t)bhd_bl_nslots((uint32_t)cap);
+
+        memset(b, 0, sizeof(*b));
+        b->nodes = malloc(nnodes * sizeof(struct bhd_bl_bnode));
+        b->pool = malloc(npool);
+        tlds = calloc(cap, sizeof(uint32_t));
+        remap = malloc(maxnodes * sizeof(uint32_t));
+        if (!b->nodes || !b->pool || !tlds || !remap)
+        {
+                bhd_bl_build_free(b);
+                free(tlds);
+                free(remap);
+                return -1;
+        }
+        b->capnodes = nnodes;
+        b->cappool = npool;
+        memset(&b->nodes[0], 0, sizeof(struct bhd_bl_bnode));
+        b->nodes[0].name = BHD_BL_ROOT;
+        b->nnodes = 1;
+
+        for (int s = 0; s < n; s++)
+        {
+                const struct bhd_bl_build* sb = &shards[s].b;
+                uint32_t base = (uint32_t)b->npool;
+
+                memcpy(b->pool + b->npool, sb->pool, sb->npool);
+                b->npool += sb->npool;
+
+                /* A parent is always added before its children */
+                remap[0] = 0;
+                for (size_t i = 1; i < sb->nnodes; i++)
+                {
+                        const struct bhd_bl_bnode* o = &sb->nodes[i];
+                        struct bhd_bl_bnode* d;
+
+                        if (o->parent == 0)
+                        {
+                                const unsigned char* l = sb->pool + o->label;
+                                size_t j = o->hash & (cap - 1);
+
+                                for (; tlds[j]; j = (j + 1) & (cap - 1))
+                                {
+                                        d = &b->nodes[tlds[j] - 1];
+                                        if (d->hash == o->hash &&
+                                            memcmp(b->pool + d->label,
+                                                   l,
+                                                   (size_t)l[0] + 1) == 0)
+                                        {
+                                                break;
+                                        }
+                                }
+                                if (tlds[j])
+                                {
+                                        remap[i] = tlds[j] - 1;
+                                        b->nodes[remap[i]].term |= o->term;
+                                        continue;
+                                }
+                                tlds[j] = (uint32_t)b->nnodes + 1;
+                        }
+
+                        d = &b->nodes[b->nnodes];
+                        *d = *o;
+                        d->label += base;
+                        d->parent = remap[o->parent];
+                        d->nchild = 0;
+                        b->nodes[d->parent].nchild++;
+                        remap[i] = (uint32_t)b->nnodes++;
+                }
+        }
+        free(tlds);
+        free(remap);
+
+        return 0;
+}
+
+static int bhd_bl_buf_put(struct bhd_bl_buf* buf, const void* p, size_t len)
+{
+        if (buf->len + len > buf->cap)
+        {
+                size_t cap = buf->cap ? buf->cap * 2 : BHD_BL_INIT_CAP;
+                unsigned char* tmp;
+
+                while (cap < buf->len + len)
+                {
+                        cap *= 2;
+                }
+                tmp = realloc(buf->buf, cap);
+                if (!tmp)
+                {
+                        return -1;
+                }
+                buf->buf = tmp;
+                buf->cap = cap;
+        }
+        memcpy(buf->buf + buf->len, p, len);
+        buf->len += len;
+
+        return 0;
+}
+
+static int bhd_bl_build_init(struct bhd_bl_build* b)
+{
+        memset(b, 0, sizeof(*b));
+        b->capnodes = BHD_BL_INIT_CAP;
+        b->capedges = BHD_BL_INIT_CAP;
+        b->cappool = BHD_BL_INIT_CAP;
+        b->caplabels = BHD_BL_INIT_CAP;
+        b->nodes = malloc(b->capnodes * sizeof(struct bhd_bl_bnode));
+        b->edges = calloc(b->capedges, sizeof(struct bhd_bl_edge));
+        b->pool = malloc(b->cappool);
+        b->labels = calloc(b->caplabels, sizeof(uint32_t));
+        if (!b->nodes || !b->edges || !b->pool || !b->labels)
+        {
+                bhd_bl_build_free(b);
+                return -1;
+        }
+
+        /* The root has an empty label at offset 0 */
+        b->pool[0] = 0;
+        b->npool = 1;
+        memset(&b->nodes[0], 0, sizeof(struct bhd_bl_bnode));
+        b->nodes[0].name = BHD_BL_ROOT;
+        b->nnodes = 1;
+
+        return 0;
+}
+
+static void bhd_bl_build_free(struct bhd_bl_build* b)
+{
+        free(b->nodes);
+        free(b->edges);
+        free(b->pool);
+        free(b->labels);
+}
+
+static int bhd_bl_add(struct bhd_bl_build* b,
+                      const char** labels,
+                      const size_t* lens,
+                      int n)
+{
+        uint32_t node = 0;
+
+        /* A truncated label would block another name */
+        for (int i = 0; i < n; i++)
+        {
+                if (lens[i] == 0 || lens[i] > BHD_DNS_MAX_LABEL)
+                {
+                        return 1;
+                }
+        }
+
+        while (n--)
+        {
+                const unsigned char* l = (const unsigned char*)labels[n];
+                size_t len = lens[n];
+                long child;
+
+                if (b->nodes[node].term)
+                {
+                        /* A parent domain is already blocked */
+                        return 0;
+                }
+                child = bhd_bl_add_child(b, node, l, len, bhd_bl_hash(l, len));
+                if (child < 0)
+                {
+                        return -1;
+                }
+                node = (uint32_t)child;
+        }
+        b->nodes[node].term = 1;
+
+        return 0;
+}
+
+static long bhd_bl_add_child(struct bhd_bl_build* b,
+                             uint32_t parent,
+                             const unsigned char* label,
+                             size_t len,
+                             uint32_t hash)
+{
+        struct bhd_bl_edge* e;
+        size_t mask;
+        size_t i;
+        long off;
+
+        off = bhd_bl_intern(b, label, len, hash);
+        if (off < 0)
+        {
+                return -1;
+        }
+
+        /* Keep the edge table at most half full */
+        if (b->nnodes * 2 >= b->capedges)
+        {
+                size_t cap = b->capedges * 2;
+                struct bhd_bl_edge* edges;
+
+                edges = calloc(cap, sizeof(struct bhd_bl_edge));
+                if (!edges)
+                {
+                        return -1;
+                }
+                for (size_t j = 0; j < b->capedges; j++)
+                {
+                        struct bhd_bl_edge* o = &b->edges[j];
+
+                        if (o->child == 0)
+                        {
+                                continue;
+                        }
+                        i = bhd_bl_edge_hash(o->parent, o->label) & (cap - 1);
+                        while (edges[i].child)
+                        {
+                                i = (i + 1) & (cap - 1);
+                        }
+                        edges[i] = *o;
+                }
+                free(b->edges);
+                b->edges = edges;
+                b->capedges = cap;
+        }
+
+        mask = b->capedges - 1;
+        i = bhd_bl_edge_hash(parent, (uint32_t)off) & mask;
+        for (e = &b->edges[i]; e->child; e = &b->edges[i])
+        {
+                if (e->parent == parent && e->label == (uint32_t)off)
+                {
+                        return (long)e->child - 1;
+                }
+                i = (i + 1) & mask;
+        }
+
+        if (b->nnodes == b->capnodes)
+        {
+                size_t cap = b->capnodes * 2;
+                struct bhd_bl_bnode* nodes;
+
+                if (cap > UINT32_MAX - 1)
+                {
+                        return -1;
+                }
+                nodes = realloc(b->nodes, cap * sizeof(struct bhd_bl_bnode));
+                if (!nodes)
+                {
+                        return -1;
+                }
+                b->nodes = nodes;
+                b->capnodes = cap;
+        }
+
+        e->parent = parent;
+        e->label = (uint32_t)off;
+        e->child = (uint32_t)b->nnodes + 1;
+        b->nodes[b->nnodes].name = bhd_bl_name_hash(b->nodes[parent].name,
+                                                    hash);
+        b->nodes[b->nnodes].parent = parent;
+        b->nodes[b->nnodes].label = (uint32_t)off;
+        b->nodes[b->nnodes].hash = hash;
+        b->nodes[b->nnodes].nchild = 0;
+        b->nodes[b->nnodes].term = 0;
+        b->nodes[parent].nchild++;
+
+        return (long)b->nnodes++;
+}
+
+static long bhd_bl_intern(struct bhd_bl_build* b,
+                          const unsigned char* label,
+                          size_t len,
+                          uint32_t hash)
+{
+        size_t mask;
+        size_t i;
+
+        /* Keep the label table at most half full */
+        if (b->nlabels * 2 >= b->caplabels)
+        {
+                size_t cap = b->caplabels * 2;
+                uint32_t* labels = calloc(cap, sizeof(uint32_t));
+
+                if (!labels)
+                {
+                        return -1;
+                }
+                for (size_t j = 0; j < b->caplabels; j++)
+                {
+                        const unsigned char* l;
+
+                        if (b->labels[j] == 0)
+                        {
+                                continue;
+                        }
+                        l = b->pool + b->labels[j] - 1;
+                        i = bhd_bl_hash(l + 1, l[0]) & (cap - 1);
+                        while (labels[i])
+                        {
+                                i = (i + 1) & (cap - 1);
+                        }
+                        labels[i] = b->labels[j];
+                }
+                free(b->labels);
+                b->labels = labels;
+                b->caplabels = cap;
+        }
+
+        mask = b->caplabels - 1;
+        for (i = hash & mask; b->labels[i]; i = (i + 1) & mask)
+        {
+                const unsigned char* l = b->pool + b->labels[i] - 1;
+                size_t j = 0;
+
+                if (l[0] != len)
+                {
+                        continue;
+                }
+                while (j < len && l[j + 1] == bhd_bl_lower(label[j]))
+                {
+                        j++;
+                }
+                if (j == len)
+                {
+                        return (long)b->labels[i] - 1;
+                }
+        }
+
+        if (b->npool + len + 1 > b->cappool)
+        {
+                size_t cap = b->cappool * 2;
+                unsigned char* pool;
+
+                if (cap > UINT32_MAX - 1)
+                {
+                        return -1;
+                }
+                pool = realloc(b->pool, cap);
+                if (!pool)
+                {
+                        return -1;
+                }
+                b->pool = pool;
+                b->cappool = cap;
+        }
+
+        b->pool[b->npool] = (unsigned char)len;
+        for (size_t j = 0; j < len; j++)
+        {
+                b->pool[b->npool + 1 + j] = bhd_bl_lower(label[j]);
+        }
+        b->labels[i] = (uint32_t)b->npool + 1;
+        b->nlabels++;
+        b->npool += len + 1;
+
+        return (long)b->labels[i] - 1;
+}
+
+static int bhd_bl_freeze(struct bhd_bl* bl, const struct bhd_bl_build* b)
+{
+        uint64_t* filter;
+        struct bhd_bl_node* nodes;
+        struct bhd_bl_slot* slots;
+        unsigned char* pool;
+        size_t nslots = 0;
+        size_t nfilter = (b->nnodes * BHD_BL_FILTER_BITS + 511) / 512;
+
+        for (size_t i = 0; i < b->nnodes; i++)
+        {
+                nslots += bhd_bl_nslots(b->nodes[i].nchild);
+        }
+        if (nslots > UINT32_MAX || nfilter > UINT32_MAX)
+        {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        bl->size = nfilter * BHD_BL_BLOCK * sizeof(uint64_t) +
+                b->nnodes * sizeof(struct bhd_bl_node) +
+                nslots * sizeof(struct bhd_bl_slot) +
+                b->npool;
+        /* Align the filter blocks to cache lines */
+        if (posix_memalign(&bl->arena, 64, bl->size))
+        {
+                errno = ENOMEM;
+                return -1;
+        }
+        filter = bl->arena;
+        nodes = (struct bhd_bl_node*)(filter + nfilter * BHD_BL_BLOCK);
+        slots = (struct bhd_bl_slot*)(nodes + b->nnodes);
+        pool = (unsigned char*)(slots + nslots);
+        memset(filter, 0, nfilter * BHD_BL_BLOCK * sizeof(uint64_t));
+        memset(slots, 0, nslots * sizeof(struct bhd_bl_slot));
+        memcpy(pool, b->pool, b->npool);
+
+        nslots = 0;
+        for (size_t i = 0; i < b->nnodes; i++)
+        {
+                uint32_t s = bhd_bl_nslots(b->nodes[i].nchild);
+
+                nodes[i].label = b->nodes[i].label;
+                nodes[i].slots = (uint32_t)nslots;
+                nodes[i].nslots = s;
+                nodes[i].term = b->nodes[i].term;
+                nslots += s;
+                bhd_bl_filter_add(filter, (uint32_t)nfilter, b->nodes[i].name);
+        }
+
+        /* Put each node in the children table of its parent */
+        for (size_t i = 1; i < b->nnodes; i++)
+        {
+                const struct bhd_bl_node* p = &nodes[b->nodes[i].parent];
+                uint32_t hash = b->nodes[i].hash;
+                uint32_t mask = p->nslots - 1;
+                uint32_t j;
+
+                for (j = hash & mask; slots[p->slots + j].node; j = (j + 1) & mask);
+                slots[p->slots + j].hash = hash;
+                slots[p->slots + j].node = (uint32_t)i + 1;
+        }
+
+        bl->filter = filter;
+        bl->nodes = nodes;
+        bl->slots = slots;
+        bl->pool = pool;
+        bl->nfilter = (uint32_t)nfilter;
+        bl->fpr = bhd_bl_filter_fpr(filter, bl->nfilter);
+        bl->npool = b->npool;
+        bl->map = NULL;
+        bl->maplen = 0;
+        bl->nnodes = (uint32_t)b->nnodes;
+        bl->nslots = (uint32_t)nslots;
+
+        return 0;
+}
+
+static int bhd_bl_walk(const struct bhd_bl* bl,
+                       const unsigned char** labels,
+                       const size_t* lens,
+                       const uint32_t* hashes,
+                       int n)
+{
+        const struct bhd_bl_node* node = bl->nodes;
+        uint64_t name = BHD_BL_ROOT;
+        int top = 1;
+
+        if (bl->engine == BHD_BL_HASH)
+        {
+                /* Look up the name and each of its parent domains. The
+                   32 bit label hashes collide too often to tell names
+                   apart, a 64 bit hash is used. */
+                while (n--)
+                {
+                        name = bhd_bl_name_hash(name,
+                                                bhd_bl_hash64(labels[n],
+                                                              lens[n]));
+                        if (bl->names[bhd_bl_hash_slot(bl, name)] == name)
+                        {
+                                return 1;
+                        }
+                }
+                return 0;
+        }
+
+        while (n--)
+        {
+                uint32_t child;
+
+                if (node->nslots == 0)
+                {
+                        return 0;
+                }
+                name = bhd_bl_name_hash(name, hashes[n]);
+                /* The TLDs are few and their table stays in cache.
+                   Below them, a name that is not in the filter is not
+                   in the trie. */
+                if (!top && !bhd_bl_filter_has(bl->filter, bl->nfilter, name))
+                {
+                        return 0;
+                }
+                top = 0;
+                child = bhd_bl_child(bl, node, labels[n], lens[n], hashes[n]);
+                if (child == 0)
+                {
+                        return 0;
+                }
+                node = &bl->nodes[child - 1];
+                if (node->term)
+                {
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+static int bhd_bl_lookup_next(const struct bhd_bl* bl,
+                              struct bhd_bl_lookup* l,
+                              const unsigned char* const* names,
+                              const size_t* lens,
+                              int* verdicts,
+                              size_t n,
+                              size_t* next)
+{
+        while (*next < n)
+        {
+                const unsigned char* name = names[*next];
+                size_t len = lens[*next];
+                size_t off = 0;
+                int valid = 1;
+
+                l->idx = (*next)++;
+                l->n = 0;
+                /* As in bhd_bl_match_name */
+                for (;;)
+                {
+                        size_t ll;
+
+                        if (off >= len || off > BHD_DNS_MAX_NAME)
+                        {
+                                valid = 0;
+                                break;
+                        }
+                        ll = name[off];
+                        if (ll == 0)
+                        {
+                                break;
+                        }
+                        if (ll > BHD_DNS_MAX_LABEL ||
+                            off + 1 + ll > len ||
+                            l->n == BHD_BL_MAX_LABELS)
+                        {
+                                valid = 0;
+                                break;
+                        }
+                        l->offs[l->n++] = (uint8_t)off;
+                        off += ll + 1;
+                }
+                if (!valid)
+                {
+                        verdicts[l->idx] = 0;
+                        continue;
+                }
+
+                l->name = name;
+                l->node = bl->nodes;
+                l->hash = BHD_BL_ROOT;
+                l->stage = 0;
+
+                return 1;
+        }
+        l->name = NULL;
+
+        return 0;
+}
+
+static int bhd_bl_lookup_step(const struct bhd_bl* bl,
+                              struct bhd_bl_lookup* l)
+{
+        const struct bhd_bl_slot* slots;
+        const unsigned char* label;
+        const unsigned char* pooled;
+        uint32_t child;
+        uint32_t mask;
+        uint32_t i;
+
+        if (bl->engine == BHD_BL_HASH)
+        {
+                switch (l->stage)
+                {
+                case 1:
+                        /* The seed of the bucket is read */
+                        l->slot = bhd_bl_hash_slot(bl, l->hash);
+                        BHD_BL_PREFETCH(&bl->names[l->slot]);
+                        l->stage = 2;
+                        return -1;
+                case 2:
+                        if (bl->names[l->slot] == l->hash)
+                        {
+                                return 1;
+                        }
+                        /* fall through */
+                default:
+                        /* Hash the next parent domain */
+                        if (l->n == 0)
+                        {
+                                return 0;
+                        }
+                        label = l->name + l->offs[--l->n];
+                        l->hash = bhd_bl_name_hash(l->hash,
+                                                   bhd_bl_hash64(label + 1,
+                                                                 label[0]));
+                        BHD_BL_PREFETCH(&bl->seeds[(l->hash >> 32) *
+                                                   bl->nbuckets >> 32]);
+                        l->stage = 1;
+                        return -1;
+                }
+        }
+
+        switch (l->stage)
+        {
+        case 1:
+                /* The children table and the filter block are read. The
+                   first child with the label's hash is most likely the
+                   one, its node is prefetched. */
+                if (l->node != bl->nodes &&
+                    !bhd_bl_filter_has(bl->filter, bl->nfilter, l->hash))
+                {
+                        return 0;
+                }
+                slots = bl->slots + l->node->slots;
+                mask = l->node->nslots - 1;
+                for (i = l->label & mask; slots[i].node; i = (i + 1) & mask)
+                {
+                        if (slots[i].hash == l->label)
+                        {
+                                break;
+                        }
+                }
+                if (slots[i].node == 0)
+                {
+                        return 0;
+                }
+                l->slot = slots[i].node;
+                BHD_BL_PREFETCH(&bl->nodes[l->slot - 1]);
+                l->stage = 2;
+                return -1;
+        case 2:
+                /* The child is read, its label is prefetched */
+                BHD_BL_PREFETCH(bl->pool + bl->nodes[l->slot - 1].label);
+                l->stage = 3;
+                return -1;
+        case 3:
+                /* The child's label is read and compared. On a hash
+                   collision the children table is searched again. */
+                label = l->name + l->offs[l->n];
+                child = l->slot;
+                pooled = bl->pool + bl->nodes[child - 1].label;
+                if (pooled[0] != label[0] ||
+                    !bhd_bl_label_eq(pooled + 1, label + 1, label[0]))
+                {
+                        child = bhd_bl_child(bl,
+                                             l->node,
+                                             label + 1,
+                                             label[0],
+                                             l->label);
+                        if (child == 0)
+                        {
+                                return 0;
+                        }
+                }
+                l->node = &bl->nodes[child - 1];
+                /* fall through */
+        default:
+                /* The node is read, its children table and the filter
+                   block of the next name are prefetched */
+                if (l->node->term)
+                {
+                        return 1;
+                }
+                if (l->n == 0 || l->node->nslots == 0)
+                {
+                        return 0;
+                }
+                label = l->name + l->offs[--l->n];
+                l->label = bhd_bl_hash(label + 1, label[0]);
+                l->hash = bhd_bl_name_hash(l->hash, l->label);
+                /* As in bhd_bl_walk, TLDs are not looked up in the
+                   filter */
+                if (l->node != bl->nodes)
+                {
+                        BHD_BL_PREFETCH(bl->filter +
+                                        ((l->hash >> 32) * bl->nfilter >> 32) *
+                                        BHD_BL_BLOCK);
+                }
+                BHD_BL_PREFETCH(&bl->slots[l->node->slots +
+                                           (l->label &
+                                            (l->node->nslots - 1))]);
+                l->stage = 1;
+                return -1;
+        }
+}
+
+static int bhd_bl_hash_build(struct bhd_bl* bl)
+{
+        struct timing t;
+        uint64_t* keys;
+        uint64_t* sorted;
+        uint32_t* stack;
+        uint64_t* hstack;
+        uint32_t* start;
+        uint8_t* taken;
+        size_t nkeys = 0;
+        size_t nstack = 0;
+        int ret = -1;
+
+        timing_start(&t);
+        keys = malloc(bl->nnodes * sizeof(uint64_t));
+        stack = malloc(bl->nnodes * sizeof(uint32_t));
+        hstack = malloc(bl->nnodes * sizeof(uint64_t));
+        if (!keys || !stack || !hstack)
+        {
+                free(keys);
+                free(stack);
+                free(hstack);
+                return -1;
+        }
+
+        /* Collect the hashes of the blocked names. Names below a
+           blocked name are never looked up. */
+        stack[nstack] = 0;
+        hstack[nstack++] = BHD_BL_ROOT;
+        while (nstack)
+        {
+                const struct bhd_bl_node* node = &bl->nodes[stack[--nstack]];
+                uint64_t name = hstack[nstack];
+
+                for (uint32_t i = 0; i < node->nslots; i++)
+                {
+                        const struct bhd_bl_slot* sl = &bl->slots[node->slots + i];
+                        const unsigned char* label;
+                        uint64_t h;
+
+                        if (sl->node == 0)
+                        {
+                                continue;
+                        }
+                        label = bl->pool + bl->nodes[sl->node - 1].label;
+                        h = bhd_bl_name_hash(name,
+                                             bhd_bl_hash64(label + 1,
+                                                           label[0]));
+                        if (bl->nodes[sl->node - 1].term)
+                        {
+                                keys[nkeys++] = h;
+                        }
+                        else
+                        {
+                                stack[nstack] = sl->node - 1;
+                                hstack[nstack++] = h;
+                        }
+                }
+        }
+        free(stack);
+        free(hstack);
+
+        bl->nbuckets = (uint32_t)(nkeys / BHD_BL_BUCKET + 1);
+        bl->nnames = (uint32_t)(nkeys * 100 / BHD_BL_LOAD + 1);
+        bl->seeds = calloc(bl->nbuckets, sizeof(uint16_t));
+        bl->names = calloc(bl->nnames, sizeof(uint64_t));
+        sorted = malloc((nkeys + 1) * sizeof(uint64_t));
+        start = calloc(bl->nbuckets, sizeof(uint32_t));
+        taken = malloc(bl->nnames);
+        if (!bl->seeds || !bl->names || !sorted || !start || !taken)
+        {
+                goto done;
+        }
+
+        /* Sort the names by bucket, start[b] ends as the end of
+           bucket b */
+        for (size_t i = 0; i < nkeys; i++)
+        {
+                start[(keys[i] >> 32) * bl->nbuckets >> 32]++;
+        }
+        for (uint32_t b = 0, sum = 0; b < bl->nbuckets; b++)
+        {
+                uint32_t c = start[b];
+
+                start[b] = sum;
+                sum += c;
+        }
+        for (size_t i = 0; i < nkeys; i++)
+        {
+                uint32_t b = (uint32_t)((keys[i] >> 32) * bl->nbuckets >> 32);
+
+                sorted[start[b]++] = keys[i];
+        }
+
+        if (bhd_bl_hash_place(bl, sorted, start, taken))
+        {
+                errno = EAGAIN;
+                goto done;
+        }
+
+        /* Release the trie */
+        if (bl->map)
+        {
+                munmap(bl->map, bl->maplen);
+                bl->map = NULL;
+        }
+        else
+        {
+                free(bl->arena);
+        }
+        bl->arena = NULL;
+        bl->nodes = NULL;
+        bl->slots = NULL;
+        bl->pool = NULL;
+        bl->filter = NULL;
+        bl->engine = BHD_BL_HASH;
+        ret = 0;
+
+        syslog(LOG_DEBUG,
+               "hashed %zu names in %ldms, %zu KiB",
+               nkeys,
+               timing_dur_msec(&t),
+               ((size_t)bl->nnames * sizeof(uint64_t) +
+                (size_t)bl->nbuckets * sizeof(uint16_t)) / 1024);
+done:
+        free(keys);
+        free(sorted);
+        free(start);
+        free(taken);
+
+        return ret;
+}
+
+static int bhd_bl_hash_place(struct bhd_bl* bl,
+                             const uint64_t* keys,
+                             const uint32_t* start,
+                             uint8_t* taken)
+{
+        uint32_t* order;
+        uint32_t* slots;
+        uint32_t maxlen = 0;
+        uint32_t norder = 0;
+        int ret = 0;
+
+        /* Place the largest buckets first, while most slots are free.
+           start[b] is the end of bucket b, and the start of bucket b+1. */
+        for (uint32_t b = 0; b < bl->nbuckets; b++)
+        {
+                uint32_t len = start[b] - (b ? start[b - 1] : 0);
+
+                if (len > maxlen)
+                {
+                        maxlen = len;
+                }
+        }
+        order = malloc(bl->nbuckets * sizeof(uint32_t));
+        slots = malloc((maxlen + 1) * sizeof(uint32_t));
+        if (!order || !slots)
+        {
+                free(order);
+                free(slots);
+                return -1;
+        }
+        for (uint32_t len = maxlen; len > 0; len--)
+        {
+                for (uint32_t b = 0; b < bl->nbuckets; b++)
+                {
+                        if (start[b] - (b ? start[b - 1] : 0) == len)
+                        {
+                                order[norder++] = b;
+                        }
+                }
+        }
+
+        memset(taken, 0, bl->nnames);
+        for (uint32_t i = 0; i < norder; i++)
+        {
+                uint32_t b = order[i];
+                uint32_t first = b ? start[b - 1] : 0;
+                uint32_t len = start[b] - first;
+                uint32_t seed;
+
+                for (seed = 0; seed <= BHD_BL_MAX_SEED; seed++)
+                {
+                        uint32_t j;
+
+                        bl->seeds[b] = (uint16_t)seed;
+                        for (j = 0; j < len; j++)
+                        {
+                                uint32_t sl = bhd_bl_hash_slot(bl,
+                                                               keys[first + j]);
+
+                                if (taken[sl])
+                                {
+                                        break;
+                                }
+                                /* Names in a bucket may collide too */
+                                taken[sl] = 1;
+                                slots[j] = sl;
+                        }
+                        if (j == len)
+                        {
+                                break;
+                        }
+                        while (j--)
+                        {
+                                taken[slots[j]] = 0;
+                        }
+                }
+                if (seed > BHD_BL_MAX_SEED)
+                {
+                        ret = -1;
+                        break;
+                }
+                for (uint32_t j = 0; j < len; j++)
+                {
+                        bl->names[slots[j]] = keys[first + j];
+                }
+        }
+
+        free(order);
+        free(slots);
+
+        return ret;
+}
+
+static uint32_t bhd_bl_hash_slot(const struct bhd_bl* bl, uint64_t name)
+{
+        uint32_t b = (uint32_t)((name >> 32) * bl->nbuckets >> 32);
+        uint64_t h = bhd_bl_mix(name + bl->seeds[b] * 0x9e3779b97f4a7c15ULL);
+
+        return (uint32_t)(((h >> 32) * bl->nnames) >> 32);
+}
+
+static uint32_t bhd_bl_nslots(uint32_t nchild)
+{
+        uint32_t want = nchild + nchild / 2 + 1;
+        uint32_t s = 2;
+
+        if (nchild == 0)
+        {
+                return 0;
+        }
+        while (s < want)
+        {
+                s *= 2;
+        }
+
+        return s;
+}
+
+static struct bhd_bl* bhd_bl_map(const char* p)
+{
+        struct bhd_bl_image img;
+        struct stat st;
+        struct bhd_bl* bl;
+        unsigned char* map;
+        size_t size;
+        int fd;
+
+        fd = open(p, O_RDONLY);
+        if (fd < 0)
+        {
+                syslog(LOG_ERR, "%s:open '%s': %m", __func__, p);
+                return NULL;
+        }
+        if (fstat(fd, &st))
+        {
+                syslog(LOG_ERR, "%s:fstat '%s': %m", __func__, p);
+                close(fd);
+                return NULL;
+        }
+        if ((size_t)st.st_size < sizeof(img))
+        {
+                syslog(LOG_ERR, "Truncated block list image '%s'", p);
+                close(fd);
+                return NULL;
+        }
+        /* Shared, so processes mapping the same image share pages */
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+        {
+                syslog(LOG_ERR, "%s:mmap '%s': %m", __func__, p);
+                return NULL;
+        }
+
+        memcpy(&img, map, sizeof(img));
+        size = (size_t)img.nfilter * BHD_BL_BLOCK * sizeof(uint64_t) +
+                (size_t)img.nnodes * sizeof(struct bhd_bl_node) +
+                (size_t)img.nslots * sizeof(struct bhd_bl_slot) +
+                img.npool;
+        if (img.version != BHD_BL_VERSION || img.bom != BHD_BL_BOM)
+        {
+                syslog(LOG_ERR,
+                       "Block list image '%s' has version %u, byte order "
+                       "%08x, expected %u and %08x",
+                       p,
+                       img.version,
+                       img.bom,
+                       BHD_BL_VERSION,
+                       BHD_BL_BOM);
+                goto bailout;
+        }
+        if (img.nnodes == 0 ||
+            img.npool == 0 ||
+            img.nfilter == 0 ||
+            sizeof(img) + size != (size_t)st.st_size)
+        {
+                syslog(LOG_ERR, "Invalid size of block list image '%s'", p);
+                goto bailout;
+        }
+        if (bhd_bl_sum(map + sizeof(img), size) != img.sum)
+        {
+                syslog(LOG_ERR, "Checksum mismatch in block list image '%s'",
+                       p);
+                goto bailout;
+        }
+
+        bl = malloc(sizeof(struct bhd_bl));
+        if (!bl)
+        {
+                syslog(LOG_ERR, "%s:malloc: %m", __func__);
+                goto bailout;
+        }
+        bl->map = map;
+        bl->maplen = (size_t)st.st_size;
+        bl->arena = map + sizeof(img);
+        bl->size = size;
+        bl->npool = img.npool;
+        bl->nnodes = img.nnodes;
+        bl->nslots = img.nslots;
+        bl->count = img.count;
+        bl->nfilter = img.nfilter;
+        bl->filter = bl->arena;
+        bl->nodes = (const struct bhd_bl_node*)(bl->filter +
+                                                (size_t)img.nfilter *
+                                                BHD_BL_BLOCK);
+        bl->fpr = bhd_bl_filter_fpr(bl->filter, bl->nfilter);
+        bl->slots = (const struct bhd_bl_slot*)(bl->nodes + img.nnodes);
+        bl->pool = (const unsigned char*)(bl->slots + img.nslots);
+
+        return bl;
+bailout:
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+}
+
+static uint64_t bhd_bl_sum(const unsigned char* buf, size_t len)
+{
+        uint64_t sum = 14695981039346656037ULL;
+        size_t i = 0;
+
+        for (; i + 8 <= len; i += 8)
+        {
+                uint64_t w;
+
+                memcpy(&w, buf + i, 8);
+                sum ^= w;
+                sum *= 1099511628211ULL;
+        }
+        for (; i < len; i++)
+        {
+                sum ^= buf[i];
+                sum *= 1099511628211ULL;
+        }
+
+        return sum;
+}
+
+static uint32_t bhd_bl_child(const struct bhd_bl* bl,
+                             const struct bhd_bl_node* node,
+                             const unsigned char* label,
+                             size_t len,
+                             uint32_t hash)
+{
+        const struct bhd_bl_slot* slots = bl->slots + node->slots;
+        uint32_t mask = node->nslots - 1;
+
+        for (uint32_t i = hash & mask; slots[i].node; i = (i + 1) & mask)
+        {
+                const unsigned char* l;
+
+                if (slots[i].hash != hash)
+                {
+                        continue;
+                }
+                l = bl->pool + bl->nodes[slots[i].node - 1].label;
+                if (l[0] == len && bhd_bl_label_eq(l + 1, label, len))
+                {
+                        return slots[i].node;
                 }
         }
 
         return 0;
 }
+
+static int bhd_bl_label_eq(const unsigned char* pooled,
+                           const unsigned char* label,
+                           size_t len)
+{
+        size_t i = 0;
+
+        while (i < len && pooled[i] == bhd_bl_lower(label[i]))
+        {
+                i++;
+        }
+
+        return i == len;
+}
+
+static uint32_t bhd_bl_hash(const unsigned char* label, size_t len)
+{
+        uint32_t hash = 2166136261u;
+
+        for (size_t i = 0; i < len; i++)
+        {
+                hash ^= bhd_bl_lower(label[i]);
+                hash *= 16777619u;
+        }
+
+        return hash;
+}
+
+static uint32_t bhd_bl_edge_hash(uint32_t parent, uint32_t label)
+{
+        return (uint32_t)bhd_bl_mix(((uint64_t)parent << 32) | label);
+}
+
+static uint64_t bhd_bl_hash64(const unsigned char* label, size_t len)
+{
+        uint64_t hash = 14695981039346656037ULL;
+
+        for (size_t i = 0; i < len; i++)
+        {
+                hash ^= bhd_bl_lower(label[i]);
+                hash *= 1099511628211ULL;
+        }
+
+        return hash;
+}
+
+static uint64_t bhd_bl_name_hash(uint64_t parent, uint64_t label)
+{
+        return bhd_bl_mix(parent ^ (label * 0x9e3779b97f4a7c15ULL));
+}
+
+static void bhd_bl_filter_add(uint64_t* filter, uint32_t nfilter, uint64_t h)
+{
+        /* The block from the high bits, the bits in the block from
+           9 bit slices of a second hash */
+        uint64_t* block = filter + ((h >> 32) * nfilter >> 32) * BHD_BL_BLOCK;
+        uint64_t g = h * 0x9e3779b97f4a7c15ULL;
+
+        for (int i = 0; i < BHD_BL_FILTER_K; i++, g >>= 9)
+        {
+                block[(g >> 6) & 7] |= 1ULL << (g & 63);
+        }
+}
+
+static int bhd_bl_filter_has(const uint64_t* filter,
+                             uint32_t nfilter,
+                             uint64_t h)
+{
+        const uint64_t* block = filter +
+                ((h >> 32) * nfilter >> 32) * BHD_BL_BLOCK;
+        uint64_t g = h * 0x9e3779b97f4a7c15ULL;
+
+        for (int i = 0; i < BHD_BL_FILTER_K; i++, g >>= 9)
+        {
+                if (!(block[(g >> 6) & 7] & (1ULL << (g & 63))))
+                {
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
+static double bhd_bl_filter_fpr(const uint64_t* filter, uint32_t nfilter)
+{
+        size_t n = (size_t)nfilter * BHD_BL_BLOCK;
+        size_t set = 0;
+        double fpr = 1.0;
+        double fill;
+
+        for (size_t i = 0; i < n; i++)
+        {
+                uint64_t w = filter[i];
+
+                /* Count the set bits */
+                while (w)
+                {
+                        w &= w - 1;
+                        set++;
+                }
+        }
+        fill = (double)set / (double)(n * 64);
+        for (int i = 0; i < BHD_BL_FILTER_K; i++)
+        {
+                fpr *= fill;
+        }
+
+        return fpr;
+}
+
+static uint64_t bhd_bl_mix(uint64_t k)
+{
+        /* Finalizer of MurmurHash3 */
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+
+        return k;
+}
+
+static unsigned char bhd_bl_lower(unsigned char c)
+{
+        return c >= 'A' && c <= 'Z' ? (unsigned char)(c + ('a' - 'A')) : c;
+}
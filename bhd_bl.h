@@ -13,10 +13,44 @@
 #ifndef BHD_BL_H
 #define BHD_BL_H
 
+#include <stddef.h>
+
+/* Max threads used to parse a text block list */
+#define BHD_BL_MAX_THREADS 16
+
 struct bhd_bl;
 struct bhd_dns_q_label;
 
-struct bhd_bl* bhd_bl_create(const char*);
+enum bhd_bl_engine
+{
+        /* A trie of labels, walked from the TLD */
+        BHD_BL_TRIE = 0,
+        /* A perfect hash table of the blocked names, each parent domain
+           of a name is looked up */
+        BHD_BL_HASH = 1,
+};
+
+struct bhd_bl_info
+{
+        /* Number of entries */
+        size_t count;
+        /* Size of the block list and of its filter in bytes */
+        size_t size;
+        size_t filter;
+        /* Estimated false positive rate of the filter */
+        double fpr;
+};
+
+/**
+ * Create a block list from a file, with one domain per line. The file
+ * may also be an image written by bhd_bl_save, which is mapped read
+ * only.
+ * @param path to the file.
+ * @param engine used for lookups.
+ * @param threads used to parse a text file, 0 for one per online CPU.
+ * @return the block list, or NULL on error.
+ */
+struct bhd_bl* bhd_bl_create(const char*, enum bhd_bl_engine, int threads);
 
 /**
  * Match provided label against the block list.
@@ -27,11 +61,61 @@ struct bhd_bl* bhd_bl_create(const char*);
  * 2) whatever.bad.host.com is matched.
  * 3) I.e .*bad.host.com is matched
  * 4) ad.host.com is not matched.
+ * Labels are compared case insensitive.
  * @param block list.
  * @param pointer to a label as present in the DNS query.
  * @return 1 if the label is present as a host or part of a subdomain.
  */
-int bhd_bl_match(struct bhd_bl*, const struct bhd_dns_q_label*);
+int bhd_bl_match(const struct bhd_bl*, const struct bhd_dns_q_label*);
+
+/**
+ * Match a domain name in wire format against the block list, as
+ * bhd_bl_match. No memory is allocated.
+ * @param block list.
+ * @param the name as length prefixed labels ending with the root label,
+ *        e.g. as found in the question of a DNS query. A name with a
+ *        compression pointer is not matched.
+ * @param max number of bytes to read.
+ * @return 1 if the name is present as a host or part of a subdomain.
+ */
+int bhd_bl_match_name(const struct bhd_bl*, const unsigned char*, size_t);
+
+/**
+ * Match a batch of domain names in wire format against the block list,
+ * as bhd_bl_match_name. The lookups are interleaved, and the memory a
+ * lookup reads next is prefetched while the others proceed, so their
+ * cache misses overlap.
+ * @param block list.
+ * @param the names.
+ * @param max number of bytes to read of each name.
+ * @param set to 1 for each name that is blocked, 0 otherwise.
+ * @param number of names.
+ * @return the number of blocked names.
+ */
+int bhd_bl_match_batch(const struct bhd_bl*,
+                       const unsigned char* const* names,
+                       const size_t* lens,
+                       int* verdicts,
+                       size_t n);
+
+/**
+ * Save a block list as an image that can be mapped by bhd_bl_create.
+ * The image is written to a temporary file that is renamed to the
+ * provided path. Only a block list using the trie engine can be saved.
+ * @param block list.
+ * @param path of the image.
+ * @return 0 on success.
+ */
+int bhd_bl_save(const struct bhd_bl*, const char*);
+
+/**
+ * Get the size and filter properties of a block list.
+ * @param block list, may be NULL.
+ * @param struct to populate.
+ * @return void.
+ */
+void bhd_bl_info(const struct bhd_bl*, struct bhd_bl_info*);
+
 void bhd_bl_free(struct bhd_bl*);
 
 #endif /* BLD_BL_H */
@@ -0,0 +1,562 @@
+/*
+* Copyright (C) 2020 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+#include "bhd_cache.h"
+#include "bhd_dns.h"
+
+/* Max number of resource records in a cached response */
+#define MAX_RR 256
+/* Size of the key (question) of a cache entry */
+#define MAX_KEY (BHD_DNS_MAX_NAME + 4)
+
+struct bhd_cache_entry
+{
+        /* Next entry in hash bucket */
+        struct bhd_cache_entry* next;
+        /* Clock ring */
+        struct bhd_cache_entry* cnext;
+        struct bhd_cache_entry* cprev;
+        long added;
+        long expire;
+        uint32_t hash;
+        /* Hits since the entry was added */
+        uint16_t hits;
+        uint16_t qlen;
+        uint16_t len;
+        uint16_t nttl;
+        /* Referenced since the clock hand last passed */
+        uint8_t ref;
+        /* A prefetch is requested */
+        uint8_t prefetch;
+        /* Offsets of TTLs (uint16_t) followed by the response, where the
+           question is stored in lower case */
+        unsigned char data[];
+};
+
+struct bhd_cache
+{
+        struct bhd_cache_entry** buckets;
+        struct bhd_cache_entry* hand;
+        size_t nbuckets;
+        size_t max;
+        size_t used;
+        size_t count;
+        long stale;
+        unsigned int prefetch;
+};
+
+static uint32_t bhd_cache_hash(const unsigned char*, size_t);
+
+/**
+ * Copy the question to the key buffer, with the qname in lower case.
+ */
+static void bhd_cache_key(unsigned char*, const unsigned char*, size_t);
+
+static struct bhd_cache_entry* bhd_cache_find(struct bhd_cache*,
+                                              const unsigned char*,
+                                              size_t,
+                                              uint32_t);
+static void bhd_cache_remove(struct bhd_cache*, struct bhd_cache_entry*);
+
+/**
+ * Evict entries until need bytes can be added within the memory bound.
+ */
+static void bhd_cache_evict(struct bhd_cache*, size_t need, long now);
+
+static unsigned char* bhd_cache_resp(struct bhd_cache_entry*);
+
+/**
+ * Find the entry for the question of a query.
+ */
+static struct bhd_cache_entry* bhd_cache_lookup(struct bhd_cache*,
+                                                const unsigned char*,
+                                                size_t);
+
+/**
+ * Write an entry's response to the buffer holding the query, and set
+ * the TTLs. A negative ttl means the TTLs are decremented by the time
+ * spent in the cache.
+ */
+static void bhd_cache_copy(struct bhd_cache_entry*,
+                           unsigned char*,
+                           size_t,
+                           long,
+                           long);
+
+struct bhd_cache* bhd_cache_create(size_t max,
+                                   unsigned int prefetch,
+                                   long stale)
+{
+        struct bhd_cache* c = malloc(sizeof(struct bhd_cache));
+        size_t n = 64;
+
+        if (!c)
+        {
+                return NULL;
+        }
+
+        /* Assume an average entry is around 256 bytes, and keep the
+           number of buckets a power of two */
+        while (n < max / 256)
+        {
+                n *= 2;
+        }
+        c->buckets = calloc(n, sizeof(struct bhd_cache_entry*));
+        if (!c->buckets)
+        {
+                free(c);
+                return NULL;
+        }
+        c->nbuckets = n;
+        c->hand = NULL;
+        c->max = max;
+        c->used = n * sizeof(struct bhd_cache_entry*);
+        c->count = 0;
+        c->prefetch = prefetch;
+        c->stale = stale;
+
+        return c;
+}
+
+size_t bhd_cache_get(struct bhd_cache* c,
+                     unsigned char* buf,
+                     size_t len,
+                     size_t qlen,
+                     long now,
+                     int* prefetch)
+{
+        struct bhd_cache_entry* e;
+        int may_prefetch = *prefetch;
+
+        *prefetch = 0;
+        e = bhd_cache_lookup(c, buf, qlen);
+        if (!e)
+        {
+                return 0;
+        }
+        if (now >= e->expire)
+        {
+                if (now >= e->expire + c->stale)
+                {
+                        bhd_cache_remove(c, e);
+                }
+                return 0;
+        }
+        if (e->len > len)
+        {
+                return 0;
+        }
+
+        bhd_cache_copy(e, buf, qlen, now, -1);
+        e->ref = 1;
+        if (e->hits < UINT16_MAX)
+        {
+                e->hits++;
+        }
+
+        /* Request one refresh of a popular entry when less than the
+           configured percent of its TTL is left */
+        if (may_prefetch &&
+            c->prefetch &&
+            !e->prefetch &&
+            e->hits >= BHD_CACHE_PREFETCH_HITS &&
+            (e->expire - now) * 100 <=
+            (e->expire - e->added) * (long)c->prefetch)
+        {
+                e->prefetch = 1;
+                *prefetch = 1;
+        }
+
+        return e->len;
+}
+
+size_t bhd_cache_get_stale(struct bhd_cache* c,
+                           unsigned char* buf,
+                           size_t len,
+                           size_t qlen,
+                           long now)
+{
+        struct bhd_cache_entry* e = bhd_cache_lookup(c, buf, qlen);
+
+        if (!e ||
+            now < e->expire ||
+            now >= e->expire + c->stale ||
+            e->len > len)
+        {
+                return 0;
+        }
+
+        bhd_cache_copy(e, buf, qlen, now, BHD_CACHE_STALE_TTL);
+
+        return e->len;
+}
+
+int bhd_cache_put(struct bhd_cache* c,
+                  const unsigned char* buf,
+                  size_t len,
+                  long now)
+{
+        uint16_t ttls[MAX_RR];
+        struct bhd_dns_h h;
+        struct bhd_dns_question q;
+        struct bhd_cache_entry* e;
+        size_t off;
+        size_t qlen;
+        size_t need;
+        size_t soa_off = 0;
+        uint32_t soa_ttl = 0;
+        uint32_t minttl;
+        uint32_t hash;
+        uint16_t nttl = 0;
+        unsigned int nrr;
+        int neg;
+
+        if (len < BHD_DNS_H_SIZE || len > UINT16_MAX)
+        {
+                return 0;
+        }
+        bhd_dns_h_unpack(&h, buf);
+        if (h.qr != 1 ||
+            h.opcode != BHD_DNS_OP_QUERY ||
+            h.tc ||
+            h.qd_count != 1)
+        {
+                return 0;
+        }
+        neg = bhd_dns_h_negative(&h);
+        if (!neg && h.rcode != BHD_DNS_RCODE_NOERROR)
+        {
+                return 0;
+        }
+        minttl = neg ? BHD_CACHE_MAX_NEG_TTL : BHD_CACHE_MAX_TTL;
+
+        off = bhd_dns_question_unpack(&q, buf, len, BHD_DNS_H_SIZE);
+        if (off == 0)
+        {
+                return 0;
+        }
+        qlen = off - BHD_DNS_H_SIZE;
+        if (qlen > MAX_KEY)
+        {
+                return 0;
+        }
+
+        nrr = (unsigned int)h.an_count + h.ns_count + h.ar_count;
+        if (nrr > MAX_RR)
+        {
+                return 0;
+        }
+        for (unsigned int i = 0; i < nrr; i++)
+        {
+                struct bhd_dns_rr rr;
+                uint32_t ttl;
+
+                off = bhd_dns_rr_unpack(&rr, buf, len, off);
+                if (off == 0)
+                {
+                        return 0;
+                }
+                /* The TTL field of OPT holds flags */
+                if (rr.type == BHD_DNS_QTYPE_OPT)
+                {
+                        continue;
+                }
+                ttl = rr.ttl;
+
+                /* RFC 2308 section 5, a negative answer is cached for
+                   the smaller of the SOA's TTL and its minimum field */
+                if (neg &&
+                    !soa_off &&
+                    rr.type == BHD_DNS_QTYPE_SOA &&
+                    i >= h.an_count &&
+                    i < (unsigned int)h.an_count + h.ns_count)
+                {
+                        struct bhd_dns_rr_soa soa;
+
+                        if (bhd_dns_rr_soa_unpack(&soa, buf, len, &rr))
+                        {
+                                return 0;
+                        }
+                        if (soa.minimum < ttl)
+                        {
+                                ttl = soa.minimum;
+                        }
+                        soa_off = rr.rdata - 6;
+                        soa_ttl = ttl;
+                }
+
+                if (ttl < minttl)
+                {
+                        minttl = ttl;
+                }
+                ttls[nttl++] = (uint16_t)(rr.rdata - 6);
+        }
+        /* Without a SOA the negative answer can not be cached */
+        if (minttl == 0 || (neg && !soa_off))
+        {
+                return 0;
+        }
+
+        need = sizeof(struct bhd_cache_entry) + nttl * sizeof(uint16_t) + len;
+        if (need > c->max / 8)
+        {
+                return 0;
+        }
+
+        e = malloc(need);
+        if (!e)
+        {
+                syslog(LOG_WARNING, "%s:malloc: %m", __func__);
+                return 0;
+        }
+        e->added = now;
+        e->expire = now + (long)minttl;
+        e->qlen = (uint16_t)qlen;
+        e->len = (uint16_t)len;
+        e->nttl = nttl;
+        e->ref = 0;
+        e->hits = 0;
+        e->prefetch = 0;
+        memcpy(e->data, ttls, nttl * sizeof(uint16_t));
+        memcpy(bhd_cache_resp(e), buf, len);
+        bhd_cache_key(bhd_cache_resp(e) + BHD_DNS_H_SIZE,
+                      buf + BHD_DNS_H_SIZE,
+                      qlen);
+        if (soa_off)
+        {
+                soa_ttl = htonl(soa_ttl);
+                memcpy(bhd_cache_resp(e) + soa_off, &soa_ttl, 4);
+        }
+
+        /* Replace any previous response */
+        hash = bhd_cache_hash(bhd_cache_resp(e) + BHD_DNS_H_SIZE, qlen);
+        e->hash = hash;
+        {
+                struct bhd_cache_entry* old;
+
+                old = bhd_cache_find(c,
+                                     bhd_cache_resp(e) + BHD_DNS_H_SIZE,
+                                     qlen,
+                                     hash);
+                if (old)
+                {
+                        /* Keep some of the popularity, so a prefetched
+                           entry stays hot */
+                        e->hits = old->hits / 2;
+                        bhd_cache_remove(c, old);
+                }
+        }
+        bhd_cache_evict(c, need, now);
+
+        e->next = c->buckets[hash & (c->nbuckets - 1)];
+        c->buckets[hash & (c->nbuckets - 1)] = e;
+
+        /* New entries are placed right behind the hand, so they get a
+           full turn before being considered for eviction */
+        if (c->hand)
+        {
+                e->cnext = c->hand;
+                e->cprev = c->hand->cprev;
+                e->cprev->cnext = e;
+                c->hand->cprev = e;
+        }
+        else
+        {
+                e->cnext = e;
+                e->cprev = e;
+                c->hand = e;
+        }
+        c->used += need;
+        c->count++;
+
+        return 1;
+}
+
+size_t bhd_cache_size(const struct bhd_cache* c)
+{
+        return c->count;
+}
+
+void bhd_cache_free(struct bhd_cache* c)
+{
+        if (!c)
+        {
+                return;
+        }
+
+        while (c->hand)
+        {
+                bhd_cache_remove(c, c->hand);
+        }
+        free(c->buckets);
+        free(c);
+}
+
+static uint32_t bhd_cache_hash(const unsigned char* key, size_t len)
+{
+        /* FNV-1a */
+        uint32_t h = 2166136261u;
+
+        for (size_t i = 0; i < len; i++)
+        {
+                h ^= key[i];
+                h *= 16777619u;
+        }
+
+        return h;
+}
+
+static void bhd_cache_key(unsigned char* key,
+                          const unsigned char* q,
+                          size_t qlen)
+{
+        /* Label lengths are never in the range of upper case letters,
+           so the whole name can be converted. */
+        for (size_t i = 0; i < qlen - 4; i++)
+        {
+                key[i] = (unsigned char)tolower(q[i]);
+        }
+        memcpy(key + qlen - 4, q + qlen - 4, 4);
+}
+
+static struct bhd_cache_entry* bhd_cache_find(struct bhd_cache* c,
+                                              const unsigned char* key,
+                                              size_t qlen,
+                                              uint32_t hash)
+{
+        struct bhd_cache_entry* e = c->buckets[hash & (c->nbuckets - 1)];
+
+        for (; e; e = e->next)
+        {
+                if (e->hash == hash &&
+                    e->qlen == qlen &&
+                    memcmp(bhd_cache_resp(e) + BHD_DNS_H_SIZE, key, qlen) == 0)
+                {
+                        return e;
+                }
+        }
+
+        return NULL;
+}
+
+static struct bhd_cache_entry* bhd_cache_lookup(struct bhd_cache* c,
+                                                const unsigned char* buf,
+                                                size_t qlen)
+{
+        unsigned char key[MAX_KEY];
+
+        if (qlen > MAX_KEY || qlen < 5)
+        {
+                return NULL;
+        }
+        bhd_cache_key(key, buf + BHD_DNS_H_SIZE, qlen);
+
+        return bhd_cache_find(c, key, qlen, bhd_cache_hash(key, qlen));
+}
+
+static void bhd_cache_copy(struct bhd_cache_entry* e,
+                           unsigned char* buf,
+                           size_t qlen,
+                           long now,
+                           long ttl)
+{
+        const unsigned char* resp = bhd_cache_resp(e);
+        uint8_t rd;
+
+        /* Keep id, rd flag and question from the query */
+        rd = buf[2] & 0x1;
+        memcpy(buf + 2, resp + 2, BHD_DNS_H_SIZE - 2);
+        buf[2] = (uint8_t)((buf[2] & 0xfe) | rd);
+        memcpy(buf + BHD_DNS_H_SIZE + qlen,
+               resp + BHD_DNS_H_SIZE + qlen,
+               e->len - BHD_DNS_H_SIZE - qlen);
+
+        for (uint16_t i = 0; i < e->nttl; i++)
+        {
+                uint16_t off;
+                uint32_t v;
+
+                memcpy(&off, e->data + i * sizeof(uint16_t), sizeof(off));
+                if (ttl < 0)
+                {
+                        memcpy(&v, resp + off, 4);
+                        v = ntohl(v) - (uint32_t)(now - e->added);
+                }
+                else
+                {
+                        v = (uint32_t)ttl;
+                }
+                v = htonl(v);
+                memcpy(buf + off, &v, 4);
+        }
+}
+
+static void bhd_cache_remove(struct bhd_cache* c, struct bhd_cache_entry* e)
+{
+        struct bhd_cache_entry** pp = &c->buckets[e->hash & (c->nbuckets - 1)];
+
+        while (*pp != e)
+        {
+                pp = &(*pp)->next;
+        }
+        *pp = e->next;
+
+        if (e->cnext == e)
+        {
+                c->hand = NULL;
+        }
+        else
+        {
+                e->cprev->cnext = e->cnext;
+                e->cnext->cprev = e->cprev;
+                if (c->hand == e)
+                {
+                        c->hand = e->cnext;
+                }
+        }
+
+        c->used -= sizeof(struct bhd_cache_entry) +
+                e->nttl * sizeof(uint16_t) +
+                e->len;
+        c->count--;
+        free(e);
+}
+
+static void bhd_cache_evict(struct bhd_cache* c, size_t need, long now)
+{
+        while (c->hand && c->used + need > c->max)
+        {
+                struct bhd_cache_entry* e = c->hand;
+
+                if (e->ref && now < e->expire)
+                {
+                        /* Second chance */
+                        e->ref = 0;
+                        c->hand = e->cnext;
+                }
+                else
+                {
+                        bhd_cache_remove(c, e);
+                }
+        }
+}
+
+static unsigned char* bhd_cache_resp(struct bhd_cache_entry* e)
+{
+        return e->data + e->nttl * sizeof(uint16_t);
+}
@@ -0,0 +1,114 @@
+/*
+* Copyright (C) 2020 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#ifndef BHD_CACHE_H
+#define BHD_CACHE_H
+
+#include <stddef.h>
+
+/* Max TTL in seconds an answer is cached for */
+#define BHD_CACHE_MAX_TTL 86400
+/* Max TTL in seconds a negative answer is cached for, RFC 2308 */
+#define BHD_CACHE_MAX_NEG_TTL 10800
+/* TTL in seconds of a stale answer, RFC 8767 */
+#define BHD_CACHE_STALE_TTL 30
+/* Number of hits an entry needs before it is prefetched */
+#define BHD_CACHE_PREFETCH_HITS 4
+
+/* Cache of upstream responses in wire format, keyed on the question
+   (qname, qtype, qclass). Entries expire after the smallest TTL found
+   in the response. Negative answers (NXDOMAIN and NODATA) are cached
+   if the authority section holds a SOA, and expire after the smaller
+   of the SOA's TTL and minimum field. When the memory bound is
+   reached, entries are evicted using the CLOCK algorithm. Popular
+   entries that are hit close to their expiry are reported once, so the
+   caller can refresh them. Expired entries are kept for a stale window
+   and can be served when the upstream fails (RFC 8767). A cache is not
+   thread safe. */
+struct bhd_cache;
+
+/**
+ * Create a cache.
+ * @param max number of bytes the cache may use.
+ * @param percent of the TTL left when a popular entry is prefetched,
+ *        0 disables prefetching.
+ * @param seconds an expired entry is kept to be served stale, 0
+ *        disables serving stale answers.
+ * @return the cache or NULL on error.
+ */
+struct bhd_cache* bhd_cache_create(size_t max,
+                                   unsigned int prefetch,
+                                   long stale);
+
+/**
+ * Look up the response to a query. On a hit, the response is written to
+ * the buffer, keeping the query's header id, rd flag and question and
+ * with the TTLs decremented by the time spent in the cache.
+ * @param the cache.
+ * @param buffer holding the query, the response is written here.
+ * @param size of buffer in bytes.
+ * @param length of the question section (must hold one question).
+ * @param the current time in seconds.
+ * @param in, non zero if a prefetch may be requested. Out, set to 1 if
+ *        the entry should be prefetched, else 0.
+ * @return length of the response, 0 if not found.
+ */
+size_t bhd_cache_get(struct bhd_cache*,
+                     unsigned char*,
+                     size_t,
+                     size_t,
+                     long,
+                     int*);
+
+/**
+ * Look up an expired response to a query, that is within the stale
+ * window. On a hit, the response is written to the buffer as with
+ * bhd_cache_get, with the TTLs set to BHD_CACHE_STALE_TTL.
+ * @param the cache.
+ * @param buffer holding the query, the response is written here.
+ * @param size of buffer in bytes.
+ * @param length of the question section (must hold one question).
+ * @param the current time in seconds.
+ * @return length of the response, 0 if not found.
+ */
+size_t bhd_cache_get_stale(struct bhd_cache*,
+                           unsigned char*,
+                           size_t,
+                           size_t,
+                           long);
+
+/**
+ * Add an upstream response to the cache. Responses that can not be
+ * cached (errors, truncated or negative without SOA) are ignored.
+ * @param the cache.
+ * @param buffer holding the response.
+ * @param size of response in bytes.
+ * @param the current time in seconds.
+ * @return 1 if the response was added, 0 if not.
+ */
+int bhd_cache_put(struct bhd_cache*, const unsigned char*, size_t, long);
+
+/**
+ * Get the number of entries in the cache.
+ * @param the cache.
+ * @return number of entries.
+ */
+size_t bhd_cache_size(const struct bhd_cache*);
+
+/**
+ * Free the cache and all entries.
+ * @param the cache.
+ * @return void.
+ */
+void bhd_cache_free(struct bhd_cache*);
+
+#endif /* BHD_CACHE_H */
@@ -15,7 +15,9 @@
 #include <string.h>
 #include <ctype.h>
 #include <syslog.h>
+#include <arpa/inet.h>
 #include "bhd_cfg.h"
+#include "bhd_bl.h"
 #include "vendor/strutil.h"
 
 #define MAX_LINE 512
@@ -35,6 +37,17 @@ int bhd_cfg_read(struct bhd_cfg* cfg, const char* p)
         memset(cfg, 0, sizeof(struct bhd_cfg));
 
         int ln = 0;
+        int workers_set = 0;
+        int cache_set = 0;
+        int hedge_set = 0;
+        int prefetch_set = 0;
+        int prefetch_limit_set = 0;
+        int stale_set = 0;
+        int edns_set = 0;
+        int engine_set = 0;
+        int fail_set = 0;
+        int mode_set = 0;
+        int threads_set = 0;
         while (fgets(line, MAX_LINE, f))
         {
                 char* d;
@@ -109,6 +122,112 @@ int bhd_cfg_read(struct bhd_cfg* cfg, const char* p)
                         }
                         strncpy(cfg->bp, d, vlen);
                 }
+                else if (strncmp("blist-engine", line, slen) == 0)
+                {
+                        if (engine_set)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Multiple blist-engine declarations at line %d",
+                                       ln);
+                                continue;
+                        }
+                        if (strcmp(d, "trie") == 0)
+                        {
+                                cfg->bl_engine = BHD_BL_TRIE;
+                        }
+                        else if (strcmp(d, "hash") == 0)
+                        {
+                                cfg->bl_engine = BHD_BL_HASH;
+                        }
+                        else
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid blist-engine %s at line %d",
+                                       d,
+                                       ln);
+                                continue;
+                        }
+                        engine_set = 1;
+                }
+                else if (strncmp("blist-fail", line, slen) == 0)
+                {
+                        if (fail_set)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Multiple blist-fail declarations at line %d",
+                                       ln);
+                                continue;
+                        }
+                        if (strcmp(d, "open") == 0)
+                        {
+                                cfg->bl_fail_closed = 0;
+                        }
+                        else if (strcmp(d, "closed") == 0)
+                        {
+                                cfg->bl_fail_closed = 1;
+                        }
+                        else
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid blist-fail %s at line %d",
+                                       d,
+                                       ln);
+                                continue;
+                        }
+                        fail_set = 1;
+                }
+                else if (strncmp("blist-mode", line, slen) == 0)
+                {
+                        if (mode_set)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Multiple blist-mode declarations at line %d",
+                                       ln);
+                                continue;
+                        }
+                        if (strcmp(d, "nodata") == 0)
+                        {
+                                cfg->bl_nxdomain = 0;
+                        }
+                        else if (strcmp(d, "nxdomain") == 0)
+                        {
+                                cfg->bl_nxdomain = 1;
+                        }
+                        else
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid blist-mode %s at line %d",
+                                       d,
+                                       ln);
+                                continue;
+                        }
+                        mode_set = 1;
+                }
+                else if (strncmp("blist-threads", line, slen) == 0)
+                {
+                        long lv;
+                        char* ep;
+
+                        if (threads_set)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Multiple blist-threads declarations at line %d",
+                                       ln);
+                                continue;
+                        }
+
+                        lv = strtol(d, &ep, 10);
+                        if (d == ep || lv < 0 || lv > BHD_BL_MAX_THREADS)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid blist-threads number %s at line %d",
+                                       d,
+                                       ln);
+                                continue;
+                        }
+                        cfg->bl_threads = (int)lv;
+                        threads_set = 1;
+                }
                 else if (strncmp("bresp", line, slen) == 0)
                 {
                         if (cfg->baddr[0])
@@ -120,16 +239,62 @@ int bhd_cfg_read(struct bhd_cfg* cfg, const char* p)
                         }
                         strncpy(cfg->baddr, d, vlen);
                 }
+                else if (strncmp("bresp6", line, slen) == 0)
+                {
+                        unsigned char a6[16];
+
+                        if (cfg->baddr6[0])
+                        {
+                                syslog(LOG_WARNING,
+                                       "Multiple bresp6 declarations at line %d",
+                                       ln);
+                                continue;
+                        }
+                        if (inet_pton(AF_INET6, d, a6) != 1)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid bresp6 %s at line %d",
+                                       d,
+                                       ln);
+                                continue;
+                        }
+                        strncpy(cfg->baddr6, d, vlen);
+                }
                 else if (strncmp("forward-addr", line, slen) == 0)
                 {
-                        if (cfg->faddr[0])
+                        /* Each declaration adds an upstream, with an
+                           optional port as addr@port */
+                        char* at = strchr(d, '@');
+                        uint16_t n = cfg->nforward;
+
+                        if (n == BHD_MAX_UPSTREAM)
                         {
                                 syslog(LOG_WARNING,
-                                       "Multiple forward-addr declarations at line %d",
+                                       "Too many forward-addr declarations at line %d",
                                        ln);
                                 continue;
                         }
-                        strncpy(cfg->faddr, d, vlen);
+                        if (at)
+                        {
+                                long lv;
+                                char* ep;
+
+                                *at++ = '\0';
+                                lv = strtol(at, &ep, 10);
+                                if (at == ep || lv < 1 || lv > UINT16_MAX)
+                                {
+                                        syslog(LOG_WARNING,
+                                               "Invalid forward-addr port %s at line %d",
+                                               at,
+                                               ln);
+                                        continue;
+                                }
+                                cfg->fports[n] = (uint16_t)lv;
+                                strrstrip(d);
+                                vlen = strlen(d) + 1;
+                        }
+                        strncpy(cfg->faddr[n], d, vlen);
+                        cfg->nforward++;
                 }
                 else if (strncmp("forward-port", line, slen) == 0)
                 {
@@ -179,6 +344,183 @@ int bhd_cfg_read(struct bhd_cfg* cfg, const char* p)
                         }
                         cfg->sport = (uint16_t)lv;
                 }
+                else if (strncmp("workers", line, slen) == 0)
+                {
+                        long lv;
+                        char* ep;
+
+                        if (workers_set)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Multiple workers declarations at line %d",
+                                       ln);
+                                continue;
+                        }
+
+                        lv = strtol(d, &ep, 10);
+                        if (d == ep || lv < 0 || lv > BHD_MAX_WORKERS)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid workers number %s at line %d",
+                                       d,
+                                       ln);
+                                continue;
+                        }
+                        cfg->workers = (uint16_t)lv;
+                        workers_set = 1;
+                }
+                else if (strncmp("cache-size", line, slen) == 0)
+                {
+                        long lv;
+                        char* ep;
+
+                        if (cache_set)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Multiple cache-size declarations at line %d",
+                                       ln);
+                                continue;
+                        }
+
+                        lv = strtol(d, &ep, 10);
+                        if (d == ep || lv < 0 || lv > BHD_MAX_CACHE)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid cache-size %s at line %d",
+                                       d,
+                                       ln);
+                                continue;
+                        }
+                        cfg->cache_size = (uint32_t)lv;
+                        cache_set = 1;
+                }
+                else if (strncmp("hedge-percentile", line, slen) == 0)
+                {
+                        long lv;
+                        char* ep;
+
+                        if (hedge_set)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Multiple hedge-percentile declarations at line %d",
+                                       ln);
+                                continue;
+                        }
+
+                        lv = strtol(d, &ep, 10);
+                        if (d == ep || lv < 0 || lv > 99)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid hedge-percentile %s at line %d",
+                                       d,
+                                       ln);
+                                continue;
+                        }
+                        cfg->hedge_pct = (uint8_t)lv;
+                        hedge_set = 1;
+                }
+                else if (strncmp("prefetch", line, slen) == 0)
+                {
+                        long lv;
+                        char* ep;
+
+                        if (prefetch_set)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Multiple prefetch declarations at line %d",
+                                       ln);
+                                continue;
+                        }
+
+                        lv = strtol(d, &ep, 10);
+                        if (d == ep || lv < 0 || lv > 99)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid prefetch %s at line %d",
+                                       d,
+                                       ln);
+                                continue;
+                        }
+                        cfg->prefetch = (uint8_t)lv;
+                        prefetch_set = 1;
+                }
+                else if (strncmp("prefetch-limit", line, slen) == 0)
+                {
+                        long lv;
+                        char* ep;
+
+                        if (prefetch_limit_set)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Multiple prefetch-limit declarations at line %d",
+                                       ln);
+                                continue;
+                        }
+
+                        lv = strtol(d, &ep, 10);
+                        if (d == ep || lv < 0 || lv > UINT16_MAX)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid prefetch-limit %s at line %d",
+                                       d,
+                                       ln);
+                                continue;
+                        }
+                        cfg->prefetch_limit = (uint32_t)lv;
+                        prefetch_limit_set = 1;
+                }
+                else if (strncmp("serve-stale", line, slen) == 0)
+                {
+                        long lv;
+                        char* ep;
+
+                        if (stale_set)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Multiple serve-stale declarations at line %d",
+                                       ln);
+                                continue;
+                        }
+
+                        lv = strtol(d, &ep, 10);
+                        if (d == ep || lv < 0 || lv > BHD_MAX_STALE)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid serve-stale %s at line %d",
+                                       d,
+                                       ln);
+                                continue;
+                        }
+                        cfg->stale = (uint32_t)lv;
+                        stale_set = 1;
+                }
+                else if (strncmp("edns-size", line, slen) == 0)
+                {
+                        long lv;
+                        char* ep;
+
+                        if (edns_set)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Multiple edns-size declarations at line %d",
+                                       ln);
+                                continue;
+                        }
+
+                        lv = strtol(d, &ep, 10);
+                        if (d == ep ||
+                            (lv != 0 && lv < 512) ||
+                            lv > BHD_MAX_EDNS)
+                        {
+                                syslog(LOG_WARNING,
+                                       "Invalid edns-size %s at line %d",
+                                       d,
+                                       ln);
+                                continue;
+                        }
+                        cfg->edns_size = (uint16_t)lv;
+                        edns_set = 1;
+                }
                 else if (strncmp("user", line, slen) == 0)
                 {
                         if (cfg->user[0])
@@ -201,6 +543,41 @@ int bhd_cfg_read(struct bhd_cfg* cfg, const char* p)
         {
                 cfg->fport = 53;
         }
+        for (uint16_t i = 0; i < cfg->nforward; i++)
+        {
+                if (!cfg->fports[i])
+                {
+                        cfg->fports[i] = cfg->fport;
+                }
+        }
+        if (!workers_set)
+        {
+                cfg->workers = 1;
+        }
+        if (!cache_set)
+        {
+                cfg->cache_size = 4096;
+        }
+        if (!hedge_set)
+        {
+                cfg->hedge_pct = 95;
+        }
+        if (!prefetch_set)
+        {
+                cfg->prefetch = 10;
+        }
+        if (!prefetch_limit_set)
+        {
+                cfg->prefetch_limit = 100;
+        }
+        if (!stale_set)
+        {
+                cfg->stale = 86400;
+        }
+        if (!edns_set)
+        {
+                cfg->edns_size = 1232;
+        }
         if (!cfg->laddr[0])
         {
                 strncpy(cfg->laddr, "0.0.0.0", STR_LEN-1);
@@ -213,6 +590,10 @@ int bhd_cfg_read(struct bhd_cfg* cfg, const char* p)
         {
                 strncpy(cfg->baddr, "0.0.0.0", STR_LEN-1);
         }
+        if (!cfg->baddr6[0])
+        {
+                strncpy(cfg->baddr6, "::", STR_LEN-1);
+        }
 
         fclose(f);
 
@@ -16,17 +16,58 @@
 #include <stdint.h>
 
 #define STR_LEN 128
+#define BHD_MAX_WORKERS 256
+#define BHD_MAX_UPSTREAM 8
+/* Max cache size in KiB */
+#define BHD_MAX_CACHE (16 * 1024 * 1024)
+/* Max time in seconds to serve stale answers, 7 days */
+#define BHD_MAX_STALE (7 * 86400)
+/* Max EDNS UDP payload size */
+#define BHD_MAX_EDNS 4096
 
 struct bhd_cfg
 {
         char laddr[STR_LEN];
-        char faddr[STR_LEN];
+        /* Upstream resolvers */
+        char faddr[BHD_MAX_UPSTREAM][STR_LEN];
         char baddr[STR_LEN];
+        /* Address of AAAA answers for blocked names */
+        char baddr6[STR_LEN];
         char bp[STR_LEN];
         char user[STR_LEN];
         uint16_t lport;
+        /* Default port for upstreams */
         uint16_t fport;
+        uint16_t fports[BHD_MAX_UPSTREAM];
+        uint16_t nforward;
         uint16_t sport;
+        /* Size of the answer cache in KiB, 0 disables the cache */
+        uint32_t cache_size;
+        /* Number of worker threads, 0 means one per online cpu */
+        uint16_t workers;
+        /* RTT percentile after which a query is also sent to a second
+           upstream, 0 disables hedging */
+        uint8_t hedge_pct;
+        /* Percent of the TTL left when a popular cache entry is
+           refreshed, 0 disables prefetching */
+        uint8_t prefetch;
+        /* Max number of prefetch queries per second */
+        uint32_t prefetch_limit;
+        /* Seconds an expired answer may be served stale, 0 disables */
+        uint32_t stale;
+        /* EDNS UDP payload size advertised to upstreams and clients, 0
+           disables EDNS */
+        uint16_t edns_size;
+        /* Block list lookup engine, enum bhd_bl_engine */
+        uint8_t bl_engine;
+        /* Answer queries that may be blocked with SERVFAIL while the
+           block list is loaded, instead of forwarding them */
+        uint8_t bl_fail_closed;
+        /* Answer blocked queries of other types than A and AAAA with
+           NXDOMAIN instead of NODATA */
+        uint8_t bl_nxdomain;
+        /* Threads used to parse the block list, 0 for one per CPU */
+        int bl_threads;
 };
 
 /**
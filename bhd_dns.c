@@ -20,6 +20,37 @@
 #include <syslog.h>
 #include "bhd_dns.h"
 
+/* Max number of labels followed when comparing names */
+#define BHD_DNS_MAX_HOPS 128
+
+/**
+ * Write a name, compressed against the names already written.
+ * @return 0 on success.
+ */
+static int bhd_dns_write_name(struct bhd_dns_writer* w,
+                              const unsigned char* name);
+
+/**
+ * Write the type, class, ttl and rdlength of a record after its name.
+ * @return offset of rdlength, 0 if it did not fit.
+ */
+static size_t bhd_dns_write_fixed(struct bhd_dns_writer* w,
+                                  enum bhd_dns_section section,
+                                  uint16_t type,
+                                  uint16_t class,
+                                  uint32_t ttl,
+                                  uint16_t rdlength);
+
+/**
+ * Compare a name in a message with a name in wire format, ignoring
+ * case.
+ * @return 1 if the names are equal.
+ */
+static int bhd_dns_name_eq(const unsigned char* buf,
+                           size_t len,
+                           size_t off,
+                           const unsigned char* name);
+
 size_t bhd_dns_h_unpack(struct bhd_dns_h* h, const unsigned char* buf)
 {
         uint16_t u16;
@@ -104,7 +135,8 @@ size_t bhd_dns_h_pack(unsigned char* buf,
 }
 
 size_t bhd_dns_q_section_unpack(struct bhd_dns_q_section* qs,
-                                const unsigned char* buf)
+                                const unsigned char* buf,
+                                size_t len)
 {
         size_t offset = 0;
 
@@ -122,7 +154,9 @@ size_t bhd_dns_q_section_unpack(struct bhd_dns_q_section* qs,
 
         for (uint16_t i = 0; i < qs->qd_count; i++)
         {
-                size_t br = bhd_dns_q_unpack(qs->q + i, buf + offset);
+                size_t br = bhd_dns_q_unpack(qs->q + i,
+                                             buf + offset,
+                                             len - offset);
 
                 if (br == 0)
                 {
@@ -157,7 +191,7 @@ size_t bhd_dns_rr_a_pack(unsigned char* buf,
         uint32_t u32;
         uint16_t u16;
 
-        if (len < 16)
+        if (len < BHD_DNS_RR_A_SIZE)
         {
                 return 0;
         }
@@ -175,7 +209,303 @@ size_t bhd_dns_rr_a_pack(unsigned char* buf,
         /* addr is always in network order from inet_pton */
         memcpy(buf + 12, &a->addr, 4);
 
-        return 16;
+        return BHD_DNS_RR_A_SIZE;
+}
+
+size_t bhd_dns_rr_aaaa_pack(unsigned char* buf,
+                            size_t len,
+                            const struct bhd_dns_rr_aaaa* a)
+{
+        uint32_t u32;
+        uint16_t u16;
+
+        if (len < BHD_DNS_RR_AAAA_SIZE)
+        {
+                return 0;
+        }
+
+        u16 = htons(a->name);
+        memcpy(buf + 0, &u16, 2);
+        u16 = htons(a->type);
+        memcpy(buf + 2, &u16, 2);
+        u16 = htons(a->class);
+        memcpy(buf + 4, &u16, 2);
+        u32 = htonl(a->ttl);
+        memcpy(buf + 6, &u32, 4);
+        u16 = htons(a->rdlength);
+        memcpy(buf + 10, &u16, 2);
+        memcpy(buf + 12, a->addr, 16);
+
+        return BHD_DNS_RR_AAAA_SIZE;
+}
+
+size_t bhd_dns_name_skip(const unsigned char* buf, size_t len, size_t off)
+{
+        size_t start = off;
+
+        /* See RFC 1035 4.1.4 for compression */
+        while (off < len)
+        {
+                uint8_t l = buf[off];
+
+                if ((l & 0xc0) == 0xc0)
+                {
+                        return off + 2 <= len ? off + 2 : 0;
+                }
+                if (l > BHD_DNS_MAX_LABEL)
+                {
+                        return 0;
+                }
+                off += (size_t)l + 1;
+                if (off - start > BHD_DNS_MAX_NAME)
+                {
+                        return 0;
+                }
+                if (l == 0)
+                {
+                        return off;
+                }
+        }
+
+        return 0;
+}
+
+size_t bhd_dns_name_read(const unsigned char* buf,
+                         size_t len,
+                         size_t off,
+                         unsigned char* out)
+{
+        size_t n = 0;
+        /* Offset a pointer must be below */
+        size_t limit = off;
+
+        /* See RFC 1035 4.1.4 for compression */
+        while (off < len)
+        {
+                uint8_t l = buf[off];
+
+                if ((l & 0xc0) == 0xc0)
+                {
+                        size_t ptr;
+
+                        if (off + 2 > len)
+                        {
+                                return 0;
+                        }
+                        ptr = (size_t)(l & 0x3f) << 8 | buf[off + 1];
+                        if (ptr >= limit)
+                        {
+                                return 0;
+                        }
+                        off = limit = ptr;
+                        continue;
+                }
+                if (l > BHD_DNS_MAX_LABEL ||
+                    off + l + 1 > len ||
+                    n + l + 1 > BHD_DNS_MAX_NAME)
+                {
+                        return 0;
+                }
+                memcpy(out + n, buf + off, (size_t)l + 1);
+                n += (size_t)l + 1;
+                off += (size_t)l + 1;
+                if (l == 0)
+                {
+                        return n;
+                }
+        }
+
+        return 0;
+}
+
+size_t bhd_dns_q_section_skip(const unsigned char* buf,
+                              size_t len,
+                              size_t off,
+                              uint16_t qd_count)
+{
+        for (uint16_t i = 0; i < qd_count; i++)
+        {
+                /* Name, type and class */
+                off = bhd_dns_name_skip(buf, len, off);
+                if (off == 0 || off + 4 > len)
+                {
+                        return 0;
+                }
+                off += 4;
+        }
+
+        return off;
+}
+
+size_t bhd_dns_question_unpack(struct bhd_dns_question* q,
+                               const unsigned char* buf,
+                               size_t len,
+                               size_t off)
+{
+        uint16_t u16;
+
+        q->name = off;
+        off = bhd_dns_name_skip(buf, len, off);
+        if (off == 0 || off + 4 > len)
+        {
+                return 0;
+        }
+
+        memcpy(&u16, buf + off, 2);
+        q->qtype = ntohs(u16);
+        memcpy(&u16, buf + off + 2, 2);
+        q->qclass = ntohs(u16);
+        q->end = off + 4;
+
+        return q->end;
+}
+
+int bhd_dns_msg_unpack(struct bhd_dns_msg* msg,
+                       const unsigned char* buf,
+                       size_t len)
+{
+        size_t* sect[3];
+        uint16_t count[3];
+        size_t off = BHD_DNS_H_SIZE;
+        struct bhd_dns_rr rr;
+
+        if (len < BHD_DNS_H_SIZE)
+        {
+                return -1;
+        }
+        msg->buf = buf;
+        msg->len = len;
+        bhd_dns_h_unpack(&msg->h, buf);
+        sect[0] = &msg->an;
+        sect[1] = &msg->ns;
+        sect[2] = &msg->ar;
+        count[0] = msg->h.an_count;
+        count[1] = msg->h.ns_count;
+        count[2] = msg->h.ar_count;
+
+        memset(&msg->q, 0, sizeof(msg->q));
+        for (uint16_t i = 0; i < msg->h.qd_count; i++)
+        {
+                struct bhd_dns_question q;
+
+                off = bhd_dns_question_unpack(&q, buf, len, off);
+                if (off == 0)
+                {
+                        return -1;
+                }
+                if (i == 0)
+                {
+                        msg->q = q;
+                }
+        }
+
+        /* Answer, authority and additional sections */
+        for (int i = 0; i < 3; i++)
+        {
+                *sect[i] = off;
+                for (uint16_t j = 0; j < count[i]; j++)
+                {
+                        off = bhd_dns_rr_unpack(&rr, buf, len, off);
+                        if (off == 0)
+                        {
+                                return -1;
+                        }
+                }
+        }
+        msg->end = off;
+
+        return 0;
+}
+
+size_t bhd_dns_rr_unpack(struct bhd_dns_rr* rr,
+                         const unsigned char* buf,
+                         size_t len,
+                         size_t off)
+{
+        uint32_t u32;
+        uint16_t u16;
+
+        rr->name = off;
+        off = bhd_dns_name_skip(buf, len, off);
+        if (off == 0 || off + BHD_DNS_RR_FIXED > len)
+        {
+                return 0;
+        }
+
+        memcpy(&u16, buf + off, 2);
+        rr->type = ntohs(u16);
+        memcpy(&u16, buf + off + 2, 2);
+        rr->class = ntohs(u16);
+        memcpy(&u32, buf + off + 4, 4);
+        rr->ttl = ntohl(u32);
+        memcpy(&u16, buf + off + 8, 2);
+        rr->rdlength = ntohs(u16);
+        off += BHD_DNS_RR_FIXED;
+        rr->rdata = off;
+
+        if (off + rr->rdlength > len)
+        {
+                return 0;
+        }
+
+        return off + rr->rdlength;
+}
+
+int bhd_dns_rr_soa_unpack(struct bhd_dns_rr_soa* soa,
+                          const unsigned char* buf,
+                          size_t len,
+                          const struct bhd_dns_rr* rr)
+{
+        uint32_t u32[5];
+        size_t end = rr->rdata + rr->rdlength;
+        size_t off;
+
+        if (rr->type != BHD_DNS_QTYPE_SOA || end > len)
+        {
+                return -1;
+        }
+
+        soa->mname = rr->rdata;
+        off = bhd_dns_name_skip(buf, end, rr->rdata);
+        if (off == 0)
+        {
+                return -1;
+        }
+        soa->rname = off;
+        off = bhd_dns_name_skip(buf, end, off);
+        if (off == 0 || off + sizeof(u32) != end)
+        {
+                return -1;
+        }
+
+        memcpy(u32, buf + off, sizeof(u32));
+        soa->serial = ntohl(u32[0]);
+        soa->refresh = ntohl(u32[1]);
+        soa->retry = ntohl(u32[2]);
+        soa->expire = ntohl(u32[3]);
+        soa->minimum = ntohl(u32[4]);
+
+        return 0;
+}
+
+void bhd_dns_h_respond(unsigned char* buf, uint8_t rcode, uint16_t an_count)
+{
+        uint16_t u16;
+
+        /* qr set, aa and tc cleared */
+        buf[2] = (uint8_t)((buf[2] & 0x79) | 0x80);
+        /* ra set, z cleared */
+        buf[3] = (uint8_t)((buf[3] & 0x30) | 0x80 | (rcode & 0xf));
+
+        u16 = htons(an_count);
+        memcpy(buf + 6, &u16, 2);
+        memset(buf + 8, 0, 4);
+}
+
+int bhd_dns_h_negative(const struct bhd_dns_h* h)
+{
+        return h->rcode == BHD_DNS_RCODE_NXDOMAIN ||
+                (h->rcode == BHD_DNS_RCODE_NOERROR && h->an_count == 0);
 }
 
 void bhd_dns_q_section_free(struct bhd_dns_q_section* qs)
@@ -201,41 +531,53 @@ void bhd_dns_q_section_free(struct bhd_dns_q_section* qs)
         qs->qd_count = 0;
 }
 
-size_t bhd_dns_q_unpack(struct bhd_dns_q* q, const unsigned char* buf)
+size_t bhd_dns_q_unpack(struct bhd_dns_q* q,
+                        const unsigned char* buf,
+                        size_t len)
 {
         struct bhd_dns_q_label* label = &q->qname;
         size_t br = 0;
         uint16_t v;
-        uint8_t len;
+        uint8_t l;
 
         /* See RFC 1035 4.1.2 for format */
         /* Format is 3www7openbsd3org */
-        len = *buf;
-        if (len > BHD_DNS_MAX_LABEL)
+        if (len == 0)
+        {
+                return 0;
+        }
+        l = *buf;
+        if (l > BHD_DNS_MAX_LABEL)
         {
                 return 0;
         }
         br++;
+        label->label = NULL;
+        label->next = NULL;
         for (;;)
         {
-                label->label = malloc(len + 1);
+                /* The label, and the length of the next */
+                if (br + l + 1 > len)
+                {
+                        goto bailout;
+                }
+                label->label = malloc((size_t)l + 1);
                 if (!label->label)
                 {
                         syslog(LOG_WARNING, "%s:malloc:%m", __func__);
                         goto bailout;
                 }
-                memcpy(label->label, buf + br, len);
-                label->label[len] = '\0';
+                memcpy(label->label, buf + br, l);
+                label->label[l] = '\0';
 
-                br += len;
-                len = *(buf + br++);
-                if (len > BHD_DNS_MAX_LABEL)
+                br += l;
+                l = *(buf + br++);
+                if (l > BHD_DNS_MAX_LABEL)
                 {
                         goto bailout;
                 }
-                else if (len == 0)
+                else if (l == 0)
                 {
-                        label->next = NULL;
                         break;
                 }
                 label->next = malloc(sizeof(struct bhd_dns_q_label));
@@ -245,6 +587,12 @@ size_t bhd_dns_q_unpack(struct bhd_dns_q* q, const unsigned char* buf)
                         goto bailout;
                 }
                 label = label->next;
+                label->label = NULL;
+                label->next = NULL;
+        }
+        if (br + 4 > len)
+        {
+                goto bailout;
         }
 
         memcpy(&v, buf + br, 2);
@@ -257,18 +605,15 @@ size_t bhd_dns_q_unpack(struct bhd_dns_q* q, const unsigned char* buf)
         return br;
 bailout:
         label = &q->qname;
-        if (label->label)
+        free(label->label);
+        label = label->next;
+        while (label)
         {
-                free(label->label);
-                label = label->next;
-                while (label)
-                {
-                        struct bhd_dns_q_label* next = label->next;
+                struct bhd_dns_q_label* next = label->next;
 
-                        free(label->label);
-                        free(label);
-                        label = next;
-                }
+                free(label->label);
+                free(label);
+                label = next;
         }
         return 0;
 }
@@ -388,3 +733,570 @@ void bhd_dns_rr_a_init(struct bhd_dns_rr_a* rr, const char* a)
         rr->rdlength = 4;
         rr->addr = na;
 }
+
+void bhd_dns_rr_aaaa_init(struct bhd_dns_rr_aaaa* rr, const char* a)
+{
+        if (inet_pton(AF_INET6, a, rr->addr) != 1)
+        {
+                syslog(LOG_WARNING, "Invalid address '%s'", a);
+                memset(rr->addr, 0, sizeof(rr->addr));
+        }
+
+        rr->name = 0xc00c;
+        rr->type = (uint16_t)BHD_DNS_QTYPE_AAAA;
+        rr->class = (uint16_t)BHD_DNS_CLASS_IN;
+        rr->ttl = 86400; /* 24h */
+        rr->rdlength = 16;
+}
+
+void bhd_dns_rr_reader_init(struct bhd_dns_rr_reader* r,
+                            const struct bhd_dns_msg* msg)
+{
+        r->buf = msg->buf;
+        r->len = msg->len;
+        r->off = msg->an;
+        r->counts[BHD_DNS_SECTION_AN] = msg->h.an_count;
+        r->counts[BHD_DNS_SECTION_NS] = msg->h.ns_count;
+        r->counts[BHD_DNS_SECTION_AR] = msg->h.ar_count;
+        r->section = BHD_DNS_SECTION_AN;
+        r->left = r->counts[BHD_DNS_SECTION_AN];
+}
+
+int bhd_dns_rr_next(struct bhd_dns_rr_reader* r,
+                    struct bhd_dns_rr* rr,
+                    enum bhd_dns_section* section)
+{
+        while (r->left == 0)
+        {
+                if (r->section == BHD_DNS_SECTION_AR)
+                {
+                        return 0;
+                }
+                r->section++;
+                r->left = r->counts[r->section];
+        }
+
+        r->off = bhd_dns_rr_unpack(rr, r->buf, r->len, r->off);
+        if (r->off == 0)
+        {
+                r->left = 0;
+                r->section = BHD_DNS_SECTION_AR;
+                return -1;
+        }
+        r->left--;
+        if (section)
+        {
+                *section = (enum bhd_dns_section)r->section;
+        }
+
+        return 1;
+}
+
+int bhd_dns_rr_a_unpack(uint32_t* addr,
+                        const unsigned char* buf,
+                        const struct bhd_dns_rr* rr)
+{
+        if (rr->type != BHD_DNS_QTYPE_A || rr->rdlength != 4)
+        {
+                return -1;
+        }
+        memcpy(addr, buf + rr->rdata, 4);
+
+        return 0;
+}
+
+int bhd_dns_rr_aaaa_unpack(unsigned char* addr,
+                           const unsigned char* buf,
+                           const struct bhd_dns_rr* rr)
+{
+        if (rr->type != BHD_DNS_QTYPE_AAAA || rr->rdlength != 16)
+        {
+                return -1;
+        }
+        memcpy(addr, buf + rr->rdata, 16);
+
+        return 0;
+}
+
+size_t bhd_dns_rr_cname_unpack(unsigned char* name,
+                               const unsigned char* buf,
+                               size_t len,
+                               const struct bhd_dns_rr* rr)
+{
+        size_t end = rr->rdata + rr->rdlength;
+
+        /* The name must fill the rdata */
+        if (rr->type != BHD_DNS_QTYPE_CNAME ||
+            end > len ||
+            bhd_dns_name_skip(buf, end, rr->rdata) != end)
+        {
+                return 0;
+        }
+
+        return bhd_dns_name_read(buf, end, rr->rdata, name);
+}
+
+int bhd_dns_rr_opt_unpack(struct bhd_dns_rr_opt* opt,
+                          const struct bhd_dns_rr* rr)
+{
+        if (rr->type != BHD_DNS_QTYPE_OPT)
+        {
+                return -1;
+        }
+
+        /* The class holds the payload size and the TTL the extended
+           rcode, version and flags */
+        opt->udp_size = rr->class;
+        opt->ext_rcode = (uint8_t)(rr->ttl >> 24);
+        opt->version = (uint8_t)(rr->ttl >> 16);
+        opt->flags = (uint16_t)rr->ttl;
+        opt->options = rr->rdata;
+        opt->optlen = rr->rdlength;
+
+        return 0;
+}
+
+int bhd_dns_opt_remove(unsigned char* buf,
+                       size_t* len,
+                       struct bhd_dns_rr_opt* opt)
+{
+        struct bhd_dns_rr_reader r;
+        struct bhd_dns_msg msg;
+        struct bhd_dns_rr rr;
+        enum bhd_dns_section section;
+        uint16_t u16;
+        int ret;
+
+        if (bhd_dns_msg_unpack(&msg, buf, *len))
+        {
+                return -1;
+        }
+
+        bhd_dns_rr_reader_init(&r, &msg);
+        while ((ret = bhd_dns_rr_next(&r, &rr, &section)) == 1)
+        {
+                size_t end = rr.rdata + rr.rdlength;
+
+                if (section != BHD_DNS_SECTION_AR ||
+                    rr.type != BHD_DNS_QTYPE_OPT)
+                {
+                        continue;
+                }
+
+                bhd_dns_rr_opt_unpack(opt, &rr);
+                /* The OPT record is usually last */
+                memmove(buf + rr.name, buf + end, *len - end);
+                *len -= end - rr.name;
+                u16 = htons((uint16_t)(msg.h.ar_count - 1));
+                memcpy(buf + 10, &u16, 2);
+                return 1;
+        }
+
+        return ret;
+}
+
+size_t bhd_dns_opt_append(unsigned char* buf,
+                          size_t len,
+                          size_t cap,
+                          const struct bhd_dns_rr_opt* opt)
+{
+        uint32_t u32;
+        uint16_t u16;
+
+        if (len < BHD_DNS_H_SIZE || len + BHD_DNS_OPT_SIZE > cap)
+        {
+                return 0;
+        }
+
+        /* The root name */
+        buf[len] = 0;
+        u16 = htons(BHD_DNS_QTYPE_OPT);
+        memcpy(buf + len + 1, &u16, 2);
+        u16 = htons(opt->udp_size);
+        memcpy(buf + len + 3, &u16, 2);
+        u32 = htonl((uint32_t)opt->ext_rcode << 24 |
+                    (uint32_t)opt->version << 16 |
+                    opt->flags);
+        memcpy(buf + len + 5, &u32, 4);
+        memset(buf + len + 9, 0, 2);
+
+        memcpy(&u16, buf + 10, 2);
+        u16 = htons((uint16_t)(ntohs(u16) + 1));
+        memcpy(buf + 10, &u16, 2);
+
+        return len + BHD_DNS_OPT_SIZE;
+}
+
+void bhd_dns_writer_init(struct bhd_dns_writer* w,
+                         unsigned char* buf,
+                         size_t len,
+                         const struct bhd_dns_h* h)
+{
+        w->buf = buf;
+        w->len = len;
+        w->off = bhd_dns_h_pack(buf, len, h);
+        w->nnames = 0;
+        w->qd_count = 0;
+        memset(w->counts, 0, sizeof(w->counts));
+        w->err = w->off == 0;
+}
+
+int bhd_dns_write_question(struct bhd_dns_writer* w,
+                           const unsigned char* name,
+                           uint16_t qtype,
+                           uint16_t qclass)
+{
+        uint16_t u16;
+
+        if (w->err ||
+            w->counts[BHD_DNS_SECTION_AN] ||
+            w->counts[BHD_DNS_SECTION_NS] ||
+            w->counts[BHD_DNS_SECTION_AR] ||
+            bhd_dns_write_name(w, name) ||
+            w->off + 4 > w->len)
+        {
+                w->err = 1;
+                return -1;
+        }
+
+        u16 = htons(qtype);
+        memcpy(w->buf + w->off, &u16, 2);
+        u16 = htons(qclass);
+        memcpy(w->buf + w->off + 2, &u16, 2);
+        w->off += 4;
+        w->qd_count++;
+
+        return 0;
+}
+
+int bhd_dns_write_rr(struct bhd_dns_writer* w,
+                     enum bhd_dns_section section,
+                     const unsigned char* name,
+                     const struct bhd_dns_rr* rr,
+                     const unsigned char* rdata)
+{
+        if (bhd_dns_write_name(w, name) ||
+            !bhd_dns_write_fixed(w,
+                                 section,
+                                 rr->type,
+                                 rr->class,
+                                 rr->ttl,
+                                 rr->rdlength) ||
+            w->off + rr->rdlength > w->len)
+        {
+                w->err = 1;
+                return -1;
+        }
+
+        if (rr->rdlength)
+        {
+                memcpy(w->buf + w->off, rdata, rr->rdlength);
+                w->off += rr->rdlength;
+        }
+
+        return 0;
+}
+
+int bhd_dns_write_a(struct bhd_dns_writer* w,
+                    enum bhd_dns_section section,
+                    const unsigned char* name,
+                    uint32_t ttl,
+                    uint32_t addr)
+{
+        struct bhd_dns_rr rr;
+
+        rr.type = BHD_DNS_QTYPE_A;
+        rr.class = BHD_DNS_CLASS_IN;
+        rr.ttl = ttl;
+        rr.rdlength = 4;
+
+        return bhd_dns_write_rr(w,
+                                section,
+                                name,
+                                &rr,
+                                (const unsigned char*)&addr);
+}
+
+int bhd_dns_write_aaaa(struct bhd_dns_writer* w,
+                       enum bhd_dns_section section,
+                       const unsigned char* name,
+                       uint32_t ttl,
+                       const unsigned char* addr)
+{
+        struct bhd_dns_rr rr;
+
+        rr.type = BHD_DNS_QTYPE_AAAA;
+        rr.class = BHD_DNS_CLASS_IN;
+        rr.ttl = ttl;
+        rr.rdlength = 16;
+
+        return bhd_dns_write_rr(w, section, name, &rr, addr);
+}
+
+int bhd_dns_write_cname(struct bhd_dns_writer* w,
+                        enum bhd_dns_section section,
+                        const unsigned char* name,
+                        uint32_t ttl,
+                        const unsigned char* target)
+{
+        uint16_t u16;
+        size_t rdl;
+
+        if (bhd_dns_write_name(w, name))
+        {
+                w->err = 1;
+                return -1;
+        }
+        /* The rdlength is known when the target is compressed */
+        rdl = bhd_dns_write_fixed(w,
+                                  section,
+                                  BHD_DNS_QTYPE_CNAME,
+                                  BHD_DNS_CLASS_IN,
+                                  ttl,
+                                  0);
+        if (!rdl || bhd_dns_write_name(w, target))
+        {
+                w->err = 1;
+                return -1;
+        }
+
+        u16 = htons((uint16_t)(w->off - rdl - 2));
+        memcpy(w->buf + rdl, &u16, 2);
+
+        return 0;
+}
+
+int bhd_dns_write_soa(struct bhd_dns_writer* w,
+                      enum bhd_dns_section section,
+                      const unsigned char* name,
+                      uint32_t ttl,
+                      const unsigned char* mname,
+                      const unsigned char* rname,
+                      const struct bhd_dns_rr_soa* soa)
+{
+        uint32_t u32[5];
+        uint16_t u16;
+        size_t rdl;
+
+        if (bhd_dns_write_name(w, name))
+        {
+                w->err = 1;
+                return -1;
+        }
+        rdl = bhd_dns_write_fixed(w,
+                                  section,
+                                  BHD_DNS_QTYPE_SOA,
+                                  BHD_DNS_CLASS_IN,
+                                  ttl,
+                                  0);
+        if (!rdl ||
+            bhd_dns_write_name(w, mname) ||
+            bhd_dns_write_name(w, rname) ||
+            w->off + sizeof(u32) > w->len)
+        {
+                w->err = 1;
+                return -1;
+        }
+
+        u32[0] = htonl(soa->serial);
+        u32[1] = htonl(soa->refresh);
+        u32[2] = htonl(soa->retry);
+        u32[3] = htonl(soa->expire);
+        u32[4] = htonl(soa->minimum);
+        memcpy(w->buf + w->off, u32, sizeof(u32));
+        w->off += sizeof(u32);
+
+        u16 = htons((uint16_t)(w->off - rdl - 2));
+        memcpy(w->buf + rdl, &u16, 2);
+
+        return 0;
+}
+
+int bhd_dns_write_opt(struct bhd_dns_writer* w,
+                      const struct bhd_dns_rr_opt* opt,
+                      const unsigned char* options)
+{
+        static const unsigned char root = 0;
+        struct bhd_dns_rr rr;
+
+        rr.type = BHD_DNS_QTYPE_OPT;
+        rr.class = opt->udp_size;
+        rr.ttl = (uint32_t)opt->ext_rcode << 24 |
+                (uint32_t)opt->version << 16 |
+                opt->flags;
+        rr.rdlength = opt->optlen;
+
+        return bhd_dns_write_rr(w, BHD_DNS_SECTION_AR, &root, &rr, options);
+}
+
+size_t bhd_dns_writer_finish(struct bhd_dns_writer* w)
+{
+        uint16_t u16;
+
+        if (w->err)
+        {
+                return 0;
+        }
+
+        u16 = htons(w->qd_count);
+        memcpy(w->buf + 4, &u16, 2);
+        for (int i = 0; i < 3; i++)
+        {
+                u16 = htons(w->counts[i]);
+                memcpy(w->buf + 6 + 2 * i, &u16, 2);
+        }
+
+        return w->off;
+}
+
+static int bhd_dns_write_name(struct bhd_dns_writer* w,
+                              const unsigned char* name)
+{
+        size_t n = 0;
+
+        if (w->err)
+        {
+                return -1;
+        }
+
+        /* Find the longest suffix already written, see RFC 1035
+           4.1.4 */
+        for (;;)
+        {
+                uint8_t l = name[n];
+
+                if (l > BHD_DNS_MAX_LABEL || n + l + 1 > BHD_DNS_MAX_NAME)
+                {
+                        return -1;
+                }
+                if (l == 0)
+                {
+                        /* No suffix found, the root ends the name */
+                        if (w->off + 1 > w->len)
+                        {
+                                return -1;
+                        }
+                        w->buf[w->off++] = 0;
+                        return 0;
+                }
+                for (unsigned int i = 0; i < w->nnames; i++)
+                {
+                        uint16_t t = w->names[i];
+                        uint16_t ptr;
+
+                        if (w->buf[t] != l ||
+                            !bhd_dns_name_eq(w->buf, w->off, t, name + n))
+                        {
+                                continue;
+                        }
+                        if (w->off + 2 > w->len)
+                        {
+                                return -1;
+                        }
+                        ptr = htons((uint16_t)(0xc000 | t));
+                        memcpy(w->buf + w->off, &ptr, 2);
+                        w->off += 2;
+                        return 0;
+                }
+
+                /* Write the label, the name from here may be pointed to
+                   by later names */
+                if (w->off + l + 1 > w->len)
+                {
+                        return -1;
+                }
+                if (w->nnames < BHD_DNS_WRITER_NAMES && w->off < 0x4000)
+                {
+                        w->names[w->nnames++] = (uint16_t)w->off;
+                }
+                memcpy(w->buf + w->off, name + n, (size_t)l + 1);
+                w->off += (size_t)l + 1;
+                n += (size_t)l + 1;
+        }
+}
+
+static size_t bhd_dns_write_fixed(struct bhd_dns_writer* w,
+                                  enum bhd_dns_section section,
+                                  uint16_t type,
+                                  uint16_t class,
+                                  uint32_t ttl,
+                                  uint16_t rdlength)
+{
+        uint32_t u32;
+        uint16_t u16;
+        size_t rdl;
+
+        /* Records are written in section order */
+        for (int i = (int)section + 1; i < 3; i++)
+        {
+                if (w->counts[i])
+                {
+                        return 0;
+                }
+        }
+        if (w->err || w->off + BHD_DNS_RR_FIXED > w->len)
+        {
+                return 0;
+        }
+
+        u16 = htons(type);
+        memcpy(w->buf + w->off, &u16, 2);
+        u16 = htons(class);
+        memcpy(w->buf + w->off + 2, &u16, 2);
+        u32 = htonl(ttl);
+        memcpy(w->buf + w->off + 4, &u32, 4);
+        u16 = htons(rdlength);
+        memcpy(w->buf + w->off + 8, &u16, 2);
+        rdl = w->off + 8;
+        w->off += BHD_DNS_RR_FIXED;
+        w->counts[section]++;
+
+        return rdl;
+}
+
+static int bhd_dns_name_eq(const unsigned char* buf,
+                           size_t len,
+                           size_t off,
+                           const unsigned char* name)
+{
+        for (int hops = 0; hops < BHD_DNS_MAX_HOPS && off < len; hops++)
+        {
+                uint8_t l = buf[off];
+
+                if ((l & 0xc0) == 0xc0)
+                {
+                        if (off + 2 > len)
+                        {
+                                return 0;
+                        }
+                        off = (size_t)(l & 0x3f) << 8 | buf[off + 1];
+                        continue;
+                }
+                if (l != *name || off + l + 1 > len)
+                {
+                        return 0;
+                }
+                if (l == 0)
+                {
+                        return 1;
+                }
+                for (uint8_t i = 1; i <= l; i++)
+                {
+                        unsigned char a = buf[off + i];
+                        unsigned char b = name[i];
+
+                        /* Only ASCII letters differ in case */
+                        if (a != b &&
+                            ((a | 0x20) != (b | 0x20) ||
+                             (a | 0x20) < 'a' ||
+                             (a | 0x20) > 'z'))
+                        {
+                                return 0;
+                        }
+                }
+                off += (size_t)l + 1;
+                name += (size_t)l + 1;
+        }
+
+        return 0;
+}
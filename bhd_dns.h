@@ -17,6 +17,20 @@
 
 #define BHD_DNS_H_SIZE 12
 #define BHD_DNS_MAX_LABEL 63
+#define BHD_DNS_MAX_NAME 255
+/* Size of type, class, ttl and rdlength of a resource record */
+#define BHD_DNS_RR_FIXED 10
+/* Size of A and AAAA records with a compressed name */
+#define BHD_DNS_RR_A_SIZE (2 + BHD_DNS_RR_FIXED + 4)
+#define BHD_DNS_RR_AAAA_SIZE (2 + BHD_DNS_RR_FIXED + 16)
+/* Size of an OPT record without options */
+#define BHD_DNS_OPT_SIZE (1 + BHD_DNS_RR_FIXED)
+/* Max UDP payload without EDNS, RFC 1035 */
+#define BHD_DNS_UDP_SIZE 512
+/* DNSSEC OK flag of OPT, RFC 3225 */
+#define BHD_DNS_OPT_DO 0x8000
+/* Names a writer remembers for compression */
+#define BHD_DNS_WRITER_NAMES 64
 
 enum bhd_dns_h_opcode
 {
@@ -25,6 +39,16 @@ enum bhd_dns_h_opcode
         BHD_DNS_OP_STATUS = 2,
 };
 
+enum bhd_dns_h_rcode
+{
+        BHD_DNS_RCODE_NOERROR = 0,
+        BHD_DNS_RCODE_FORMERR = 1,
+        BHD_DNS_RCODE_SERVFAIL = 2,
+        BHD_DNS_RCODE_NXDOMAIN = 3,
+        BHD_DNS_RCODE_NOTIMP = 4,
+        BHD_DNS_RCODE_REFUSED = 5,
+};
+
 enum bhd_dns_h_qtype
 {
         /* type subset */
@@ -38,6 +62,10 @@ enum bhd_dns_h_qtype
         BHD_DNS_QTYPE_MINFO = 14,
         BHD_DNS_QTYPE_MX = 15,
         BHD_DNS_QTYPE_TXT = 16,
+        BHD_DNS_QTYPE_AAAA = 28,
+        BHD_DNS_QTYPE_OPT = 41,
+        BHD_DNS_QTYPE_SVCB = 64,
+        BHD_DNS_QTYPE_HTTPS = 65,
         /* qtype elements */
         BHD_DNS_QTYPE_AXFR = 252,
         BHD_DNS_QTYPE_MAILA = 254,
@@ -125,6 +153,103 @@ struct bhd_dns_q_section
         uint16_t qd_count;
 };
 
+/* A question as found in a message. Name is an offset into the
+   message, end is the offset of the first byte after the question. */
+struct bhd_dns_question
+{
+        size_t name;
+        size_t end;
+        uint16_t qtype;
+        uint16_t qclass;
+};
+
+/* A resource record as found in a message. Name and rdata are
+   offsets into the message. */
+struct bhd_dns_rr
+{
+        size_t name;
+        size_t rdata;
+        uint32_t ttl;
+        uint16_t type;
+        uint16_t class;
+        uint16_t rdlength;
+};
+
+/* A view of a message, nothing is copied out of the buffer. The
+   sections are offsets into the message, and end is the offset of the
+   first byte after the last record. The first question is unpacked
+   when there is one. */
+struct bhd_dns_msg
+{
+        const unsigned char* buf;
+        size_t len;
+        struct bhd_dns_h h;
+        struct bhd_dns_question q;
+        size_t an;
+        size_t ns;
+        size_t ar;
+        size_t end;
+};
+
+enum bhd_dns_section
+{
+        BHD_DNS_SECTION_AN = 0,
+        BHD_DNS_SECTION_NS = 1,
+        BHD_DNS_SECTION_AR = 2,
+};
+
+/* Reads the records of a message one at a time, in order. */
+struct bhd_dns_rr_reader
+{
+        const unsigned char* buf;
+        size_t len;
+        size_t off;
+        /* Records left in the current section */
+        uint16_t left;
+        uint16_t counts[3];
+        uint8_t section;
+};
+
+/* Writes a message, names are compressed against the names already
+   written. The counts in the header are set when finished. */
+struct bhd_dns_writer
+{
+        unsigned char* buf;
+        size_t len;
+        size_t off;
+        /* Offsets of labels written, candidates for compression */
+        uint16_t names[BHD_DNS_WRITER_NAMES];
+        unsigned int nnames;
+        uint16_t qd_count;
+        uint16_t counts[3];
+        /* Set when a write did not fit */
+        int err;
+};
+
+/* OPT pseudo record, RFC 6891. Options is an offset into the
+   message. */
+struct bhd_dns_rr_opt
+{
+        uint16_t udp_size;
+        uint8_t ext_rcode;
+        uint8_t version;
+        uint16_t flags;
+        size_t options;
+        uint16_t optlen;
+};
+
+/* SOA rdata, mname and rname are offsets into the message */
+struct bhd_dns_rr_soa
+{
+        size_t mname;
+        size_t rname;
+        uint32_t serial;
+        uint32_t refresh;
+        uint32_t retry;
+        uint32_t expire;
+        uint32_t minimum;
+};
+
 struct bhd_dns_rr_a
 {
         uint16_t name;
@@ -135,6 +260,16 @@ struct bhd_dns_rr_a
         uint32_t addr;
 };
 
+struct bhd_dns_rr_aaaa
+{
+        uint16_t name;
+        uint16_t type;
+        uint16_t class;
+        uint32_t ttl;
+        uint16_t rdlength;
+        unsigned char addr[16];
+};
+
 /**
  * Unpack a DNS header from the provided buffer.
  * @param bhd_dns_h struct to populate.
@@ -157,10 +292,12 @@ size_t bhd_dns_h_pack(unsigned char*, size_t, const struct bhd_dns_h*);
  * to any referenced memory as it will be overwritten.
  * @param query section struct with qd_count populated.
  * @param buffer to read from.
+ * @param size of the buffer in bytes.
  * @return number of bytes read from the buffer; 0 indicates an error.
  */
 size_t bhd_dns_q_section_unpack(struct bhd_dns_q_section*,
-                                const unsigned char*);
+                                const unsigned char*,
+                                size_t);
 
 /**
  * Write a dns query section to a buffer.
@@ -173,6 +310,326 @@ size_t bhd_dns_q_section_pack(unsigned char*,
                               size_t,
                               const struct bhd_dns_q_section*);
 
+/**
+ * Find the end of a domain name in a message. A compression pointer
+ * terminates the name.
+ * @param buffer holding the message.
+ * @param size of the message in bytes.
+ * @param offset of the name.
+ * @return offset of the first byte after the name; 0 indicates an error.
+ */
+size_t bhd_dns_name_skip(const unsigned char*, size_t, size_t);
+
+/**
+ * Read a domain name from a message, following compression pointers.
+ * A pointer must point before itself, so a name can not loop.
+ * @param buffer holding the message.
+ * @param size of the message in bytes.
+ * @param offset of the name.
+ * @param buffer of at least BHD_DNS_MAX_NAME bytes to write the name
+ *        to, in wire format without compression.
+ * @return length of the name written; 0 indicates an error.
+ */
+size_t bhd_dns_name_read(const unsigned char*,
+                         size_t,
+                         size_t,
+                         unsigned char*);
+
+/**
+ * Find the end of the question section of a message, without
+ * unpacking it.
+ * @param buffer holding the message.
+ * @param size of the message in bytes.
+ * @param offset of the question section.
+ * @param number of questions.
+ * @return offset of the first byte after the question section;
+ *         0 indicates an error.
+ */
+size_t bhd_dns_q_section_skip(const unsigned char*, size_t, size_t, uint16_t);
+
+/**
+ * Unpack a question from a message.
+ * @param question struct to populate.
+ * @param buffer holding the message.
+ * @param size of the message in bytes.
+ * @param offset of the question.
+ * @return offset of the first byte after the question;
+ *         0 indicates an error.
+ */
+size_t bhd_dns_question_unpack(struct bhd_dns_question*,
+                               const unsigned char*,
+                               size_t,
+                               size_t);
+
+/**
+ * Unpack a message into a view of its header and sections. All
+ * records are checked to be within the message, and no memory is
+ * allocated.
+ * @param msg struct to populate, it points into the buffer.
+ * @param buffer holding the message.
+ * @param size of the message in bytes.
+ * @return 0 on success.
+ */
+int bhd_dns_msg_unpack(struct bhd_dns_msg*, const unsigned char*, size_t);
+
+/**
+ * Unpack a resource record from a message.
+ * @param rr struct to populate.
+ * @param buffer holding the message.
+ * @param size of the message in bytes.
+ * @param offset of the resource record.
+ * @return offset of the first byte after the resource record;
+ *         0 indicates an error.
+ */
+size_t bhd_dns_rr_unpack(struct bhd_dns_rr*,
+                         const unsigned char*,
+                         size_t,
+                         size_t);
+
+/**
+ * Unpack the rdata of a SOA resource record.
+ * @param soa struct to populate.
+ * @param buffer holding the message.
+ * @param size of the message in bytes.
+ * @param the resource record, must be of type SOA.
+ * @return 0 on success.
+ */
+int bhd_dns_rr_soa_unpack(struct bhd_dns_rr_soa*,
+                          const unsigned char*,
+                          size_t,
+                          const struct bhd_dns_rr*);
+
+/**
+ * Turn a query into its response in place, by setting the flags and
+ * counts of the header. The opcode, rd, ad and cd flags and the
+ * question are kept.
+ * @param buffer holding the message, at least BHD_DNS_H_SIZE bytes.
+ * @param response code.
+ * @param number of answers.
+ * @return void.
+ */
+void bhd_dns_h_respond(unsigned char*, uint8_t, uint16_t);
+
+/**
+ * Start reading the records of a message.
+ * @param reader to initialize.
+ * @param message view, from bhd_dns_msg_unpack.
+ * @return void.
+ */
+void bhd_dns_rr_reader_init(struct bhd_dns_rr_reader*,
+                            const struct bhd_dns_msg*);
+
+/**
+ * Read the next record of a message.
+ * @param reader.
+ * @param rr struct to populate.
+ * @param set to the section of the record, may be NULL.
+ * @return 1 if a record was read, 0 after the last record and -1 on
+ *         error.
+ */
+int bhd_dns_rr_next(struct bhd_dns_rr_reader*,
+                    struct bhd_dns_rr*,
+                    enum bhd_dns_section*);
+
+/**
+ * Read the address of an A record.
+ * @param address to write, in network order.
+ * @param buffer holding the message.
+ * @param the resource record, must be of type A.
+ * @return 0 on success.
+ */
+int bhd_dns_rr_a_unpack(uint32_t*,
+                        const unsigned char*,
+                        const struct bhd_dns_rr*);
+
+/**
+ * Read the address of an AAAA record.
+ * @param 16 bytes to write the address to.
+ * @param buffer holding the message.
+ * @param the resource record, must be of type AAAA.
+ * @return 0 on success.
+ */
+int bhd_dns_rr_aaaa_unpack(unsigned char*,
+                           const unsigned char*,
+                           const struct bhd_dns_rr*);
+
+/**
+ * Read the target of a CNAME record.
+ * @param buffer of at least BHD_DNS_MAX_NAME bytes to write the name
+ *        to, in wire format without compression.
+ * @param buffer holding the message.
+ * @param size of the message in bytes.
+ * @param the resource record, must be of type CNAME.
+ * @return length of the name written; 0 indicates an error.
+ */
+size_t bhd_dns_rr_cname_unpack(unsigned char*,
+                               const unsigned char*,
+                               size_t,
+                               const struct bhd_dns_rr*);
+
+/**
+ * Unpack an OPT pseudo record.
+ * @param opt struct to populate.
+ * @param the resource record, must be of type OPT.
+ * @return 0 on success.
+ */
+int bhd_dns_rr_opt_unpack(struct bhd_dns_rr_opt*, const struct bhd_dns_rr*);
+
+/**
+ * Remove the OPT record from the additional section of a message.
+ * @param buffer holding the message.
+ * @param size of the message in bytes, updated.
+ * @param opt struct to populate if the OPT record is found.
+ * @return 1 if the OPT record was removed, 0 if there is none and -1
+ *         if the message is malformed.
+ */
+int bhd_dns_opt_remove(unsigned char*, size_t*, struct bhd_dns_rr_opt*);
+
+/**
+ * Append an OPT record without options to a message that has none.
+ * @param buffer holding the message.
+ * @param size of the message in bytes.
+ * @param size of the buffer in bytes.
+ * @param opt to write, options are not used.
+ * @return the new size of the message; 0 if it did not fit.
+ */
+size_t bhd_dns_opt_append(unsigned char*,
+                          size_t,
+                          size_t,
+                          const struct bhd_dns_rr_opt*);
+
+/**
+ * Start writing a message.
+ * @param writer to initialize.
+ * @param buffer to write to.
+ * @param size of the buffer in bytes.
+ * @param header, its counts are set by bhd_dns_writer_finish.
+ * @return void.
+ */
+void bhd_dns_writer_init(struct bhd_dns_writer*,
+                         unsigned char*,
+                         size_t,
+                         const struct bhd_dns_h*);
+
+/**
+ * Write a question. Questions are written before any record.
+ * @param writer.
+ * @param name in wire format, uncompressed.
+ * @param qtype.
+ * @param qclass.
+ * @return 0 on success.
+ */
+int bhd_dns_write_question(struct bhd_dns_writer*,
+                           const unsigned char*,
+                           uint16_t,
+                           uint16_t);
+
+/**
+ * Write a record with opaque rdata. Records are written in section
+ * order.
+ * @param writer.
+ * @param section of the record.
+ * @param name in wire format, uncompressed.
+ * @param the record, name and rdata are not used.
+ * @param rdata of rr->rdlength bytes.
+ * @return 0 on success.
+ */
+int bhd_dns_write_rr(struct bhd_dns_writer*,
+                     enum bhd_dns_section,
+                     const unsigned char*,
+                     const struct bhd_dns_rr*,
+                     const unsigned char*);
+
+/**
+ * Write an A record.
+ * @param writer.
+ * @param section of the record.
+ * @param name in wire format, uncompressed.
+ * @param ttl.
+ * @param address in network order.
+ * @return 0 on success.
+ */
+int bhd_dns_write_a(struct bhd_dns_writer*,
+                    enum bhd_dns_section,
+                    const unsigned char*,
+                    uint32_t,
+                    uint32_t);
+
+/**
+ * Write an AAAA record.
+ * @param writer.
+ * @param section of the record.
+ * @param name in wire format, uncompressed.
+ * @param ttl.
+ * @param address, 16 bytes.
+ * @return 0 on success.
+ */
+int bhd_dns_write_aaaa(struct bhd_dns_writer*,
+                       enum bhd_dns_section,
+                       const unsigned char*,
+                       uint32_t,
+                       const unsigned char*);
+
+/**
+ * Write a CNAME record, the target is compressed too.
+ * @param writer.
+ * @param section of the record.
+ * @param name in wire format, uncompressed.
+ * @param ttl.
+ * @param target in wire format, uncompressed.
+ * @return 0 on success.
+ */
+int bhd_dns_write_cname(struct bhd_dns_writer*,
+                        enum bhd_dns_section,
+                        const unsigned char*,
+                        uint32_t,
+                        const unsigned char*);
+
+/**
+ * Write a SOA record, mname and rname are compressed too.
+ * @param writer.
+ * @param section of the record.
+ * @param name in wire format, uncompressed.
+ * @param ttl.
+ * @param mname in wire format, uncompressed.
+ * @param rname in wire format, uncompressed.
+ * @param the soa, mname and rname are not used.
+ * @return 0 on success.
+ */
+int bhd_dns_write_soa(struct bhd_dns_writer*,
+                      enum bhd_dns_section,
+                      const unsigned char*,
+                      uint32_t,
+                      const unsigned char*,
+                      const unsigned char*,
+                      const struct bhd_dns_rr_soa*);
+
+/**
+ * Write an OPT pseudo record to the additional section.
+ * @param writer.
+ * @param the opt record.
+ * @param options of opt->optlen bytes, options is not used.
+ * @return 0 on success.
+ */
+int bhd_dns_write_opt(struct bhd_dns_writer*,
+                      const struct bhd_dns_rr_opt*,
+                      const unsigned char*);
+
+/**
+ * Finish a message, the counts are written to the header.
+ * @param writer.
+ * @return the length of the message; 0 if it did not fit.
+ */
+size_t bhd_dns_writer_finish(struct bhd_dns_writer*);
+
+/**
+ * Check if a response is negative (RFC 2308), i.e NXDOMAIN or
+ * NODATA (no error and no answers).
+ * @param header of the response.
+ * @return 1 if the response is negative.
+ */
+int bhd_dns_h_negative(const struct bhd_dns_h*);
+
 /**
  * Write a dns rr A to a buffer.
  * @param buffer.
@@ -182,6 +639,17 @@ size_t bhd_dns_q_section_pack(unsigned char*,
  */
 size_t bhd_dns_rr_a_pack(unsigned char*, size_t, const struct bhd_dns_rr_a*);
 
+/**
+ * Write a dns rr AAAA to a buffer.
+ * @param buffer.
+ * @param size of buffer in bytes.
+ * @param rr to write.
+ * @return number of bytes written.
+ */
+size_t bhd_dns_rr_aaaa_pack(unsigned char*,
+                            size_t,
+                            const struct bhd_dns_rr_aaaa*);
+
 /**
  * Free the memory referenced by the content of the provided struct.
  * The struct itself is not freed, and q is set to NULL;.
@@ -204,7 +672,16 @@ void bhd_dns_q_dump(const struct bhd_dns_q*);
  */
 void bhd_dns_rr_a_init(struct bhd_dns_rr_a* rr, const char* a);
 
+/**
+ * Initialize a resource record (AAAA), using name compression pointing
+ * to the first query section after the header (offset 12bytes).
+ * @param rr the resource record to initialize.
+ * @param a the address (IPv6 notation) to use in the response.
+ * @return void.
+ */
+void bhd_dns_rr_aaaa_init(struct bhd_dns_rr_aaaa* rr, const char* a);
+
 /* Internal functions */
-size_t bhd_dns_q_unpack(struct bhd_dns_q*, const unsigned char*);
+size_t bhd_dns_q_unpack(struct bhd_dns_q*, const unsigned char*, size_t);
 size_t bhd_dns_q_pack(unsigned char*, size_t, const struct bhd_dns_q*);
 #endif /* BHD_DNS_H */
@@ -10,12 +10,17 @@
 * file and include the License file at http://opensource.org/licenses/CDDL-1.0.
 */
 
+/* SO_REUSEPORT, recvmmsg(2) and sendmmsg(2) are not part of POSIX */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <syslog.h>
 #include <poll.h>
@@ -24,389 +29,2407 @@
 #include "bhd_dns.h"
 #include "bhd_bl.h"
 #include "bhd_cfg.h"
+#include "bhd_cache.h"
 #include "vendor/timing.h"
 
-/* Max UDP message size from RFC1035 */
-#define BUF_LEN 512
+/* Size of the stats response */
+#define STATS_LEN 4096
 /* Default timeout in ms */
 #define BHD_TIMEOUT 5000
-sig_atomic_t run;
+/* How often pending queries are checked for timeout, in ms */
+#define BHD_EXPIRE_INTERVAL 10
+/* Consecutive timeouts before an upstream is considered down */
+#define BHD_UP_MAX_FAILS 3
+/* Time before an upstream that is down is tried again, doubled for
+   each failed try, in us */
+#define BHD_UP_BACKOFF 1000000L
+/* Bounds of the time to wait for an upstream before trying another,
+   in us. The max is used until the RTT is known. */
+#define BHD_UP_MIN_RTO 200000L
+#define BHD_UP_MAX_RTO 1000000L
+/* Time to wait for upstream before a stale answer is used, in ms */
+#define BHD_STALE_DEADLINE 1800
+/* Min hedge delay, in us */
+#define BHD_HEDGE_MIN 5000L
+/* Number of samples between updates of the hedge delay */
+#define BHD_RTT_UPDATE 32
+/* Time before a failed first load of the block list is tried again,
+   doubled for each failed try up to the max, in ms */
+#define BHD_BL_RETRY 1000L
+#define BHD_BL_MAX_RETRY 300000L
+/* How often an idle thread checks if the server is stopped, in ms */
+#define BHD_IDLE_INTERVAL 500
+/* Lowest port a forward socket is bound to, and attempts at a free
+   random port */
+#define BHD_FWD_PORT_MIN 1024
+#define BHD_FWD_TRIES 16
+volatile sig_atomic_t run;
+/* Set on SIGHUP, the block list is reloaded */
+volatile sig_atomic_t reload;
 
-int bhd_srv_stat_str(char* buf, int len, const struct bhd_stats* stats);
+int bhd_srv_stat_str(char* buf,
+                     int len,
+                     const struct bhd_srv* srv,
+                     const struct bhd_stats* stats);
+
+/**
+ * Worker thread main loop.
+ */
+static void* bhd_srv_work(void* arg);
 
 /**
  * Return 0 if successful.
  */
-static int bhd_srv_serve_dns(struct bhd_srv* srv);
+static int bhd_srv_serve_dns(struct bhd_worker* w);
+
+/**
+ * Answer a blocked query in place. A and AAAA queries are answered
+ * with the configured addresses, other types with NODATA or NXDOMAIN.
+ * @param w the worker.
+ * @param m the query, replaced by the answer.
+ * @param qlen length of the question section.
+ * @param qtype type of the question.
+ * @return 0 if successful.
+ */
+static int bhd_srv_block(struct bhd_worker* w,
+                         struct bhd_msg* m,
+                         size_t qlen,
+                         uint16_t qtype);
+
+/**
+ * Serve responses from upstream.
+ * @param w the worker.
+ * @param s the forward socket to read from.
+ * @return 0 if successful.
+ */
+static int bhd_srv_serve_upstream(struct bhd_worker* w, unsigned int s);
 static int bhd_srv_serve_stats(struct bhd_srv* srv);
 
 /**
- * Default signal handler.
+ * Read the EDNS of a query from its OPT record.
+ * @param srv the server.
+ * @param e set to the client's EDNS, size is 0 if the query has no
+ *        OPT record or EDNS is disabled.
+ * @param msg the query.
+ */
+static void bhd_srv_edns(const struct bhd_srv* srv,
+                         struct bhd_edns* e,
+                         const struct bhd_dns_msg* msg);
+
+/**
+ * Fit a response to the payload size of a client. A response that is
+ * too large is truncated to its question with the tc flag set, and an
+ * OPT record is appended if the client's query had one.
+ * @param w the worker.
+ * @param buf the response, must have room for an OPT record.
+ * @param len length of the response.
+ * @param e the client's EDNS.
+ * @param ext_rcode upper bits of the response code, from the OPT
+ *        record of an upstream's response. A client without EDNS gets
+ *        SERVFAIL as they can not be sent to it.
+ * @return the new length of the response.
+ */
+static size_t bhd_srv_answer(struct bhd_worker* w,
+                             unsigned char* buf,
+                             size_t len,
+                             const struct bhd_edns* e,
+                             uint8_t ext_rcode);
+
+/**
+ * Append the OPT record advertised to the upstreams to a pending
+ * query, if EDNS is enabled.
+ */
+static void bhd_srv_query_opt(const struct bhd_srv* srv,
+                              struct bhd_pending* p);
+
+/**
+ * Create an UDP socket bound to the provided address.
+ * @param addr address in dot notation, 0.0.0.0 for any.
+ * @param port port to bind to.
+ * @param reuse if set, SO_REUSEPORT is set on the socket.
+ * @return the socket or -1 on error.
+ */
+static int bhd_srv_bind(const char* addr, uint16_t port, int reuse);
+
+/**
+ * Receive a batch of datagrams without blocking. The batch size is
+ * adapted to the number of datagrams that are queued.
+ * @param fd the socket to read from.
+ * @param msgs messages to populate.
+ * @param len size of the datagrams to read, a larger datagram is cut
+ *        to len + 1 bytes so it can be told apart. The buffers must
+ *        have room for len + 1 bytes.
+ * @param batch current batch size, updated for the next call.
+ * @return the number of messages read or -1 on error.
+ */
+static int bhd_srv_recv(int fd,
+                        struct bhd_msg* msgs,
+                        size_t len,
+                        unsigned int* batch);
+
+/**
+ * Send a batch of datagrams.
+ * @param fd the socket to write to.
+ * @param msgs the messages to send.
+ * @param n number of messages.
+ * @return the number of bytes sent.
+ */
+static size_t bhd_srv_send(int fd, const struct bhd_msg* msgs, unsigned int n);
+
+/**
+ * Check that a response is for the question of a pending query.
+ * @return 1 if the question matches.
+ */
+static int bhd_srv_same_question(const struct bhd_pending* p,
+                                 const struct bhd_msg* m);
+
+/**
+ * Queue a response to a client, the queue is flushed when full.
+ */
+static void bhd_srv_queue_down(struct bhd_worker* w,
+                               unsigned char* buf,
+                               size_t len,
+                               const struct sockaddr_in* addr);
+
+/**
+ * Queue a pending query to be sent to an upstream, the queue is flushed
+ * when full.
+ */
+static void bhd_srv_forward(struct bhd_worker* w,
+                            struct bhd_pending* p,
+                            int up,
+                            long now);
+
+/**
+ * Find a pending query with the same question, opcode and flags (qr,
+ * rd, cd and do) as a query.
+ * @param w the worker.
+ * @param q the query.
+ * @param qlen length of the question section.
+ * @param hash hash of the question section.
+ * @param dnssec the do flag of the query.
+ * @return the pending query or NULL if not found.
+ */
+static struct bhd_pending* bhd_srv_coalesce_find(struct bhd_worker* w,
+                                                 const unsigned char* q,
+                                                 size_t qlen,
+                                                 uint32_t hash,
+                                                 uint8_t dnssec);
+
+/**
+ * Add a client waiting for the response of a pending query.
+ * @return 0 on success, -1 if there is no room.
+ */
+static int bhd_srv_coalesce_add(struct bhd_worker* w,
+                                struct bhd_pending* p,
+                                const struct sockaddr_in* addr,
+                                uint16_t id,
+                                const struct bhd_edns* e);
+
+/**
+ * Send a response to all clients waiting on a pending query. Each
+ * client gets a copy with its id, fit to its payload size.
+ * @param ext_rcode upper bits of the response code, see
+ *        bhd_srv_answer.
+ * @return number of clients the response is sent to.
+ */
+static unsigned int bhd_srv_coalesce_respond(struct bhd_worker* w,
+                                             struct bhd_pending* p,
+                                             const struct bhd_msg* m,
+                                             uint8_t ext_rcode);
+
+/**
+ * Release all clients waiting on a pending query.
+ */
+static void bhd_srv_coalesce_clear(struct bhd_worker* w,
+                                   struct bhd_pending* p);
+
+/**
+ * Answer the clients of a pending query with a stale response from the
+ * cache, if there is one. The pending query is kept as a refresh of
+ * the cache entry.
+ * @param w the worker.
+ * @param p the pending query.
+ * @param now current time in us.
+ * @return 1 if the clients are answered, 0 if not.
+ */
+static int bhd_srv_stale(struct bhd_worker* w, struct bhd_pending* p, long now);
+
+/**
+ * Refresh a cache entry from upstream. The query is built from the
+ * header and question of a response served from the cache, and is
+ * subject to the prefetch rate limit.
+ * @param w the worker.
+ * @param buf the response.
+ * @param qlen length of the question section.
+ * @param now current time in us.
+ */
+static void bhd_srv_prefetch(struct bhd_worker* w,
+                             const unsigned char* buf,
+                             size_t qlen,
+                             long now);
+
+/**
+ * Check if the cache is used for a query. The cache is keyed on the
+ * question only, so answers to queries with the cd flag, which may be
+ * unvalidated, or the do flag, which carry DNSSEC records, are neither
+ * cached nor served from the cache.
+ * @param q the query.
+ * @param dnssec the do flag of the query.
+ * @return 1 if the cache is used.
+ */
+static int bhd_srv_cacheable(const unsigned char* q, uint8_t dnssec);
+
+/**
+ * FNV-1a hash of a question section.
+ */
+static uint32_t bhd_srv_qhash(const unsigned char* q, size_t len);
+
+/**
+ * Send all queued datagrams.
+ */
+static void bhd_srv_flush(struct bhd_worker* w);
+
+/**
+ * Select the upstream with the lowest smoothed RTT among those that
+ * are up. An upstream that is down is selected when it is due for a
+ * retry, or if all upstreams are down.
+ * @param w the worker.
+ * @param exclude bit mask of upstreams not to select.
+ * @param now current time in us.
+ * @return the upstream, -1 if all are excluded.
+ */
+static int bhd_srv_up_select(struct bhd_worker* w, uint32_t exclude, long now);
+
+/**
+ * Update an upstream's RTT estimate with a new sample, in us.
+ */
+static void bhd_srv_up_rtt(struct bhd_worker* w, int up, long rtt);
+
+/**
+ * Register a timeout for an upstream.
+ */
+static void bhd_srv_up_fail(struct bhd_worker* w, int up, long now);
+
+/**
+ * Time to wait for an upstream before trying another, in us.
+ */
+static long bhd_srv_up_rto(const struct bhd_upstream* u);
+
+/**
+ * Add an RTT sample (us) and update the hedge delay, which is the
+ * configured percentile of the recent samples.
+ */
+static void bhd_srv_hedge_sample(struct bhd_worker* w, long rtt);
+static int bhd_srv_cmp_long(const void* a, const void* b);
+
+/**
+ * Get a random value from the worker's pool, which is refilled from
+ * /dev/urandom when empty.
+ */
+static uint16_t bhd_srv_random(struct bhd_worker* w);
+
+/**
+ * Create a forward socket bound to a random port, RFC 5452.
+ * @return the socket or -1 on error.
+ */
+static int bhd_srv_fwd_open(struct bhd_worker* w);
+
+/**
+ * Select a forward socket at random among those that have sent less
+ * than BHD_FWD_ROTATE queries.
+ * @return index of the socket.
+ */
+static unsigned int bhd_srv_fwd_select(struct bhd_worker* w);
+
+/**
+ * Release a query sent on a forward socket. A socket that has sent
+ * BHD_FWD_ROTATE queries is bound to a new port when none of its
+ * queries are pending.
+ */
+static void bhd_srv_fwd_release(struct bhd_worker* w, unsigned int s);
+
+/**
+ * Allocate a pending query with a fresh random forward id.
+ * @return the pending query or NULL if too many queries are in flight.
+ */
+static struct bhd_pending* bhd_srv_pending_alloc(struct bhd_worker* w);
+static void bhd_srv_pending_free(struct bhd_worker* w, struct bhd_pending* p);
+
+/**
+ * Fail over pending queries whose upstreams have not responded in
+ * time, hedge queries that are slower than the hedge delay and drop
+ * all pending queries that have waited longer than BHD_TIMEOUT.
+ */
+static void bhd_srv_expire(struct bhd_worker* w, long now);
+
+/**
+ * Hit ratio, 0 if there are no hits nor misses.
+ */
+static double bhd_srv_ratio(size_t hit, size_t miss);
+
+/**
+ * Reload the block list in steps, called periodically by the thread
+ * serving stats. A reload that is asked for starts a loader thread, a
+ * loaded block list is published and the retired one is freed when no
+ * worker can use it.
+ */
+static void bhd_srv_reload(struct bhd_srv* srv);
+
+/**
+ * Block list loader thread.
+ */
+static void* bhd_srv_load(void* arg);
+
+/**
+ * Check if all workers have passed an epoch.
+ * @return 1 if all workers have seen the epoch.
+ */
+static int bhd_srv_quiescent(const struct bhd_srv* srv, uint64_t epoch);
+
+/**
+ * Default signal handler, SIGHUP reloads the block list and other
+ * signals stop the server.
  */
 static void sigh(int);
 
-int bhd_srv_init(struct bhd_srv* srv,
-                 const struct bhd_cfg* cfg,
-                 struct bhd_bl* bl,
-                 int daemon)
+int bhd_srv_init(struct bhd_srv* srv, const struct bhd_cfg* cfg, int daemon)
 {
-        struct sockaddr_in saddr;
+        struct bhd_dns_rr_a rr_a;
+        struct bhd_dns_rr_aaaa rr_aaaa;
         struct sigaction sa;
-        int ret;
+        int n = cfg->workers;
 
-        srv->stats = (struct bhd_stats){.numf = 0,
-                                        .numb = 0,
-                                        .up_tx = 0,
-                                        .up_rx = 0,
-                                        .down_tx = 0,
-                                        .down_rx = 0};
+        srv->start = timing_monotonic_usec() / 1000;
         srv->cfg = cfg;
-        srv->bl = bl;
+        srv->bl = NULL;
+        srv->bl_next = NULL;
+        srv->bl_old = NULL;
+        srv->epoch = 0;
+        srv->bl_retired = 0;
+        memset(&srv->reload, 0, sizeof(srv->reload));
+        srv->loading = 0;
+        srv->bl_retry = 0;
+        srv->bl_retry_delay = BHD_BL_RETRY;
+        srv->answered = 0;
         srv->daemon = (char)daemon;
+        srv->fd_stats = -1;
+        srv->fd_random = -1;
+
+        /* Upstream answers may be as large as the payload size
+           advertised */
+        srv->buf_len = cfg->edns_size > BHD_DNS_UDP_SIZE ?
+                cfg->edns_size : BHD_DNS_UDP_SIZE;
+        srv->buf_cap = srv->buf_len + BHD_DNS_OPT_SIZE;
+
+        /* The addresses are the same for all blocked names */
+        bhd_dns_rr_a_init(&rr_a, cfg->baddr);
+        bhd_dns_rr_a_pack(srv->bl_a, sizeof(srv->bl_a), &rr_a);
+        bhd_dns_rr_aaaa_init(&rr_aaaa, cfg->baddr6);
+        bhd_dns_rr_aaaa_pack(srv->bl_aaaa, sizeof(srv->bl_aaaa), &rr_aaaa);
 
         run = 0;
+        /* The first reload loads the block list */
+        reload = cfg->bp[0] != '\0';
 
         sa.sa_flags = 0;
         sa.sa_handler = &sigh;
         sigfillset(&sa.sa_mask);
 
-        if (sigaction(SIGINT, &sa, NULL))
+        if (sigaction(SIGINT, &sa, NULL) || sigaction(SIGHUP, &sa, NULL))
         {
                 syslog(LOG_WARNING, "Failed to install sighandler %m");
         }
 
+        if (n == 0)
+        {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+                n = cpus > 0 ? (int)cpus : 1;
+        }
+#ifndef SO_REUSEPORT
+        if (n > 1)
+        {
+                syslog(LOG_WARNING, "SO_REUSEPORT not supported, using 1 worker");
+                n = 1;
+        }
+#endif
+
         /* Set up forward address */
         syslog(LOG_INFO, "Listen address: %s@%d", cfg->laddr, cfg->lport);
-        syslog(LOG_INFO, "Forward address: %s@%d", cfg->faddr, cfg->fport);
-        srv->fd_forward = socket(AF_INET, SOCK_DGRAM, 0);
-        if (srv->fd_forward < 0)
+        syslog(LOG_INFO, "Workers: %d", n);
+        if (cfg->nforward == 0)
         {
-                syslog(LOG_ERR, "Could not create socket: %m");
+                syslog(LOG_ERR, "No forward address configured");
                 return -1;
         }
         memset(&srv->faddr, 0, sizeof(srv->faddr));
-        srv->faddr.sin_family = AF_INET;
-        srv->faddr.sin_port = htons(cfg->fport);
-        if (inet_pton(AF_INET, cfg->faddr, &srv->faddr.sin_addr) < 0)
+        for (int i = 0; i < cfg->nforward; i++)
+        {
+                syslog(LOG_INFO,
+                       "Forward address: %s@%d",
+                       cfg->faddr[i],
+                       cfg->fports[i]);
+                srv->faddr[i].sin_family = AF_INET;
+                srv->faddr[i].sin_port = htons(cfg->fports[i]);
+                if (inet_pton(AF_INET,
+                              cfg->faddr[i],
+                              &srv->faddr[i].sin_addr) != 1)
+                {
+                        syslog(LOG_ERR,
+                               "Invalid address '%s'",
+                               cfg->faddr[i]);
+                        return -1;
+                }
+        }
+        srv->nforward = cfg->nforward;
+
+        /* Forward ids must not be predictable, RFC 5452. The device is
+           opened before privileges are dropped. */
+        srv->fd_random = open("/dev/urandom", O_RDONLY);
+        if (srv->fd_random < 0)
+        {
+                syslog(LOG_ERR, "Could not open /dev/urandom: %m");
+                return -1;
+        }
+
+        srv->workers = calloc((size_t)n, sizeof(struct bhd_worker));
+        if (!srv->workers)
+        {
+                syslog(LOG_ERR, "%s:calloc: %m", __func__);
+                return -1;
+        }
+        srv->nworkers = n;
+
+        for (int i = 0; i < n; i++)
+        {
+                struct bhd_worker* w = &srv->workers[i];
+
+                w->srv = srv;
+                w->fd_listen = -1;
+                for (int j = 0; j < BHD_FWD_SOCKETS; j++)
+                {
+                        w->fwd[j].fd = -1;
+                }
+                for (uint16_t j = 0; j < BHD_MAX_PENDING; j++)
+                {
+                        w->pfree[j] = (uint16_t)(BHD_MAX_PENDING - 1 - j);
+                }
+                w->npfree = BHD_MAX_PENDING;
+                /* Share the prefetch limit among the workers */
+                w->pf_rate = (cfg->prefetch_limit + (unsigned int)n - 1) /
+                        (unsigned int)n;
+                w->pf_tokens = w->pf_rate;
+                for (uint16_t j = 0; j < BHD_MAX_WAITERS; j++)
+                {
+                        w->wfree[j] = (uint16_t)(BHD_MAX_WAITERS - 1 - j);
+                }
+                w->nwfree = BHD_MAX_WAITERS;
+                w->batch_down = BHD_BATCH_MIN;
+                w->batch_up = BHD_BATCH_MIN;
+                for (int j = 0; j < BHD_MAX_UPSTREAM; j++)
+                {
+                        w->up[j].srtt = 0;
+                        w->up[j].rttvar = 0;
+                        w->up[j].retry = 0;
+                        w->up[j].fails = 0;
+                }
+                w->rxbuf = malloc(BHD_BATCH * srv->buf_cap);
+                if (!w->rxbuf)
+                {
+                        syslog(LOG_ERR, "%s:malloc: %m", __func__);
+                        return -1;
+                }
+                for (int j = 0; j < BHD_BATCH; j++)
+                {
+                        w->rx[j].buf = w->rxbuf + j * srv->buf_cap;
+                }
+                if (cfg->cache_size)
+                {
+                        w->cache = bhd_cache_create((size_t)cfg->cache_size *
+                                                    1024 / (size_t)n,
+                                                    cfg->prefetch,
+                                                    (long)cfg->stale);
+                        if (!w->cache)
+                        {
+                                syslog(LOG_ERR, "Could not create cache: %m");
+                                return -1;
+                        }
+                }
+                w->nrnd = 0;
+
+                /* Responses are only accepted on the socket a query
+                   is sent on, a spoofed response has to guess the
+                   port as well as the id */
+                for (int j = 0; j < BHD_FWD_SOCKETS; j++)
+                {
+                        w->fwd[j].fd = bhd_srv_fwd_open(w);
+                        if (w->fwd[j].fd < 0)
+                        {
+                                return -1;
+                        }
+                        w->fwd[j].sent = 0;
+                        w->fwd[j].pending = 0;
+                }
+
+                /* Set up listening socket, the kernel distributes
+                   clients among the workers' sockets */
+                w->fd_listen = bhd_srv_bind(cfg->laddr, cfg->lport, n > 1);
+                if (w->fd_listen < 0)
+                {
+                        return -1;
+                }
+        }
+
+        /* Stats socket */
+        srv->fd_stats = bhd_srv_bind(cfg->laddr, cfg->sport, 0);
+        if (srv->fd_stats < 0)
+        {
+                return -1;
+        }
+
+        return 0;
+}
+
+static int bhd_srv_bind(const char* addr, uint16_t port, int reuse)
+{
+        struct sockaddr_in saddr;
+        int fd;
+        int ret;
+
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0)
+        {
+                syslog(LOG_ERR, "Could not create socket: %m");
+                return -1;
+        }
+#ifdef SO_REUSEPORT
+        if (reuse)
+        {
+                int on = 1;
+
+                if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+                {
+                        syslog(LOG_ERR, "setsockopt SO_REUSEPORT: %m");
+                        close(fd);
+                        return -1;
+                }
+        }
+#else
+        (void)reuse;
+#endif
+        memset(&saddr, 0, sizeof(saddr));
+        saddr.sin_family = AF_INET;
+        saddr.sin_port = htons(port);
+        if (strncmp(addr, "0.0.0.0", 7) == 0)
+        {
+                saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        }
+        else
+        {
+                uint32_t na;
+
+                if (inet_pton(AF_INET, addr, &na) < 0)
+                {
+                        syslog(LOG_ERR, "Invalid address '%s': %m", addr);
+                        close(fd);
+                        return -1;
+                }
+
+                saddr.sin_addr.s_addr = na;
+        }
+        ret = bind(fd, (struct sockaddr*)&saddr, sizeof(saddr));
+        if (ret < 0)
+        {
+                syslog(LOG_ERR, "Failed to bind: %m");
+                close(fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+int bhd_serve(struct bhd_srv* srv)
+{
+        struct bhd_stats stats;
+        struct pollfd fds[1];
+        sigset_t mask;
+        sigset_t omask;
+        int started = 0;
+
+        run = 1;
+
+        /* Signals are handled by this thread only, workers notice that
+           run is cleared within BHD_IDLE_INTERVAL */
+        sigfillset(&mask);
+        pthread_sigmask(SIG_BLOCK, &mask, &omask);
+        for (; started < srv->nworkers; started++)
+        {
+                struct bhd_worker* w = &srv->workers[started];
+
+                if (pthread_create(&w->thread, NULL, &bhd_srv_work, w))
+                {
+                        syslog(LOG_ERR, "pthread_create: %m");
+                        run = 0;
+                        break;
+                }
+        }
+        pthread_sigmask(SIG_SETMASK, &omask, NULL);
+
+        fds[0].fd = srv->fd_stats;
+        fds[0].events = POLLIN;
+        while(run)
+        {
+                int timeout;
+                int ready;
+
+                /* Wake up more often while a block list reload is in
+                   progress */
+                bhd_srv_reload(srv);
+                timeout = srv->loading || srv->bl_old ?
+                        BHD_EXPIRE_INTERVAL : BHD_IDLE_INTERVAL;
+                ready = poll(fds, 1, timeout);
+
+                if (ready < 0)
+                {
+                        /* error */
+                        if (errno != EINTR)
+                        {
+                                syslog(LOG_WARNING, "%s:poll:%m", __func__);
+                        }
+                        continue;
+                }
+
+                if (fds[0].revents & POLLIN)
+                {
+                        bhd_srv_serve_stats(srv);
+                }
+        }
+
+        for (int i = 0; i < started; i++)
+        {
+                pthread_join(srv->workers[i].thread, NULL);
+        }
+        if (srv->loading)
+        {
+                pthread_join(srv->loader, NULL);
+                bhd_bl_free(srv->bl_next);
+                srv->bl_next = NULL;
+                srv->loading = 0;
+        }
+        bhd_bl_free(srv->bl_old);
+        srv->bl_old = NULL;
+
+        bhd_srv_stats(srv, &stats);
+        if (!srv->daemon)
+        {
+                printf("Stop listening\n");
+                printf("Forwarded %ld requests\n", stats.numf);
+                printf("Blocked %ld requests, %ld A, %ld AAAA, %ld HTTPS, %ld ANY, %ld other\n",
+                       stats.numb,
+                       stats.numb_a,
+                       stats.numb_aaaa,
+                       stats.numb_https,
+                       stats.numb_any,
+                       stats.numb_other);
+                printf("Timed out %ld requests\n", stats.timeout);
+                printf("Dropped %ld requests\n", stats.dropped);
+                printf("Failed %ld requests while loading\n", stats.bl_fail);
+                printf("Cache hits %ld\n", stats.cache_hit);
+                printf("Cache misses %ld\n", stats.cache_miss);
+                printf("Negative cache hits %ld\n", stats.cache_neg_hit);
+                printf("Negative cache misses %ld\n", stats.cache_neg_miss);
+                printf("Hedged %ld requests, %ld won\n",
+                       stats.hedge,
+                       stats.hedge_win);
+                printf("Coalesced %ld queries\n", stats.coalesced);
+                printf("Prefetched %ld cache entries, %ld capped\n",
+                       stats.prefetch,
+                       stats.prefetch_capped);
+                printf("Served %ld stale answers\n", stats.stale);
+                printf("Truncated %ld answers\n", stats.truncated);
+                printf("Upstream tx %ld bytes\n", stats.up_tx);
+                printf("Upstream rx %ld bytes\n", stats.up_rx);
+                printf("Downstream tx %ld bytes\n", stats.down_tx);
+                printf("Dowmstream rx %ld bytes\n", stats.down_rx);
+                for (int i = 0; i < srv->nforward; i++)
+                {
+                        printf("Upstream %s@%d: %ld queries, %ld timeouts, "
+                               "rtt %.1fms\n",
+                               srv->cfg->faddr[i],
+                               srv->cfg->fports[i],
+                               stats.up[i].queries,
+                               stats.up[i].timeouts,
+                               (double)stats.up[i].srtt / 1000.0);
+                }
+        }
+
+        for (int i = 0; i < srv->nworkers; i++)
+        {
+                close(srv->workers[i].fd_listen);
+                for (int j = 0; j < BHD_FWD_SOCKETS; j++)
+                {
+                        close(srv->workers[i].fwd[j].fd);
+                }
+                free(srv->workers[i].rxbuf);
+                bhd_cache_free(srv->workers[i].cache);
+        }
+        close(srv->fd_stats);
+        close(srv->fd_random);
+        free(srv->workers);
+        srv->workers = NULL;
+
+        return started == srv->nworkers ? 0 : -1;
+}
+
+void bhd_srv_stats(const struct bhd_srv* srv, struct bhd_stats* stats)
+{
+        size_t nsrtt[BHD_MAX_UPSTREAM] = {0};
+
+        memset(stats, 0, sizeof(*stats));
+
+        /* Counters are only written by their worker, reading them while
+           a worker is running may yield a slightly stale value. */
+        for (int i = 0; i < srv->nworkers; i++)
+        {
+                const struct bhd_stats* ws = &srv->workers[i].stats;
+
+                stats->numf += ws->numf;
+                stats->numb += ws->numb;
+                stats->numb_a += ws->numb_a;
+                stats->numb_aaaa += ws->numb_aaaa;
+                stats->numb_https += ws->numb_https;
+                stats->numb_any += ws->numb_any;
+                stats->numb_other += ws->numb_other;
+                stats->up_tx += ws->up_tx;
+                stats->up_rx += ws->up_rx;
+                stats->down_tx += ws->down_tx;
+                stats->down_rx += ws->down_rx;
+                stats->timeout += ws->timeout;
+                stats->dropped += ws->dropped;
+                stats->cache_hit += ws->cache_hit;
+                stats->cache_miss += ws->cache_miss;
+                stats->cache_neg_hit += ws->cache_neg_hit;
+                stats->cache_neg_miss += ws->cache_neg_miss;
+                stats->hedge += ws->hedge;
+                stats->hedge_win += ws->hedge_win;
+                stats->up_late += ws->up_late;
+                stats->coalesced += ws->coalesced;
+                stats->prefetch += ws->prefetch;
+                stats->prefetch_capped += ws->prefetch_capped;
+                stats->stale += ws->stale;
+                stats->truncated += ws->truncated;
+                stats->bl_fail += ws->bl_fail;
+                for (int j = 0; j < srv->nforward; j++)
+                {
+                        const struct bhd_upstream* u = &srv->workers[i].up[j];
+
+                        stats->up[j].queries += ws->up[j].queries;
+                        stats->up[j].answers += ws->up[j].answers;
+                        stats->up[j].timeouts += ws->up[j].timeouts;
+                        if (u->srtt)
+                        {
+                                stats->up[j].srtt += u->srtt;
+                                nsrtt[j]++;
+                        }
+                }
+        }
+        /* Average the workers' RTT estimates */
+        for (int j = 0; j < srv->nforward; j++)
+        {
+                if (nsrtt[j])
+                {
+                        stats->up[j].srtt /= (long)nsrtt[j];
+                }
+        }
+}
+
+static void* bhd_srv_work(void* arg)
+{
+        struct bhd_worker* w = arg;
+        struct pollfd fds[1 + BHD_FWD_SOCKETS];
+        long last_expire = timing_monotonic_usec();
+        int ret;
+
+        fds[0].fd = w->fd_listen;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < BHD_FWD_SOCKETS; i++)
+        {
+                fds[1 + i].events = POLLIN;
+        }
+
+        while(run)
+        {
+                /* Between two batches no block list is referenced */
+                __atomic_store_n(&w->epoch,
+                                 __atomic_load_n(&w->srv->epoch,
+                                                 __ATOMIC_ACQUIRE),
+                                 __ATOMIC_RELEASE);
+
+                /* Wake up more often if there are queries that
+                   may time out */
+                int timeout = w->npfree < BHD_MAX_PENDING ?
+                        BHD_EXPIRE_INTERVAL : BHD_IDLE_INTERVAL;
+                int ready;
+                long now;
+
+                /* Forward sockets are replaced as they are rotated */
+                for (int i = 0; i < BHD_FWD_SOCKETS; i++)
+                {
+                        fds[1 + i].fd = w->fwd[i].fd;
+                }
+                ready = poll(fds, 1 + BHD_FWD_SOCKETS, timeout);
+
+                if (ready < 0)
+                {
+                        /* error */
+                        syslog(LOG_WARNING, "%s:poll:%m", __func__);
+                        continue;
+                }
+
+                if (fds[0].revents & POLLIN)
+                {
+                        ret = bhd_srv_serve_dns(w);
+                        if (ret)
+                        {
+                                syslog(LOG_WARNING, "DNS query failed");
+                        }
+                }
+                for (unsigned int i = 0; i < BHD_FWD_SOCKETS; i++)
+                {
+                        if (fds[1 + i].revents & POLLIN)
+                        {
+                                ret = bhd_srv_serve_upstream(w, i);
+                                if (ret)
+                                {
+                                        syslog(LOG_WARNING,
+                                               "DNS response failed");
+                                }
+                        }
+                }
+
+                if (!w->answered && w->stats.down_tx)
+                {
+                        w->answered = 1;
+                        if (!__atomic_exchange_n(&w->srv->answered,
+                                                 1,
+                                                 __ATOMIC_RELAXED))
+                        {
+                                syslog(LOG_INFO,
+                                       "First answer %ldms after start",
+                                       timing_monotonic_usec() / 1000 -
+                                       w->srv->start);
+                        }
+                }
+
+                now = timing_monotonic_usec();
+                if (now - last_expire >= BHD_EXPIRE_INTERVAL * 1000L)
+                {
+                        bhd_srv_expire(w, now);
+                        last_expire = now;
+                }
+        }
+
+        return NULL;
+}
+
+static int bhd_srv_serve_dns(struct bhd_worker* w)
+{
+        struct bhd_dns_h h[BHD_BATCH];
+        /* Length of the question section */
+        size_t qlen[BHD_BATCH];
+        uint16_t qtype[BHD_BATCH];
+        struct bhd_edns edns[BHD_BATCH];
+        /* -1 invalid, 0 forward, 1 candidate for blocking, 2 block,
+           3 fail while the block list is loaded */
+        int verdict[BHD_BATCH];
+        const struct bhd_bl* bl = __atomic_load_n(&w->srv->bl,
+                                                  __ATOMIC_ACQUIRE);
+        /* Names of the candidates for blocking */
+        const unsigned char* names[BHD_BATCH];
+        size_t nlen[BHD_BATCH];
+        int cand[BHD_BATCH];
+        int blocked[BHD_BATCH];
+        size_t ncand = 0;
+        long now = timing_monotonic_usec();
+        int n;
+
+        n = bhd_srv_recv(w->fd_listen,
+                         w->rx,
+                         w->srv->buf_len,
+                         &w->batch_down);
+        if (n < 0)
+        {
+                syslog(LOG_WARNING, "client:recv: %m");
+                return -1;
+        }
+
+        /* Parse the whole batch */
+        for (int i = 0; i < n; i++)
+        {
+                struct bhd_msg* m = &w->rx[i];
+                struct bhd_dns_msg msg;
+
+                w->stats.down_rx += m->len;
+                verdict[i] = -1;
+                if (m->len < BHD_DNS_H_SIZE)
+                {
+                        syslog(LOG_WARNING,
+                               "client:recv %ld bytes, expected %d",
+                               m->len,
+                               BHD_DNS_H_SIZE);
+                        continue;
+                }
+                if (m->len > w->srv->buf_len)
+                {
+                        syslog(LOG_WARNING,
+                               "client:query larger than %ld bytes",
+                               w->srv->buf_len);
+                        continue;
+                }
+
+                /* The message is viewed in place, so deciding whether
+                   to block a query needs no memory allocation */
+                if (bhd_dns_msg_unpack(&msg, m->buf, m->len))
+                {
+                        syslog(LOG_WARNING,
+                               "client:malformed query (%ld bytes)",
+                               m->len);
+                        continue;
+                }
+                h[i] = msg.h;
+                qlen[i] = msg.an - BHD_DNS_H_SIZE;
+
+#if DEBUG
+                bhd_dns_h_dump(&h[i]);
+#endif
+                if (msg.end != m->len)
+                {
+#if DEBUG
+                        for (size_t j = msg.end; j < m->len; j++)
+                        {
+                                printf("%02x:", m->buf[j]);
+                        }
+                        printf("\n");
+#endif
+                        syslog(LOG_WARNING,
+                               "Not all data was unpacked: got %ld want %ld",
+                               msg.end,
+                               m->len);
+                        continue;
+                }
+                bhd_srv_edns(w->srv, &edns[i], &msg);
+
+                verdict[i] = 0;
+                if (h[i].qr == 0 &&
+                    h[i].opcode == BHD_DNS_OP_QUERY &&
+                    h[i].qd_count == 1)
+                {
+                        /* Blocked names are answered for all types */
+                        qtype[i] = msg.q.qtype;
+                        verdict[i] = msg.q.qclass == BHD_DNS_CLASS_IN;
+                }
+        }
+
+        /* Match the candidates against the block list together, so
+           their cache misses overlap */
+        for (int i = 0; i < n; i++)
+        {
+                if (verdict[i] == 1)
+                {
+                        cand[ncand] = i;
+                        names[ncand] = w->rx[i].buf + BHD_DNS_H_SIZE;
+                        nlen[ncand] = qlen[i];
+                        ncand++;
+                }
+        }
+        if (ncand && !bl && w->srv->cfg->bl_fail_closed)
+        {
+                /* Not loaded yet, nothing that may be blocked is
+                   resolved */
+                for (size_t i = 0; i < ncand; i++)
+                {
+                        verdict[cand[i]] = 3;
+                }
+                ncand = 0;
+        }
+        if (ncand)
+        {
+                bhd_bl_match_batch(bl, names, nlen, blocked, ncand);
+        }
+        for (size_t i = 0; i < ncand; i++)
+        {
+                if (blocked[i])
+                {
+                        verdict[cand[i]] = 2;
+                }
+        }
+
+        /* Respond to blocked queries and forward the rest */
+        for (int i = 0; i < n; i++)
+        {
+                struct bhd_msg* m = &w->rx[i];
+
+                if (verdict[i] == 2)
+                {
+                        if (bhd_srv_block(w, m, qlen[i], qtype[i]))
+                        {
+                                w->stats.dropped++;
+                                continue;
+                        }
+
+                        w->stats.numb++;
+                        m->len = bhd_srv_answer(w,
+                                                m->buf,
+                                                m->len,
+                                                &edns[i],
+                                                0);
+                        bhd_srv_queue_down(w, m->buf, m->len, &m->addr);
+                }
+                else if (verdict[i] == 3)
+                {
+                        /* The question is kept as is */
+                        bhd_dns_h_respond(m->buf, BHD_DNS_RCODE_SERVFAIL, 0);
+                        m->len = bhd_srv_answer(w,
+                                                m->buf,
+                                                BHD_DNS_H_SIZE + qlen[i],
+                                                &edns[i],
+                                                0);
+
+                        w->stats.bl_fail++;
+                        bhd_srv_queue_down(w, m->buf, m->len, &m->addr);
+                }
+                else if (verdict[i] >= 0)
+                {
+                        struct bhd_pending* p;
+                        /* A plain query, forwarded with only its
+                           question */
+                        int query = h[i].qr == 0 &&
+                                h[i].opcode == BHD_DNS_OP_QUERY &&
+                                h[i].qd_count == 1;
+                        uint32_t hash;
+                        uint16_t fid;
+                        int up;
+
+                        if (w->cache &&
+                            query &&
+                            bhd_srv_cacheable(m->buf, edns[i].dnssec))
+                        {
+                                int pf = 1;
+                                size_t nb = bhd_cache_get(w->cache,
+                                                          m->buf,
+                                                          w->srv->buf_len,
+                                                          qlen[i],
+                                                          now / 1000000,
+                                                          &pf);
+
+                                if (nb)
+                                {
+                                        struct bhd_dns_h rh;
+
+                                        if (pf)
+                                        {
+                                                bhd_srv_prefetch(w,
+                                                                 m->buf,
+                                                                 qlen[i],
+                                                                 now);
+                                        }
+
+                                        bhd_dns_h_unpack(&rh, m->buf);
+                                        if (bhd_dns_h_negative(&rh))
+                                        {
+                                                w->stats.cache_neg_hit++;
+                                        }
+                                        m->len = bhd_srv_answer(w,
+                                                                m->buf,
+                                                                nb,
+                                                                &edns[i],
+                                                                0);
+                                        w->stats.cache_hit++;
+                                        bhd_srv_queue_down(w,
+                                                           m->buf,
+                                                           m->len,
+                                                           &m->addr);
+                                        continue;
+                                }
+                                w->stats.cache_miss++;
+                        }
+
+                        if (!query && m->len > BHD_MAX_QUERY)
+                        {
+                                syslog(LOG_WARNING,
+                                       "%s:query too large (%ld bytes)",
+                                       __func__,
+                                       m->len);
+                                w->stats.dropped++;
+                                continue;
+                        }
+
+                        /* Wait for an identical query already sent */
+                        hash = bhd_srv_qhash(m->buf + BHD_DNS_H_SIZE,
+                                             qlen[i]);
+                        p = NULL;
+                        if (query)
+                        {
+                                p = bhd_srv_coalesce_find(w,
+                                                          m->buf,
+                                                          qlen[i],
+                                                          hash,
+                                                          edns[i].dnssec);
+                        }
+                        if (p &&
+                            p->stale &&
+                            w->cache &&
+                            bhd_srv_cacheable(m->buf, edns[i].dnssec))
+                        {
+                                /* The upstream is already known to be
+                                   slow for this question */
+                                size_t nb;
+
+                                nb = bhd_cache_get_stale(w->cache,
+                                                         m->buf,
+                                                         w->srv->buf_len,
+                                                         qlen[i],
+                                                         now / 1000000);
+                                if (nb)
+                                {
+                                        m->len = bhd_srv_answer(w,
+                                                                m->buf,
+                                                                nb,
+                                                                &edns[i],
+                                                                0);
+                                        w->stats.stale++;
+                                        bhd_srv_queue_down(w,
+                                                           m->buf,
+                                                           m->len,
+                                                           &m->addr);
+                                        continue;
+                                }
+                        }
+                        if (p && bhd_srv_coalesce_add(w,
+                                                      p,
+                                                      &m->addr,
+                                                      h[i].id,
+                                                      &edns[i]) == 0)
+                        {
+                                w->stats.coalesced++;
+                                continue;
+                        }
+
+                        p = bhd_srv_pending_alloc(w);
+                        if (!p)
+                        {
+                                syslog(LOG_WARNING,
+                                       "%s:too many pending queries",
+                                       __func__);
+                                w->stats.dropped++;
+                                continue;
+                        }
+                        p->caddr = m->addr;
+                        p->edns = edns[i];
+                        p->id = h[i].id;
+                        p->recv = now;
+                        p->tried = 0;
+                        p->failed = 0;
+                        p->hedge = -1;
+                        p->prefetch = 0;
+                        p->stale = 0;
+                        p->waiter = 0;
+                        p->hash = hash;
+                        p->qnext = w->qmap[hash % BHD_QMAP_SIZE];
+                        w->qmap[hash % BHD_QMAP_SIZE] =
+                                (uint16_t)(p - w->pending + 1);
+
+                        /* Forward with the rewritten id, and the
+                           OPT record of this server in place of the
+                           client's */
+                        fid = htons(p->fid);
+                        if (query)
+                        {
+                                memcpy(p->q, m->buf, BHD_DNS_H_SIZE + qlen[i]);
+                                memset(p->q + 6, 0, 6);
+                                p->qlen = (uint16_t)(BHD_DNS_H_SIZE + qlen[i]);
+                                bhd_srv_query_opt(w->srv, p);
+                        }
+                        else
+                        {
+                                memcpy(p->q, m->buf, m->len);
+                                p->qlen = (uint16_t)m->len;
+                        }
+                        memcpy(p->q, &fid, 2);
+
+                        w->stats.numf++;
+                        up = bhd_srv_up_select(w, 0, now);
+                        bhd_srv_forward(w, p, up, now);
+                }
+        }
+
+        /* Queries not sent upstream will time out */
+        bhd_srv_flush(w);
+
+        return 0;
+}
+
+static int bhd_srv_block(struct bhd_worker* w,
+                         struct bhd_msg* m,
+                         size_t qlen,
+                         uint16_t qtype)
+{
+        const struct bhd_srv* srv = w->srv;
+        /* The header and question are kept as is */
+        size_t nb = BHD_DNS_H_SIZE + qlen;
+        const unsigned char* ans = NULL;
+        size_t nans = 0;
+        uint8_t rcode = BHD_DNS_RCODE_NOERROR;
+
+        if (qtype == BHD_DNS_QTYPE_A)
+        {
+                ans = srv->bl_a;
+                nans = sizeof(srv->bl_a);
+                w->stats.numb_a++;
+        }
+        else if (qtype == BHD_DNS_QTYPE_AAAA)
+        {
+                ans = srv->bl_aaaa;
+                nans = sizeof(srv->bl_aaaa);
+                w->stats.numb_aaaa++;
+        }
+        else
+        {
+                /* There is no address to give, the name has no record
+                   of the type, or does not exist */
+                if (srv->cfg->bl_nxdomain)
+                {
+                        rcode = BHD_DNS_RCODE_NXDOMAIN;
+                }
+                if (qtype == BHD_DNS_QTYPE_HTTPS)
+                {
+                        w->stats.numb_https++;
+                }
+                else if (qtype == BHD_DNS_QTYPE_ALL)
+                {
+                        w->stats.numb_any++;
+                }
+                else
+                {
+                        w->stats.numb_other++;
+                }
+        }
+        if (nb + nans > srv->buf_len)
+        {
+                return -1;
+        }
+
+        bhd_dns_h_respond(m->buf, rcode, ans ? 1 : 0);
+        if (nans)
+        {
+                memcpy(m->buf + nb, ans, nans);
+        }
+        m->len = nb + nans;
+
+        return 0;
+}
+
+static int bhd_srv_serve_upstream(struct bhd_worker* w, unsigned int s)
+{
+        long now = timing_monotonic_usec();
+        int n;
+
+        n = bhd_srv_recv(w->fwd[s].fd,
+                         w->rx,
+                         w->srv->buf_len,
+                         &w->batch_up);
+        if (n < 0)
+        {
+                syslog(LOG_WARNING, "forward:recv: %m");
+                return -1;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+                struct bhd_msg* m = &w->rx[i];
+                struct bhd_pending* p;
+                struct bhd_dns_h rh;
+                struct bhd_dns_rr_opt opt;
+                long rtt;
+                uint16_t id;
+                uint16_t slot;
+                int up;
+
+                w->stats.up_rx += m->len;
+                if (m->len < BHD_DNS_H_SIZE)
+                {
+                        syslog(LOG_WARNING,
+                               "forward:recv %ld bytes, expected %d",
+                               m->len,
+                               BHD_DNS_H_SIZE);
+                        continue;
+                }
+                for (up = 0; up < w->srv->nforward; up++)
+                {
+                        const struct sockaddr_in* fa = &w->srv->faddr[up];
+
+                        if (m->addr.sin_addr.s_addr == fa->sin_addr.s_addr &&
+                            m->addr.sin_port == fa->sin_port)
+                        {
+                                break;
+                        }
+                }
+
+                /* Respond's id shall match a pending request's id */
+                memcpy(&id, m->buf, 2);
+                slot = w->pmap[ntohs(id)];
+                if (slot == 0)
+                {
+                        /* A response that arrived after the request was
+                           answered by another upstream or timed out */
+                        w->stats.up_late++;
+                        continue;
+                }
+                p = &w->pending[slot - 1];
+                if (up == w->srv->nforward ||
+                    !(p->tried & (1u << up)) ||
+                    p->sock[up] != s)
+                {
+                        syslog(LOG_WARNING,
+                               "%s:response from unknown source",
+                               __func__);
+                        continue;
+                }
+                if (!bhd_srv_same_question(p, m))
+                {
+                        syslog(LOG_WARNING,
+                               "%s:response question mismatch",
+                               __func__);
+                        continue;
+                }
+                if (m->len > w->srv->buf_len)
+                {
+                        struct bhd_dns_question q;
+
+                        /* Larger than the payload size advertised, and
+                           cut by the receive buffer. Only the question,
+                           which matched the query's, is kept and the tc
+                           flag set, so the client retries over TCP, and
+                           it is not cached */
+                        bhd_dns_question_unpack(&q,
+                                                p->q,
+                                                p->qlen,
+                                                BHD_DNS_H_SIZE);
+                        m->buf[2] |= 0x02;
+                        memset(m->buf + 6, 0, 6);
+                        m->len = q.end;
+                        w->stats.truncated++;
+                }
+
+                w->stats.up[up].answers++;
+                if (p->hedge == up)
+                {
+                        w->stats.hedge_win++;
+                }
+                /* The clock is monotonic, but a response received in
+                   the same us as the query was sent would be taken
+                   as no sample at all */
+                rtt = now - p->sent[up];
+                if (rtt < 1)
+                {
+                        rtt = 1;
+                }
+                bhd_srv_up_rtt(w, up, rtt);
+                bhd_srv_hedge_sample(w, rtt);
+
+                bhd_dns_h_unpack(&rh, m->buf);
+                if (rh.rcode == BHD_DNS_RCODE_SERVFAIL &&
+                    !p->stale &&
+                    bhd_srv_stale(w, p, now))
+                {
+                        /* RFC 8767, prefer a stale answer to an error */
+                        bhd_srv_pending_free(w, p);
+                        continue;
+                }
+                /* The OPT record is for this server only, clients
+                   get their own with the extended response code */
+                memset(&opt, 0, sizeof(opt));
+                if (bhd_dns_opt_remove(m->buf, &m->len, &opt) < 0)
+                {
+                        syslog(LOG_WARNING,
+                               "%s:malformed response (%ld bytes)",
+                               __func__,
+                               m->len);
+                        continue;
+                }
+                if (w->cache &&
+                    opt.ext_rcode == 0 &&
+                    bhd_srv_cacheable(p->q, p->edns.dnssec))
+                {
+                        if (bhd_dns_h_negative(&rh))
+                        {
+                                w->stats.cache_neg_miss++;
+                        }
+                        bhd_cache_put(w->cache, m->buf, m->len, now / 1000000);
+                }
+
+                bhd_srv_coalesce_respond(w, p, m, opt.ext_rcode);
+                if (!p->prefetch)
+                {
+                        id = htons(p->id);
+                        memcpy(m->buf, &id, 2);
+                        m->len = bhd_srv_answer(w,
+                                                m->buf,
+                                                m->len,
+                                                &p->edns,
+                                                opt.ext_rcode);
+                        bhd_srv_queue_down(w, m->buf, m->len, &p->caddr);
+                }
+                bhd_srv_pending_free(w, p);
+        }
+
+        bhd_srv_flush(w);
+
+        return 0;
+}
+
+static int bhd_srv_same_question(const struct bhd_pending* p,
+                                 const struct bhd_msg* m)
+{
+        struct bhd_dns_question q;
+
+        if (bhd_dns_question_unpack(&q, p->q, p->qlen, BHD_DNS_H_SIZE) == 0 ||
+            q.end > m->len)
+        {
+                return 0;
+        }
+
+        return memcmp(p->q + BHD_DNS_H_SIZE,
+                      m->buf + BHD_DNS_H_SIZE,
+                      q.end - BHD_DNS_H_SIZE) == 0;
+}
+
+static struct bhd_pending* bhd_srv_coalesce_find(struct bhd_worker* w,
+                                                 const unsigned char* q,
+                                                 size_t qlen,
+                                                 uint32_t hash,
+                                                 uint8_t dnssec)
+{
+        uint16_t slot = w->qmap[hash % BHD_QMAP_SIZE];
+
+        while (slot)
+        {
+                struct bhd_pending* p = &w->pending[slot - 1];
+
+                if (p->hash == hash &&
+                    p->qlen >= BHD_DNS_H_SIZE + qlen &&
+                    (p->q[2] & 0xf9) == (q[2] & 0xf9) &&
+                    (p->q[3] & 0x10) == (q[3] & 0x10) &&
+                    p->edns.dnssec == dnssec &&
+                    memcmp(p->q + BHD_DNS_H_SIZE,
+                           q + BHD_DNS_H_SIZE,
+                           qlen) == 0)
+                {
+                        return p;
+                }
+                slot = p->qnext;
+        }
+
+        return NULL;
+}
+
+static int bhd_srv_coalesce_add(struct bhd_worker* w,
+                                struct bhd_pending* p,
+                                const struct sockaddr_in* addr,
+                                uint16_t id,
+                                const struct bhd_edns* e)
+{
+        struct bhd_waiter* wt;
+        uint16_t slot;
+
+        if (w->nwfree == 0)
+        {
+                return -1;
+        }
+        slot = w->wfree[--w->nwfree];
+        wt = &w->waiters[slot];
+        wt->caddr = *addr;
+        wt->edns = *e;
+        wt->id = id;
+        wt->next = p->waiter;
+        p->waiter = (uint16_t)(slot + 1);
+
+        return 0;
+}
+
+static unsigned int bhd_srv_coalesce_respond(struct bhd_worker* w,
+                                             struct bhd_pending* p,
+                                             const struct bhd_msg* m,
+                                             uint8_t ext_rcode)
+{
+        unsigned char buf[BHD_MAX_EDNS + BHD_DNS_OPT_SIZE];
+        struct bhd_msg out;
+        unsigned int n = 0;
+
+        if (!p->waiter || m->len > w->srv->buf_len)
+        {
+                return 0;
+        }
+
+        /* Waiters may differ in id and payload size, each gets its own
+           copy of the response */
+        out.buf = buf;
+        for (uint16_t s = p->waiter; s; s = w->waiters[s - 1].next)
+        {
+                const struct bhd_waiter* wt = &w->waiters[s - 1];
+                uint16_t id = htons(wt->id);
+
+                memcpy(buf, m->buf, m->len);
+                memcpy(buf, &id, 2);
+                out.len = bhd_srv_answer(w,
+                                         buf,
+                                         m->len,
+                                         &wt->edns,
+                                         ext_rcode);
+                out.addr = wt->caddr;
+                w->stats.down_tx += bhd_srv_send(w->fd_listen, &out, 1);
+                n++;
+        }
+
+        return n;
+}
+
+static void bhd_srv_coalesce_clear(struct bhd_worker* w,
+                                   struct bhd_pending* p)
+{
+        while (p->waiter)
+        {
+                uint16_t s = p->waiter;
+
+                p->waiter = w->waiters[s - 1].next;
+                w->wfree[w->nwfree++] = (uint16_t)(s - 1);
+        }
+}
+
+static int bhd_srv_stale(struct bhd_worker* w, struct bhd_pending* p, long now)
+{
+        unsigned char buf[BHD_MAX_EDNS + BHD_DNS_OPT_SIZE];
+        struct bhd_msg m;
+        struct bhd_dns_question q;
+        uint16_t id;
+
+        p->stale = 1;
+        if (!w->cache ||
+            p->prefetch ||
+            !bhd_srv_cacheable(p->q, p->edns.dnssec))
+        {
+                return 0;
+        }
+        if (bhd_dns_question_unpack(&q, p->q, p->qlen, BHD_DNS_H_SIZE) == 0)
+        {
+                return 0;
+        }
+
+        memcpy(buf, p->q, q.end);
+        m.len = bhd_cache_get_stale(w->cache,
+                                    buf,
+                                    w->srv->buf_len,
+                                    q.end - BHD_DNS_H_SIZE,
+                                    now / 1000000);
+        if (m.len == 0)
+        {
+                return 0;
+        }
+        m.buf = buf;
+
+        w->stats.stale += bhd_srv_coalesce_respond(w, p, &m, 0) + 1;
+        bhd_srv_coalesce_clear(w, p);
+        id = htons(p->id);
+        memcpy(buf, &id, 2);
+        m.len = bhd_srv_answer(w, buf, m.len, &p->edns, 0);
+        m.addr = p->caddr;
+        w->stats.down_tx += bhd_srv_send(w->fd_listen, &m, 1);
+
+        /* Keep waiting for the upstream, to refresh the cache */
+        p->prefetch = 1;
+
+        return 1;
+}
+
+static void bhd_srv_prefetch(struct bhd_worker* w,
+                             const unsigned char* buf,
+                             size_t qlen,
+                             long now)
+{
+        unsigned char q[BHD_MAX_QUERY];
+        struct bhd_pending* p;
+        uint32_t hash;
+        uint16_t fid;
+
+        if (now - w->pf_refill >= 1000000L)
+        {
+                w->pf_tokens = w->pf_rate;
+                w->pf_refill = now;
+        }
+        if (BHD_DNS_H_SIZE + qlen > BHD_MAX_QUERY)
+        {
+                return;
+        }
+
+        /* A plain query with the rd flag of the client's query, the id
+           is set when it is sent */
+        memset(q, 0, BHD_DNS_H_SIZE);
+        q[2] = buf[2] & 0x01;
+        q[5] = 1;
+        memcpy(q + BHD_DNS_H_SIZE, buf + BHD_DNS_H_SIZE, qlen);
+        hash = bhd_srv_qhash(q + BHD_DNS_H_SIZE, qlen);
+        if (bhd_srv_coalesce_find(w, q, qlen, hash, 0))
+        {
+                /* Already pending */
+                return;
+        }
+        p = w->pf_tokens ? bhd_srv_pending_alloc(w) : NULL;
+        if (!p)
+        {
+                w->stats.prefetch_capped++;
+                return;
+        }
+        w->pf_tokens--;
+
+        p->edns.size = 0;
+        p->edns.dnssec = 0;
+        p->recv = now;
+        p->tried = 0;
+        p->failed = 0;
+        p->hedge = -1;
+        p->prefetch = 1;
+        p->stale = 1;
+        p->waiter = 0;
+        p->hash = hash;
+        p->qnext = w->qmap[hash % BHD_QMAP_SIZE];
+        w->qmap[hash % BHD_QMAP_SIZE] = (uint16_t)(p - w->pending + 1);
+
+        fid = htons(p->fid);
+        memcpy(p->q, q, BHD_DNS_H_SIZE + qlen);
+        memcpy(p->q, &fid, 2);
+        p->qlen = (uint16_t)(BHD_DNS_H_SIZE + qlen);
+        bhd_srv_query_opt(w->srv, p);
+
+        w->stats.prefetch++;
+        bhd_srv_forward(w, p, bhd_srv_up_select(w, 0, now), now);
+}
+
+static void bhd_srv_edns(const struct bhd_srv* srv,
+                         struct bhd_edns* e,
+                         const struct bhd_dns_msg* msg)
+{
+        struct bhd_dns_rr_reader r;
+        struct bhd_dns_rr rr;
+        struct bhd_dns_rr_opt opt;
+        enum bhd_dns_section section;
+
+        e->size = 0;
+        e->dnssec = 0;
+        if (!srv->cfg->edns_size || !msg->h.ar_count)
+        {
+                return;
+        }
+
+        bhd_dns_rr_reader_init(&r, msg);
+        while (bhd_dns_rr_next(&r, &rr, &section) == 1)
+        {
+                if (section != BHD_DNS_SECTION_AR ||
+                    rr.type != BHD_DNS_QTYPE_OPT)
+                {
+                        continue;
+                }
+
+                bhd_dns_rr_opt_unpack(&opt, &rr);
+                /* RFC 6891, a smaller size is treated as 512 */
+                e->size = opt.udp_size < BHD_DNS_UDP_SIZE ?
+                        BHD_DNS_UDP_SIZE : opt.udp_size;
+                e->dnssec = (opt.flags & BHD_DNS_OPT_DO) != 0;
+                return;
+        }
+}
+
+static size_t bhd_srv_answer(struct bhd_worker* w,
+                             unsigned char* buf,
+                             size_t len,
+                             const struct bhd_edns* e,
+                             uint8_t ext_rcode)
+{
+        const struct bhd_srv* srv = w->srv;
+        struct bhd_dns_rr_opt opt;
+        size_t limit = BHD_DNS_UDP_SIZE;
+        size_t olen = 0;
+
+        if (e->size)
+        {
+                limit = e->size < srv->buf_len ? e->size : srv->buf_len;
+                olen = BHD_DNS_OPT_SIZE;
+        }
+        else if (ext_rcode)
+        {
+                buf[3] = (unsigned char)((buf[3] & 0xf0) |
+                                         BHD_DNS_RCODE_SERVFAIL);
+        }
+        if (len + olen > limit)
+        {
+                struct bhd_dns_question q;
+
+                /* RFC 2181, the client retries over TCP */
+                if (bhd_dns_question_unpack(&q, buf, len, BHD_DNS_H_SIZE) == 0)
+                {
+                        return len;
+                }
+                buf[2] |= 0x02;
+                memset(buf + 6, 0, 6);
+                len = q.end;
+                w->stats.truncated++;
+        }
+        if (e->size)
+        {
+                memset(&opt, 0, sizeof(opt));
+                opt.udp_size = srv->cfg->edns_size;
+                opt.ext_rcode = ext_rcode;
+                opt.flags = e->dnssec ? BHD_DNS_OPT_DO : 0;
+                len = bhd_dns_opt_append(buf, len, len + olen, &opt);
+        }
+
+        return len;
+}
+
+static void bhd_srv_query_opt(const struct bhd_srv* srv,
+                              struct bhd_pending* p)
+{
+        struct bhd_dns_rr_opt opt;
+        size_t nb;
+
+        if (!srv->cfg->edns_size)
+        {
+                return;
+        }
+
+        memset(&opt, 0, sizeof(opt));
+        opt.udp_size = srv->cfg->edns_size;
+        opt.flags = p->edns.dnssec ? BHD_DNS_OPT_DO : 0;
+        nb = bhd_dns_opt_append(p->q, p->qlen, sizeof(p->q), &opt);
+        if (nb)
+        {
+                p->qlen = (uint16_t)nb;
+        }
+}
+
+static int bhd_srv_cacheable(const unsigned char* q, uint8_t dnssec)
+{
+        return (q[3] & 0x10) == 0 && !dnssec;
+}
+
+static uint32_t bhd_srv_qhash(const unsigned char* q, size_t len)
+{
+        uint32_t hash = 2166136261u;
+
+        for (size_t i = 0; i < len; i++)
+        {
+                hash ^= q[i];
+                hash *= 16777619u;
+        }
+
+        return hash;
+}
+
+static void bhd_srv_queue_down(struct bhd_worker* w,
+                               unsigned char* buf,
+                               size_t len,
+                               const struct sockaddr_in* addr)
+{
+        if (w->ndown == BHD_BATCH)
+        {
+                bhd_srv_flush(w);
+        }
+        w->tx_down[w->ndown].buf = buf;
+        w->tx_down[w->ndown].len = len;
+        w->tx_down[w->ndown].addr = *addr;
+        w->ndown++;
+}
+
+static void bhd_srv_forward(struct bhd_worker* w,
+                            struct bhd_pending* p,
+                            int up,
+                            long now)
+{
+        if (w->nup == BHD_BATCH)
+        {
+                bhd_srv_flush(w);
+        }
+        p->up = (uint8_t)up;
+        p->sent[up] = now;
+        p->tried |= 1u << up;
+        p->sock[up] = (uint8_t)bhd_srv_fwd_select(w);
+        w->fwd[p->sock[up]].sent++;
+        w->fwd[p->sock[up]].pending++;
+        w->stats.up[up].queries++;
+
+        w->tx_up[w->nup].buf = p->q;
+        w->tx_up[w->nup].len = p->qlen;
+        w->tx_up[w->nup].addr = w->srv->faddr[up];
+        w->tx_sock[w->nup] = p->sock[up];
+        w->nup++;
+}
+
+static void bhd_srv_flush(struct bhd_worker* w)
+{
+        /* Send the queries on each forward socket in one batch */
+        for (unsigned int s = 0; w->nup && s < BHD_FWD_SOCKETS; s++)
+        {
+                struct bhd_msg out[BHD_BATCH];
+                unsigned int n = 0;
+
+                for (unsigned int i = 0; i < w->nup; i++)
+                {
+                        if (w->tx_sock[i] == s)
+                        {
+                                out[n++] = w->tx_up[i];
+                        }
+                }
+                w->stats.up_tx += bhd_srv_send(w->fwd[s].fd, out, n);
+        }
+        w->stats.down_tx += bhd_srv_send(w->fd_listen, w->tx_down, w->ndown);
+        w->nup = 0;
+        w->ndown = 0;
+}
+
+static int bhd_srv_up_select(struct bhd_worker* w, uint32_t exclude, long now)
+{
+        int best = -1;
+        int down = -1;
+
+        for (int i = 0; i < w->srv->nforward; i++)
+        {
+                const struct bhd_upstream* u = &w->up[i];
+
+                if (exclude & (1u << i))
+                {
+                        continue;
+                }
+                if (u->fails >= BHD_UP_MAX_FAILS)
+                {
+                        /* Down, remember the one that is due for a
+                           retry first */
+                        if (down < 0 || u->retry < w->up[down].retry)
+                        {
+                                down = i;
+                        }
+                        continue;
+                }
+                if (best < 0 || u->srtt < w->up[best].srtt)
+                {
+                        best = i;
+                }
+        }
+
+        if (down >= 0 && (best < 0 || now >= w->up[down].retry))
+        {
+                /* Probe an upstream that is down, or use the least bad
+                   if all are down. Postpone the next probe. */
+                struct bhd_upstream* u = &w->up[down];
+                unsigned int shift = u->fails - BHD_UP_MAX_FAILS;
+                long backoff = BHD_UP_BACKOFF << (shift > 6 ? 6 : shift);
+
+                u->retry = now + backoff;
+                return down;
+        }
+
+        return best;
+}
+
+static void bhd_srv_up_rtt(struct bhd_worker* w, int up, long rtt)
+{
+        struct bhd_upstream* u = &w->up[up];
+
+        if (u->fails >= BHD_UP_MAX_FAILS)
+        {
+                syslog(LOG_INFO,
+                       "Upstream %s@%d is up",
+                       w->srv->cfg->faddr[up],
+                       w->srv->cfg->fports[up]);
+        }
+        u->fails = 0;
+
+        /* RFC 6298 */
+        if (u->srtt == 0)
+        {
+                u->srtt = rtt;
+                u->rttvar = rtt / 2;
+        }
+        else
+        {
+                long d = u->srtt - rtt;
+
+                u->rttvar = (3 * u->rttvar + (d < 0 ? -d : d)) / 4;
+                u->srtt = (7 * u->srtt + rtt) / 8;
+        }
+}
+
+static void bhd_srv_up_fail(struct bhd_worker* w, int up, long now)
+{
+        struct bhd_upstream* u = &w->up[up];
+
+        w->stats.up[up].timeouts++;
+
+        /* Back off the RTT so a slow upstream is not preferred */
+        u->srtt = u->srtt ? u->srtt * 2 : BHD_UP_MAX_RTO;
+        if (u->srtt > BHD_TIMEOUT * 1000L)
+        {
+                u->srtt = BHD_TIMEOUT * 1000L;
+        }
+
+        u->fails++;
+        if (u->fails == BHD_UP_MAX_FAILS)
+        {
+                syslog(LOG_WARNING,
+                       "Upstream %s@%d is down",
+                       w->srv->cfg->faddr[up],
+                       w->srv->cfg->fports[up]);
+                u->retry = now + BHD_UP_BACKOFF;
+        }
+}
+
+static long bhd_srv_up_rto(const struct bhd_upstream* u)
+{
+        long rto;
+
+        if (u->srtt == 0)
         {
-                syslog(LOG_ERR, "Invalid address '%s': %m", cfg->faddr);
-                return -1;
+                return BHD_UP_MAX_RTO;
         }
 
-        /* Set up listening socket */
-        srv->fd_listen = socket(AF_INET, SOCK_DGRAM, 0);
-        if (srv->fd_listen < 0)
+        rto = u->srtt + 4 * u->rttvar;
+        if (rto < BHD_UP_MIN_RTO)
         {
-                syslog(LOG_ERR, "Could not create socket: %m");
-                return -1;
+                rto = BHD_UP_MIN_RTO;
         }
-        memset(&saddr, 0, sizeof(saddr));
-        saddr.sin_family = AF_INET;
-        saddr.sin_port = htons(cfg->lport);
-        if (strncmp(cfg->laddr, "0.0.0.0", 7) == 0)
+        if (rto > BHD_UP_MAX_RTO)
         {
-                saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+                rto = BHD_UP_MAX_RTO;
         }
-        else
-        {
-                uint32_t na;
 
-                if (inet_pton(AF_INET, cfg->laddr, &na) < 0)
-                {
-                        syslog(LOG_ERR, "Invalid address '%s': %m", cfg->laddr);
-                        return -1;
-                }
+        return rto;
+}
 
-                saddr.sin_addr.s_addr = na;
-        }
-        ret = bind(srv->fd_listen, (struct sockaddr*)&saddr, sizeof(saddr));
-        if (ret < 0)
+static int bhd_srv_recv(int fd,
+                        struct bhd_msg* msgs,
+                        size_t len,
+                        unsigned int* batch)
+{
+        unsigned int n = *batch;
+        int ret;
+
+#ifdef __linux__
+        struct mmsghdr mh[BHD_BATCH];
+        struct iovec iov[BHD_BATCH];
+
+        memset(mh, 0, sizeof(struct mmsghdr) * n);
+        for (unsigned int i = 0; i < n; i++)
         {
-                syslog(LOG_ERR, "Failed to bind: %m");
-                return -1;
+                iov[i].iov_base = msgs[i].buf;
+                iov[i].iov_len = len + 1;
+                mh[i].msg_hdr.msg_iov = &iov[i];
+                mh[i].msg_hdr.msg_iovlen = 1;
+                mh[i].msg_hdr.msg_name = &msgs[i].addr;
+                mh[i].msg_hdr.msg_namelen = sizeof(msgs[i].addr);
         }
 
-        /* Stats socket */
-        srv->fd_stats = socket(AF_INET, SOCK_DGRAM, 0);
-        if (srv->fd_stats < 0)
+        /* Socket is known to be readable, only drain what is queued */
+        ret = recvmmsg(fd, mh, n, MSG_DONTWAIT, NULL);
+        if (ret < 0)
         {
-                syslog(LOG_ERR, "Could not create socket: %m");
-                return -1;
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
         }
-        memset(&saddr, 0, sizeof(saddr));
-        saddr.sin_family = AF_INET;
-        saddr.sin_port = htons(cfg->sport);
-        if (strncmp(cfg->laddr, "0.0.0.0", 7) == 0)
+        for (int i = 0; i < ret; i++)
         {
-                saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+                msgs[i].len = mh[i].msg_len;
         }
-        else
+#else
+        for (ret = 0; ret < (int)n; ret++)
         {
-                uint32_t na;
+                socklen_t slen = sizeof(msgs[ret].addr);
+                ssize_t nb = recvfrom(fd,
+                                      msgs[ret].buf,
+                                      len + 1,
+                                      MSG_DONTWAIT,
+                                      (struct sockaddr*)&msgs[ret].addr,
+                                      &slen);
 
-                if (inet_pton(AF_INET, cfg->laddr, &na) < 0)
+                if (nb < 0)
                 {
-                        syslog(LOG_ERR, "Invalid address '%s': %m", cfg->laddr);
-                        return -1;
+                        if (ret == 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                        {
+                                return -1;
+                        }
+                        break;
                 }
+                msgs[ret].len = (size_t)nb;
+        }
+#endif
 
-                saddr.sin_addr.s_addr = na;
+        /* Grow the batch while the queue keeps filling it, and shrink it
+           when traffic is sparse to keep the per batch setup cheap. */
+        if ((unsigned int)ret == n && n < BHD_BATCH)
+        {
+                *batch = n * 2;
         }
-        ret = bind(srv->fd_stats, (struct sockaddr*)&saddr, sizeof(saddr));
-        if (ret < 0)
+        else if ((unsigned int)ret < n / 4 && n > BHD_BATCH_MIN)
         {
-                syslog(LOG_ERR, "Failed to bind: %m");
-                return -1;
+                *batch = n / 2;
         }
 
-        return 0;
+        return ret;
 }
 
-int bhd_serve(struct bhd_srv* srv)
+static size_t bhd_srv_send(int fd, const struct bhd_msg* msgs, unsigned int n)
 {
-        struct pollfd fds[2];
-        int ret;
+        size_t nb = 0;
 
-        fds[0].fd = srv->fd_listen;
-        fds[0].events = POLLIN;
-        fds[1].fd = srv->fd_stats;
-        fds[1].events = POLLIN;
+        /* Blocking of send operations on an UDP socket is very unlikely
+           to happen, so currently we omit calling poll(2). */
+#ifdef __linux__
+        struct mmsghdr mh[BHD_BATCH];
+        struct iovec iov[BHD_BATCH];
+        unsigned int sent = 0;
 
-        run = 1;
-        while(run)
+        if (n == 0)
         {
-                int ready = poll(fds, 2, -1);
+                return 0;
+        }
 
-                if (ready < 0)
+        memset(mh, 0, sizeof(struct mmsghdr) * n);
+        for (unsigned int i = 0; i < n; i++)
+        {
+                iov[i].iov_base = msgs[i].buf;
+                iov[i].iov_len = msgs[i].len;
+                mh[i].msg_hdr.msg_iov = &iov[i];
+                mh[i].msg_hdr.msg_iovlen = 1;
+                mh[i].msg_hdr.msg_name = (void*)&msgs[i].addr;
+                mh[i].msg_hdr.msg_namelen = sizeof(msgs[i].addr);
+        }
+
+        while (sent < n)
+        {
+                int ret = sendmmsg(fd, mh + sent, n - sent, 0);
+
+                if (ret < 0)
                 {
-                        /* error */
-                        syslog(LOG_WARNING, "%s:poll:%m", __func__);
+                        /* Skip the failing message */
+                        syslog(LOG_WARNING, "sendmmsg: %m");
+                        sent++;
                         continue;
                 }
-
-                if (fds[0].revents & POLLIN)
+                for (int i = 0; i < ret; i++)
                 {
-                        ret = bhd_srv_serve_dns(srv);
-                        if (ret)
-                        {
-                                syslog(LOG_WARNING, "DNS query failed");
-                        }
+                        nb += mh[sent + i].msg_len;
                 }
-                if (fds[1].revents & POLLIN)
+                sent += (unsigned int)ret;
+        }
+#else
+        for (unsigned int i = 0; i < n; i++)
+        {
+                ssize_t ret = sendto(fd,
+                                     msgs[i].buf,
+                                     msgs[i].len,
+                                     0,
+                                     (const struct sockaddr*)&msgs[i].addr,
+                                     sizeof(msgs[i].addr));
+
+                if (ret < 0)
                 {
-                        bhd_srv_serve_stats(srv);
+                        syslog(LOG_WARNING, "sendto: %m");
+                        continue;
                 }
+                nb += (size_t)ret;
         }
+#endif
 
-        if (!srv->daemon)
+        return nb;
+}
+
+static uint16_t bhd_srv_random(struct bhd_worker* w)
+{
+        if (w->nrnd == 0)
         {
-                printf("Stop listening\n");
-                printf("Forwarded %ld requests\n", srv->stats.numf);
-                printf("Blocked %ld requests\n", srv->stats.numb);
-                printf("Upstream tx %ld bytes\n", srv->stats.up_tx);
-                printf("Upstream rx %ld bytes\n", srv->stats.up_rx);
-                printf("Downstream tx %ld bytes\n", srv->stats.down_tx);
-                printf("Dowmstream rx %ld bytes\n", srv->stats.down_rx);
-        }
+                ssize_t nb = read(w->srv->fd_random, w->rnd, sizeof(w->rnd));
 
-        close(srv->fd_listen);
-        close(srv->fd_forward);
+                if (nb != (ssize_t)sizeof(w->rnd))
+                {
+                        /* Reads from /dev/urandom do not fail, the
+                           previous values are used again if they do */
+                        syslog(LOG_ERR, "%s:read: %m", __func__);
+                }
+                w->nrnd = BHD_RND_POOL;
+        }
 
-        return 0;
+        return w->rnd[--w->nrnd];
 }
 
-static int bhd_srv_serve_dns(struct bhd_srv* srv)
+static int bhd_srv_fwd_open(struct bhd_worker* w)
 {
-        unsigned char buf[BUF_LEN];
-        struct sockaddr_in caddr;
-        struct bhd_dns_h h;
-        struct bhd_dns_q_section qs;
-        struct pollfd fds[1];
-        size_t br;
-        size_t offset = 0;
-        ssize_t nb;
-        socklen_t slen = sizeof(caddr);
-        int ready;
+        struct sockaddr_in saddr;
+        int fd;
 
-        nb = recvfrom(srv->fd_listen,
-                      buf,
-                      BUF_LEN,
-                      0,
-                      (struct sockaddr*)&caddr,
-                      &slen);
-        if (nb < 0)
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0)
         {
-                syslog(LOG_WARNING, "client:recvfrom: %m");
+                syslog(LOG_ERR, "Could not create socket: %m");
                 return -1;
         }
 
-        srv->stats.down_rx += nb;
-        if (nb < BHD_DNS_H_SIZE)
+        memset(&saddr, 0, sizeof(saddr));
+        saddr.sin_family = AF_INET;
+        saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        for (int i = 0; i < BHD_FWD_TRIES; i++)
         {
-                syslog(LOG_WARNING,
-                       "client:recvfrom %ld bytes, expected %d",
-                       nb,
-                       BHD_DNS_H_SIZE);
-                return -1;
+                /* Unprivileged ports, so sockets can be rotated after
+                   privileges are dropped */
+                uint16_t port = (uint16_t)(BHD_FWD_PORT_MIN +
+                                           bhd_srv_random(w) %
+                                           (UINT16_MAX + 1 -
+                                            BHD_FWD_PORT_MIN));
+
+                saddr.sin_port = htons(port);
+                if (bind(fd, (struct sockaddr*)&saddr, sizeof(saddr)) == 0)
+                {
+                        return fd;
+                }
+                if (errno != EADDRINUSE)
+                {
+                        break;
+                }
         }
 
-        br = bhd_dns_h_unpack(&h, buf);
-        qs.qd_count = h.qd_count;
-        offset += br;
-        br = bhd_dns_q_section_unpack(&qs, buf + offset);
-        offset += br;
+        syslog(LOG_ERR, "Failed to bind forward socket: %m");
+        close(fd);
 
-#if DEBUG
-        bhd_dns_h_dump(&h);
-#endif
-        /* If ad flag is set, ignore additional data */
-        if (offset != (size_t)nb && h.ad == 0)
+        return -1;
+}
+
+static unsigned int bhd_srv_fwd_select(struct bhd_worker* w)
+{
+        unsigned int r = bhd_srv_random(w) % BHD_FWD_SOCKETS;
+
+        for (unsigned int i = 0; i < BHD_FWD_SOCKETS; i++)
         {
-#if DEBUG
-                for (int i = offset; i < nb; i++)
+                unsigned int s = (r + i) % BHD_FWD_SOCKETS;
+
+                if (w->fwd[s].sent < BHD_FWD_ROTATE)
                 {
-                        printf("%02x:", buf[i]);
+                        return s;
                 }
-                printf("\n");
-#endif
-                syslog(LOG_WARNING,
-                       "Not all data was unpacked: got %ld want %ld",
-                       offset,
-                       nb);
-                return -1;
         }
 
-        if (h.qr == 0 &&
-            h.opcode == BHD_DNS_OP_QUERY &&
-            qs.qd_count == 1 &&
-            qs.q->qtype == BHD_DNS_QTYPE_A &&
-            qs.q->qclass == BHD_DNS_CLASS_IN)
+        /* All sockets wait for their last queries */
+        return r;
+}
+
+static void bhd_srv_fwd_release(struct bhd_worker* w, unsigned int s)
+{
+        struct bhd_fwd* f = &w->fwd[s];
+        int fd;
+
+        f->pending--;
+        if (f->pending || f->sent < BHD_FWD_ROTATE)
         {
-                struct bhd_dns_q_label* l = &qs.q->qname;
-                int m = bhd_bl_match(srv->bl, l);
+                return;
+        }
 
-                if (m)
-                {
-                        /* Send static response */
-                        struct bhd_dns_rr_a rr;
+        /* The old socket is kept if no new one can be bound */
+        fd = bhd_srv_fwd_open(w);
+        if (fd >= 0)
+        {
+                close(f->fd);
+                f->fd = fd;
+        }
+        f->sent = 0;
+}
 
-                        bhd_dns_rr_a_init(&rr, srv->cfg->baddr);
-                        h.qr = 1;
-                        h.ra = 1;
-                        h.an_count = 1;
+static struct bhd_pending* bhd_srv_pending_alloc(struct bhd_worker* w)
+{
+        struct bhd_pending* p;
+        uint16_t slot;
+        uint16_t fid;
 
-                        nb = bhd_dns_h_pack(buf, BUF_LEN, &h);
-                        nb += bhd_dns_q_section_pack(buf + nb,
-                                                     BUF_LEN - nb,
-                                                     &qs);
-                        nb += bhd_dns_rr_a_pack(buf + nb,
-                                                BUF_LEN - nb,
-                                                &rr);
+        if (w->npfree == 0)
+        {
+                return NULL;
+        }
+        slot = w->pfree[--w->npfree];
+        p = &w->pending[slot];
 
-                        srv->stats.numb++;
-                        goto do_respond;
-                }
+        /* Pick an unused random id, the map is sparsely populated so
+           this rarely takes more than one attempt. */
+        do
+        {
+                fid = bhd_srv_random(w);
+        } while (w->pmap[fid]);
+
+        w->pmap[fid] = (uint16_t)(slot + 1);
+        p->fid = fid;
+
+        return p;
+}
+
+static void bhd_srv_pending_free(struct bhd_worker* w, struct bhd_pending* p)
+{
+        uint16_t slot = (uint16_t)(p - w->pending + 1);
+        uint16_t* link = &w->qmap[p->hash % BHD_QMAP_SIZE];
+
+        /* Unlink from the question's bucket */
+        while (*link && *link != slot)
+        {
+                link = &w->pending[*link - 1].qnext;
+        }
+        if (*link)
+        {
+                *link = p->qnext;
         }
 
-        srv->stats.numf++;
+        bhd_srv_coalesce_clear(w, p);
 
-        /* Blocking of sendto(2) operations on an UDP socket is very unlikely
-           to happen, so currently we omit calling poll(2). */
-        nb = sendto(srv->fd_forward,
-                    buf,
-                    nb,
-                    0,
-                    (struct sockaddr*)&srv->faddr,
-                    sizeof(struct sockaddr_in));
-        if (nb < 0)
+        for (int up = 0; up < w->srv->nforward; up++)
         {
-                syslog(LOG_WARNING, "forward:sendto: %m");
-                return -1;
+                if (p->tried & (1u << up))
+                {
+                        bhd_srv_fwd_release(w, p->sock[up]);
+                }
         }
-        srv->stats.up_tx += nb;
 
-        struct timing start;
-        int timeout = BHD_TIMEOUT;
+        w->pmap[p->fid] = 0;
+        w->pfree[w->npfree++] = (uint16_t)(slot - 1);
+}
 
-        timing_start(&start);
-        for (;;)
+static void bhd_srv_expire(struct bhd_worker* w, long now)
+{
+        for (uint16_t i = 0; i < BHD_MAX_PENDING; i++)
         {
-                uint16_t resp_id;
+                struct bhd_pending* p = &w->pending[i];
+                uint32_t waiting;
 
-                if (timeout < 1)
+                if (w->pmap[p->fid] != i + 1)
                 {
-                        syslog(LOG_WARNING, "%s:timeout waiting for response", __func__);
-                        return -1;
+                        continue;
                 }
 
-                /* Set timeout before attempting to read */
-                fds[0].fd = srv->fd_forward;
-                fds[0].events = POLLIN;
-                ready = poll(fds, 1, timeout);
-                if (ready == 0)
+                /* Register timeouts for all upstreams the query is
+                   sent to, a late response is still used */
+                waiting = p->tried & ~p->failed;
+                for (int up = 0; waiting; up++)
                 {
-                        /* timeout */
-                        syslog(LOG_WARNING, "%s:timeout waiting for response", __func__);
-                        return -1;
+                        uint32_t bit = 1u << up;
+
+                        if (!(waiting & bit))
+                        {
+                                continue;
+                        }
+                        waiting &= ~bit;
+                        if (now - p->sent[up] >= bhd_srv_up_rto(&w->up[up]))
+                        {
+                                p->failed |= bit;
+                                bhd_srv_up_fail(w, up, now);
+                        }
                 }
-                else if (ready < 0)
-                {
-                        /* error */
-                        syslog(LOG_WARNING, "%s:poll:%m", __func__);
-                        return -1;
 
+                /* RFC 8767, answer from a stale cache entry if the
+                   upstream is slow */
+                if (!p->stale && now - p->recv >= BHD_STALE_DEADLINE * 1000L)
+                {
+                        bhd_srv_stale(w, p, now);
                 }
-                nb = recvfrom(srv->fd_forward, buf, BUF_LEN, 0, NULL, NULL);
-                if (nb < 0)
+
+                if (now - p->recv >= BHD_TIMEOUT * 1000L)
                 {
-                        syslog(LOG_WARNING, "forward:recvfrom: %m");
-                        return -1;
+                        syslog(LOG_WARNING,
+                               "%s:timeout waiting for response",
+                               __func__);
+                        w->stats.timeout++;
+                        bhd_srv_pending_free(w, p);
+                        continue;
                 }
-                srv->stats.up_rx += nb;
 
-                /* Respond's id shall match request's id */
-                memcpy(&resp_id, buf, 2);
-                resp_id = ntohs(resp_id);
-                if (h.id == resp_id)
+                if (p->failed == p->tried)
                 {
-                        break;
+                        /* Fail over to the best upstream not yet tried */
+                        int up = bhd_srv_up_select(w, p->tried, now);
+
+                        if (up >= 0)
+                        {
+                                bhd_srv_forward(w, p, up, now);
+                        }
+                }
+                else if ((p->tried & (p->tried - 1)) == 0 &&
+                         w->hedge_delay &&
+                         now - p->recv >= w->hedge_delay)
+                {
+                        /* Hedge, send the query to a second upstream if
+                           the first is slower than usual. A query that
+                           has failed over is already at its second
+                           upstream, and is not hedged */
+                        int up = bhd_srv_up_select(w, p->tried, now);
+
+                        if (up >= 0 && w->up[up].fails < BHD_UP_MAX_FAILS)
+                        {
+                                p->hedge = (int8_t)up;
+                                w->stats.hedge++;
+                                bhd_srv_forward(w, p, up, now);
+                        }
                 }
-                syslog(LOG_INFO, "%s:response id mismatch", __func__);
-                timeout -= (int)timing_dur_msec(&start);
         }
 
-do_respond:
-        /* Blocking of sendto(2) operations on an UDP socket is very unlikely
-           to happen, so currently we omit calling poll(2). */
-        nb = sendto(srv->fd_listen,
-                    buf,
-                    nb,
-                    0,
-                    (struct sockaddr*)&caddr,
-                    sizeof(caddr));
-        if (nb < 0)
+        bhd_srv_flush(w);
+}
+
+static void bhd_srv_hedge_sample(struct bhd_worker* w, long rtt)
+{
+        long sorted[BHD_RTT_SAMPLES];
+        unsigned int pct = w->srv->cfg->hedge_pct;
+        unsigned int n;
+
+        if (pct == 0 || w->srv->nforward < 2)
         {
-                syslog(LOG_WARNING, "client:sendto: %m");
-                return -1;
+                return;
         }
 
-        srv->stats.down_tx += nb;
-        bhd_dns_q_section_free(&qs);
+        w->rtts[w->nrtt++ % BHD_RTT_SAMPLES] = rtt;
+        if (w->nrtt % BHD_RTT_UPDATE)
+        {
+                return;
+        }
 
-        return 0;
+        /* Recompute the percentile over the most recent samples */
+        n = w->nrtt < BHD_RTT_SAMPLES ? w->nrtt : BHD_RTT_SAMPLES;
+        memcpy(sorted, w->rtts, n * sizeof(long));
+        qsort(sorted, n, sizeof(long), &bhd_srv_cmp_long);
+        w->hedge_delay = sorted[(n - 1) * pct / 100];
+        if (w->hedge_delay < BHD_HEDGE_MIN)
+        {
+                w->hedge_delay = BHD_HEDGE_MIN;
+        }
 }
 
+static int bhd_srv_cmp_long(const void* a, const void* b)
+{
+        long la = *(const long*)a;
+        long lb = *(const long*)b;
+
+        return (la > lb) - (la < lb);
+}
 
 static int bhd_srv_serve_stats(struct bhd_srv* srv)
 {
-        unsigned char buf[BUF_LEN];
+        unsigned char buf[STATS_LEN];
+        struct bhd_stats stats;
         struct sockaddr_in caddr;
         ssize_t nb;
         socklen_t slen = sizeof(caddr);
 
         nb = recvfrom(srv->fd_stats,
                       buf,
-                      BUF_LEN,
+                      STATS_LEN,
                       0,
                       (struct sockaddr*)&caddr,
                       &slen);
@@ -428,7 +2451,8 @@ static int bhd_srv_serve_stats(struct bhd_srv* srv)
                 return 0;
         }
 
-        nb = bhd_srv_stat_str((char*)&buf[0], BUF_LEN, &srv->stats);
+        bhd_srv_stats(srv, &stats);
+        nb = bhd_srv_stat_str((char*)&buf[0], STATS_LEN, srv, &stats);
         nb = sendto(srv->fd_stats,
                     buf,
                     nb,
@@ -444,22 +2468,238 @@ static int bhd_srv_serve_stats(struct bhd_srv* srv)
         return 0;
 }
 
-int bhd_srv_stat_str(char* buf, int len, const struct bhd_stats* stats)
+int bhd_srv_stat_str(char* buf,
+                     int len,
+                     const struct bhd_srv* srv,
+                     const struct bhd_stats* stats)
 {
+        struct bhd_bl_info bi;
         int nb = 0;
 
+        bhd_bl_info(srv->bl, &bi);
+
         nb += snprintf(buf+nb, len - nb, "requests.block:%ld\n", stats->numb);
+        nb += snprintf(buf+nb, len - nb, "requests.block.a:%ld\n", stats->numb_a);
+        nb += snprintf(buf+nb, len - nb, "requests.block.aaaa:%ld\n", stats->numb_aaaa);
+        nb += snprintf(buf+nb, len - nb, "requests.block.https:%ld\n", stats->numb_https);
+        nb += snprintf(buf+nb, len - nb, "requests.block.any:%ld\n", stats->numb_any);
+        nb += snprintf(buf+nb, len - nb, "requests.block.other:%ld\n", stats->numb_other);
         nb += snprintf(buf+nb, len - nb, "requests.forward:%ld\n", stats->numf);
+        nb += snprintf(buf+nb, len - nb, "requests.timeout:%ld\n", stats->timeout);
+        nb += snprintf(buf+nb, len - nb, "requests.dropped:%ld\n", stats->dropped);
+        nb += snprintf(buf+nb, len - nb, "requests.loading:%ld\n", stats->bl_fail);
+        nb += snprintf(buf+nb, len - nb, "cache.hit:%ld\n", stats->cache_hit);
+        nb += snprintf(buf+nb, len - nb, "cache.miss:%ld\n", stats->cache_miss);
+        nb += snprintf(buf+nb, len - nb, "cache.ratio:%.3f\n",
+                       bhd_srv_ratio(stats->cache_hit, stats->cache_miss));
+        nb += snprintf(buf+nb, len - nb, "cache.neg.hit:%ld\n", stats->cache_neg_hit);
+        nb += snprintf(buf+nb, len - nb, "cache.neg.miss:%ld\n", stats->cache_neg_miss);
+        nb += snprintf(buf+nb, len - nb, "cache.neg.ratio:%.3f\n",
+                       bhd_srv_ratio(stats->cache_neg_hit,
+                                     stats->cache_neg_miss));
+        nb += snprintf(buf+nb, len - nb, "hedge.sent:%ld\n", stats->hedge);
+        nb += snprintf(buf+nb, len - nb, "hedge.win:%ld\n", stats->hedge_win);
+        nb += snprintf(buf+nb, len - nb, "hedge.load:%.3f\n",
+                       stats->numf ?
+                       (double)stats->hedge / (double)stats->numf : 0.0);
+        nb += snprintf(buf+nb, len - nb, "upstream.late:%ld\n", stats->up_late);
+        nb += snprintf(buf+nb, len - nb, "coalesced:%ld\n", stats->coalesced);
+        nb += snprintf(buf+nb, len - nb, "cache.prefetch:%ld\n", stats->prefetch);
+        nb += snprintf(buf+nb, len - nb, "cache.prefetch.capped:%ld\n",
+                       stats->prefetch_capped);
+        nb += snprintf(buf+nb, len - nb, "cache.stale:%ld\n", stats->stale);
+        nb += snprintf(buf+nb, len - nb, "requests.truncated:%ld\n", stats->truncated);
         nb += snprintf(buf+nb, len - nb, "upstream.tx:%ld\n", stats->up_tx);
         nb += snprintf(buf+nb, len - nb, "upstream.rx:%ld\n", stats->up_rx);
         nb += snprintf(buf+nb, len - nb, "downstream.tx:%ld\n", stats->down_tx);
         nb += snprintf(buf+nb, len - nb, "downsteram.rx:%ld\n", stats->down_rx);
+        nb += snprintf(buf+nb, len - nb, "blocklist.entries:%ld\n", bi.count);
+        nb += snprintf(buf+nb, len - nb, "blocklist.bytes:%ld\n", bi.size);
+        nb += snprintf(buf+nb, len - nb, "blocklist.filter.bytes:%ld\n",
+                       bi.filter);
+        nb += snprintf(buf+nb, len - nb, "blocklist.filter.fpr:%.4f\n", bi.fpr);
+        nb += snprintf(buf+nb, len - nb, "blocklist.reloads:%ld\n",
+                       srv->reload.reloads);
+        nb += snprintf(buf+nb, len - nb, "blocklist.reload.failed:%ld\n",
+                       srv->reload.failed);
+        nb += snprintf(buf+nb, len - nb, "blocklist.reload.ms:%ld\n",
+                       srv->reload.dur);
+        nb += snprintf(buf+nb, len - nb, "blocklist.reload.delta:%ld\n",
+                       srv->reload.delta);
+        for (int i = 0; i < srv->nforward; i++)
+        {
+                const struct bhd_up_stats* us = &stats->up[i];
+
+                nb += snprintf(buf+nb, len - nb, "upstream.%d.addr:%s@%d\n",
+                               i, srv->cfg->faddr[i], srv->cfg->fports[i]);
+                nb += snprintf(buf+nb, len - nb, "upstream.%d.queries:%ld\n",
+                               i, us->queries);
+                nb += snprintf(buf+nb, len - nb, "upstream.%d.answers:%ld\n",
+                               i, us->answers);
+                nb += snprintf(buf+nb, len - nb, "upstream.%d.timeouts:%ld\n",
+                               i, us->timeouts);
+                nb += snprintf(buf+nb, len - nb, "upstream.%d.rtt_ms:%.1f\n",
+                               i, (double)us->srtt / 1000.0);
+        }
 
         return nb;
 }
 
+static double bhd_srv_ratio(size_t hit, size_t miss)
+{
+        if (hit + miss == 0)
+        {
+                return 0.0;
+        }
+
+        return (double)hit / (double)(hit + miss);
+}
+
+static void bhd_srv_reload(struct bhd_srv* srv)
+{
+        if (srv->bl_old &&
+            bhd_srv_quiescent(srv, srv->bl_retired))
+        {
+                bhd_bl_free(srv->bl_old);
+                srv->bl_old = NULL;
+        }
+
+        if (__atomic_load_n(&srv->loading, __ATOMIC_ACQUIRE) == 2)
+        {
+                struct bhd_bl_info old;
+                struct bhd_bl_info new;
+
+                pthread_join(srv->loader, NULL);
+                srv->loading = 0;
+                srv->reload.dur = timing_monotonic_usec() / 1000 -
+                        srv->reload_start;
+                if (!srv->bl_next && srv->bl)
+                {
+                        srv->reload.failed++;
+                        syslog(LOG_ERR,
+                               "Could not load block list '%s' in %ldms, "
+                               "keeping the current one",
+                               srv->cfg->bp,
+                               srv->reload.dur);
+                        return;
+                }
+                if (!srv->bl_next)
+                {
+                        /* Nothing is blocked, or with blist-fail closed
+                           nothing that may be blocked is resolved, so
+                           try again without waiting for a SIGHUP */
+                        srv->reload.failed++;
+                        syslog(LOG_ERR,
+                               "Could not load block list '%s' in %ldms, "
+                               "no block list is in use, retrying in %lds",
+                               srv->cfg->bp,
+                               srv->reload.dur,
+                               srv->bl_retry_delay / 1000);
+                        srv->bl_retry = timing_monotonic_usec() / 1000 +
+                                srv->bl_retry_delay;
+                        srv->bl_retry_delay *= 2;
+                        if (srv->bl_retry_delay > BHD_BL_MAX_RETRY)
+                        {
+                                srv->bl_retry_delay = BHD_BL_MAX_RETRY;
+                        }
+                        return;
+                }
+                srv->bl_retry = 0;
+                srv->bl_retry_delay = BHD_BL_RETRY;
+
+                bhd_bl_info(srv->bl, &old);
+                bhd_bl_info(srv->bl_next, &new);
+                if (srv->bl)
+                {
+                        srv->reload.reloads++;
+                }
+                else
+                {
+                        syslog(LOG_INFO,
+                               "Blocking ready %ldms after start",
+                               timing_monotonic_usec() / 1000 -
+                               srv->start);
+                }
+                srv->reload.delta = (long)(new.size + new.filter) -
+                        (long)(old.size + old.filter);
+
+                /* Publish the new block list, and retire the old one at
+                   a new epoch */
+                srv->bl_old = srv->bl;
+                __atomic_store_n(&srv->bl, srv->bl_next, __ATOMIC_RELEASE);
+                srv->bl_next = NULL;
+                srv->bl_retired = __atomic_add_fetch(&srv->epoch,
+                                                     1,
+                                                     __ATOMIC_SEQ_CST);
+                syslog(LOG_INFO,
+                       "Loaded block list in %ldms, %ld entries, "
+                       "%+ld bytes",
+                       srv->reload.dur,
+                       new.count,
+                       srv->reload.delta);
+        }
+
+        if (srv->bl_retry && timing_monotonic_usec() / 1000 >= srv->bl_retry)
+        {
+                srv->bl_retry = 0;
+                reload = 1;
+        }
+
+        /* A retired block list must be freed before the next reload */
+        if (reload && srv->loading == 0 && srv->bl_old == NULL)
+        {
+                sigset_t mask;
+                sigset_t omask;
+
+                reload = 0;
+                srv->loading = 1;
+                srv->reload_start = timing_monotonic_usec() / 1000;
+                syslog(LOG_INFO, "Loading block list '%s'", srv->cfg->bp);
+
+                sigfillset(&mask);
+                pthread_sigmask(SIG_BLOCK, &mask, &omask);
+                if (pthread_create(&srv->loader, NULL, &bhd_srv_load, srv))
+                {
+                        syslog(LOG_ERR, "pthread_create: %m");
+                        srv->loading = 0;
+                        srv->reload.failed++;
+                }
+                pthread_sigmask(SIG_SETMASK, &omask, NULL);
+        }
+}
+
+static void* bhd_srv_load(void* arg)
+{
+        struct bhd_srv* srv = arg;
+
+        srv->bl_next = bhd_bl_create(srv->cfg->bp,
+                                     (enum bhd_bl_engine)srv->cfg->bl_engine,
+                                     srv->cfg->bl_threads);
+        __atomic_store_n(&srv->loading, 2, __ATOMIC_RELEASE);
+
+        return NULL;
+}
+
+static int bhd_srv_quiescent(const struct bhd_srv* srv, uint64_t epoch)
+{
+        for (int i = 0; i < srv->nworkers; i++)
+        {
+                if (__atomic_load_n(&srv->workers[i].epoch,
+                                    __ATOMIC_ACQUIRE) < epoch)
+                {
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
 static void sigh(int signum)
 {
-        (void)signum;
+        if (signum == SIGHUP)
+        {
+                reload = 1;
+                return;
+        }
         run = 0;
 }
@@ -13,53 +13,317 @@
 #ifndef BHD_SRV_H
 #define BHD_SRV_H
 
+#include <stdint.h>
+#include <pthread.h>
 #include <netinet/in.h>
+#include "bhd_cfg.h"
+#include "bhd_dns.h"
+
+/* Max number of queries outstanding upstream */
+#define BHD_MAX_PENDING 1024
+/* Max size of a query that is forwarded */
+#define BHD_MAX_QUERY 512
+/* Max number of clients waiting on another client's pending query */
+#define BHD_MAX_WAITERS 4096
+/* Number of buckets in the table of pending questions */
+#define BHD_QMAP_SIZE 2048
+/* Number of recent RTT samples the hedge delay is computed over */
+#define BHD_RTT_SAMPLES 256
+/* Max number of datagrams read or written per system call */
+#define BHD_BATCH 64
+#define BHD_BATCH_MIN 4
+/* Number of random values read from /dev/urandom at a time */
+#define BHD_RND_POOL 256
+/* Number of sockets a worker forwards on, each bound to a random port */
+#define BHD_FWD_SOCKETS 16
+/* Queries sent on a forward socket before it moves to a new port */
+#define BHD_FWD_ROTATE 1024
 
 struct bhd_bl;
-struct bhd_cfg;
+struct bhd_cache;
+
+/* EDNS of a client's query, size is 0 if the query has no OPT
+   record */
+struct bhd_edns
+{
+        uint16_t size;
+        /* The DO flag */
+        uint8_t dnssec;
+};
+
+struct bhd_up_stats
+{
+        /* Queries sent, answers received and tries that timed out */
+        size_t queries;
+        size_t answers;
+        size_t timeouts;
+        /* Smoothed RTT in us, only set when stats are summed */
+        long srtt;
+};
 
 /* Naming is based on responses, i.e upstream is where requests are
    forwarded */
 struct bhd_stats
 {
+        struct bhd_up_stats up[BHD_MAX_UPSTREAM];
         size_t numf;
         size_t numb;
+        /* Blocked queries by type, other counts the remaining types */
+        size_t numb_a;
+        size_t numb_aaaa;
+        size_t numb_https;
+        size_t numb_any;
+        size_t numb_other;
         size_t up_tx;
         size_t up_rx;
         size_t down_tx;
         size_t down_rx;
+        size_t timeout;
+        size_t dropped;
+        size_t cache_hit;
+        size_t cache_miss;
+        /* Negative answers served from cache, and fetched upstream */
+        size_t cache_neg_hit;
+        size_t cache_neg_miss;
+        /* Queries sent to a second upstream, and answered by it first */
+        size_t hedge;
+        size_t hedge_win;
+        /* Responses for queries that were already answered */
+        size_t up_late;
+        /* Queries merged with an identical pending query */
+        size_t coalesced;
+        /* Cache entries refreshed before expiry, and refreshes skipped
+           due to the rate limit */
+        size_t prefetch;
+        size_t prefetch_capped;
+        /* Stale answers served, RFC 8767 */
+        size_t stale;
+        /* Answers truncated to fit the client's UDP payload size, or
+           the receive buffer */
+        size_t truncated;
+        /* Queries failed while the block list is loaded */
+        size_t bl_fail;
 };
 
-struct bhd_srv
+/* A query forwarded upstream, waiting for a response. The query is
+   forwarded with a rewritten id (fid), which is used to find the
+   client to respond to. The query is kept so it can be sent to another
+   upstream if the first one does not respond. */
+struct bhd_pending
+{
+        struct sockaddr_in caddr;
+        struct bhd_edns edns;
+        /* Time the query was received, and sent to each upstream, in us */
+        long recv;
+        long sent[BHD_MAX_UPSTREAM];
+        /* Bit masks of upstreams the query is sent to, and upstreams
+           that have timed out */
+        uint32_t tried;
+        uint32_t failed;
+        uint16_t id;
+        uint16_t fid;
+        uint16_t qlen;
+        /* Upstream the query was last sent to */
+        uint8_t up;
+        /* Forward socket the query is sent to each upstream on */
+        uint8_t sock[BHD_MAX_UPSTREAM];
+        /* Upstream the query was hedged to, -1 if not hedged */
+        int8_t hedge;
+        /* A cache refresh, there is no client to respond to */
+        uint8_t prefetch;
+        /* A stale answer has been looked for */
+        uint8_t stale;
+        /* Hash of the question, next pending slot + 1 in the same
+           bucket and first waiter + 1, 0 ends the lists */
+        uint32_t hash;
+        uint16_t qnext;
+        uint16_t waiter;
+        unsigned char q[BHD_MAX_QUERY];
+};
+
+/* A client asking the same question as a pending query, it gets a copy
+   of the response with its own id. */
+struct bhd_waiter
+{
+        struct sockaddr_in caddr;
+        struct bhd_edns edns;
+        uint16_t id;
+        /* Next waiter + 1, 0 ends the list */
+        uint16_t next;
+};
+
+/* A worker's view of an upstream's health. Times are in us. */
+struct bhd_upstream
+{
+        /* Smoothed RTT and RTT variation, RFC 6298 */
+        long srtt;
+        long rttvar;
+        /* When an upstream that is down is tried again */
+        long retry;
+        /* Consecutive timeouts */
+        unsigned int fails;
+};
+
+/* A datagram, the address is the source when received and the
+   destination when sent. */
+struct bhd_msg
+{
+        unsigned char* buf;
+        size_t len;
+        struct sockaddr_in addr;
+};
+
+/* A socket queries are forwarded on. Once BHD_FWD_ROTATE queries are
+   sent on it, no more are, and it is bound to a new random port when
+   none of its queries are pending. */
+struct bhd_fwd
+{
+        int fd;
+        unsigned int sent;
+        unsigned int pending;
+};
+
+/* A worker serves clients on its own listen socket (bound with
+   SO_REUSEPORT) and forwards on its own sockets. All mutable state used
+   when serving queries is per worker, so no locking is needed. Stats
+   are placed first, each worker is large enough to keep the counters of
+   different workers on separate cache lines. */
+struct bhd_worker
 {
         struct bhd_stats stats;
-        struct sockaddr_in faddr;
+        struct bhd_pending pending[BHD_MAX_PENDING];
+        /* Free slots in pending */
+        uint16_t pfree[BHD_MAX_PENDING];
+        /* Maps a forwarded id to a pending slot + 1, 0 if unused */
+        uint16_t pmap[UINT16_MAX + 1];
+        /* Maps a question's hash to the first pending slot + 1 */
+        uint16_t qmap[BHD_QMAP_SIZE];
+        struct bhd_waiter waiters[BHD_MAX_WAITERS];
+        /* Free slots in waiters */
+        uint16_t wfree[BHD_MAX_WAITERS];
+        struct bhd_upstream up[BHD_MAX_UPSTREAM];
+        /* Recent RTT samples, and the delay before a query is hedged in
+           us, 0 until enough samples are collected */
+        long rtts[BHD_RTT_SAMPLES];
+        long hedge_delay;
+        unsigned int nrtt;
+        /* Prefetch rate limit, tokens per second and time of the last
+           refill in us */
+        unsigned int pf_rate;
+        unsigned int pf_tokens;
+        long pf_refill;
+        /* Received datagrams, backed by rxbuf */
+        struct bhd_msg rx[BHD_BATCH];
+        /* Datagrams to send to clients and upstream */
+        struct bhd_msg tx_down[BHD_BATCH];
+        struct bhd_msg tx_up[BHD_BATCH];
+        /* Forward socket of each datagram in tx_up */
+        uint8_t tx_sock[BHD_BATCH];
+        unsigned char* rxbuf;
+        struct bhd_cache* cache;
+        struct bhd_srv* srv;
+        /* Last block list epoch seen, the worker holds no reference to
+           a block list retired before it */
+        uint64_t epoch;
+        pthread_t thread;
+        int fd_listen;
+        struct bhd_fwd fwd[BHD_FWD_SOCKETS];
+        /* Random values for forward ids and ports, used from the end */
+        uint16_t rnd[BHD_RND_POOL];
+        unsigned int nrnd;
+        unsigned int batch_down;
+        unsigned int batch_up;
+        /* Number of queued datagrams in tx_down and tx_up */
+        unsigned int ndown;
+        unsigned int nup;
+        uint16_t npfree;
+        uint16_t nwfree;
+        /* Set when the worker has answered a client */
+        uint8_t answered;
+};
+
+/* Stats of block list reloads */
+struct bhd_reload_stats
+{
+        size_t reloads;
+        size_t failed;
+        /* Duration of the last reload in ms, and the change in memory
+           used by the block list in bytes */
+        long dur;
+        long delta;
+};
+
+/* The block list is loaded when the server is started, and reloaded
+   on SIGHUP. A new list is loaded by a thread while the old one (or
+   none) is in use, and is published by swapping the pointer. The old
+   list is freed when every worker has passed an epoch later than the
+   swap, as no worker holds a reference to a block list between two
+   batches. */
+struct bhd_srv
+{
+        struct sockaddr_in faddr[BHD_MAX_UPSTREAM];
         const struct bhd_cfg* cfg;
         struct bhd_bl* bl;
-        int fd_listen;
-        int fd_forward;
+        /* A block list being loaded, and a retired block list waiting
+           for the workers to pass the epoch it was retired at */
+        struct bhd_bl* bl_next;
+        struct bhd_bl* bl_old;
+        uint64_t epoch;
+        uint64_t bl_retired;
+        struct bhd_reload_stats reload;
+        /* Answers to blocked A and AAAA queries, appended to the
+           question */
+        unsigned char bl_a[BHD_DNS_RR_A_SIZE];
+        unsigned char bl_aaaa[BHD_DNS_RR_AAAA_SIZE];
+        /* Size of datagrams received, and of the buffers, which leave
+           room to add an OPT record */
+        size_t buf_len;
+        size_t buf_cap;
+        /* Monotonic time the server was initialized, and a reload was
+           started, in ms */
+        long start;
+        long reload_start;
+        pthread_t loader;
+        /* 0 when idle, 1 while loading, 2 when loaded */
+        int loading;
+        /* Monotonic time a failed first load is tried again at, 0 if
+           none is due, and the delay before the try after it, in ms */
+        long bl_retry;
+        long bl_retry_delay;
+        /* Set when a client is first answered */
+        int answered;
+        struct bhd_worker* workers;
+        int nworkers;
+        int nforward;
         int fd_stats;
+        int fd_random;
         char daemon;
 };
 
 /**
  * Initilize a bhd_srv struct.
  * @param srv the struct to initialize.
- * @param cfg configuration struct.
- * @param bl block list to use.
+ * @param cfg configuration struct. The block list is loaded in the
+ *        background when the server is started.
  * @param daemon set to true if srv should be run as a daemon.
  * @return 0 on success.
  */
-int bhd_srv_init(struct bhd_srv* srv,
-                 const struct bhd_cfg* cfg,
-                 struct bhd_bl* bl,
-                 int daemon);
+int bhd_srv_init(struct bhd_srv* srv, const struct bhd_cfg* cfg, int daemon);
 
 /**
- * Start server.
+ * Start server. One thread per worker is started, and the calling
+ * thread serves the stats socket until the server is stopped.
  * @param srv struct to use
  * @return -1 if server unexpectedly stopped.
  */
 int bhd_serve(struct bhd_srv* srv);
 
+/**
+ * Sum the stats of all workers.
+ * @param srv the server.
+ * @param stats struct to write the sum to.
+ * @return void.
+ */
+void bhd_srv_stats(const struct bhd_srv* srv, struct bhd_stats* stats);
+
 #endif /* BHD_SRV_H */
@@ -0,0 +1,423 @@
+/*
+* Copyright (C) 2020 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "bhd_dns.h"
+#include "bhd_bl.h"
+#include "vendor/timing.h"
+
+#define MAX_LINE 256
+/* Passes over the names for each way of matching */
+#define ROUNDS 10
+/* Names per call to bhd_bl_match_batch, as a batch of the server */
+#define BATCH 64
+/* Messages written and read by the message benchmark */
+#define MSGS 2000000
+
+struct name
+{
+        struct bhd_dns_q_label* labels;
+        /* The labels point into the text */
+        char text[BHD_DNS_MAX_NAME];
+        unsigned char wire[BHD_DNS_MAX_NAME + 1];
+        size_t len;
+};
+
+/**
+ * Read names, one per line, and split them in labels and to wire
+ * format.
+ * @return the number of names read, or -1 on error.
+ */
+static long read_names(const char* p, struct name** names);
+
+/**
+ * Print the throughput of a run.
+ */
+static void report(const char* what, long n, long usec, long blocked);
+
+/**
+ * Measure the time to load a text block list with 1, 2, 4... threads.
+ * @return 0 on success.
+ */
+static int bench_load(const char* p, int max);
+
+/**
+ * Measure the throughput of writing a response with the compressing
+ * writer, and of reading its records back.
+ * @return 0 on success.
+ */
+static int bench_msg(void);
+
+/**
+ * Write a response with a CNAME chain, addresses, a SOA and an OPT.
+ * @return the length of the response, 0 on error.
+ */
+static size_t write_msg(unsigned char* buf, size_t len);
+
+/**
+ * Measure the throughput of the block list lookups, one name at a time
+ * and in batches, with -l the time to load a block list, or with -d
+ * the throughput of writing and reading messages.
+ */
+int main(int argc, char** argv)
+{
+        const unsigned char* wires[BATCH];
+        size_t lens[BATCH];
+        int verdicts[BATCH];
+        enum bhd_bl_engine engine = BHD_BL_TRIE;
+        struct bhd_bl* bl;
+        struct name* names;
+        struct timing t;
+        long n;
+        long blocked;
+
+        if (argc == 2 && strcmp(argv[1], "-d") == 0)
+        {
+                return bench_msg();
+        }
+        if (argc >= 3 && strcmp(argv[1], "-l") == 0)
+        {
+                openlog("bhdns-bench", LOG_PERROR, LOG_USER);
+                setlogmask(LOG_UPTO(LOG_INFO));
+                return bench_load(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+        }
+        if (argc < 3 || argc > 4)
+        {
+                fprintf(stderr,
+                        "usage: %s blist names [trie|hash]\n"
+                        "       %s -l blist [max threads]\n"
+                        "       %s -d\n",
+                        argv[0],
+                        argv[0],
+                        argv[0]);
+                return 1;
+        }
+        if (argc == 4 && strcmp(argv[3], "hash") == 0)
+        {
+                engine = BHD_BL_HASH;
+        }
+
+        openlog("bhdns-bench", LOG_PERROR, LOG_USER);
+
+        bl = bhd_bl_create(argv[1], engine, 0);
+        if (!bl)
+        {
+                return 1;
+        }
+        n = read_names(argv[2], &names);
+        if (n < 0)
+        {
+                bhd_bl_free(bl);
+                return 1;
+        }
+
+        blocked = 0;
+        timing_start(&t);
+        for (int r = 0; r < ROUNDS; r++)
+        {
+                for (long i = 0; i < n; i++)
+                {
+                        blocked += bhd_bl_match(bl, names[i].labels);
+                }
+        }
+        report("match", n, timing_dur_usec(&t), blocked);
+
+        blocked = 0;
+        timing_start(&t);
+        for (int r = 0; r < ROUNDS; r++)
+        {
+                for (long i = 0; i < n; i++)
+                {
+                        blocked += bhd_bl_match_name(bl,
+                                                     names[i].wire,
+                                                     names[i].len);
+                }
+        }
+        report("match_name", n, timing_dur_usec(&t), blocked);
+
+        blocked = 0;
+        timing_start(&t);
+        for (int r = 0; r < ROUNDS; r++)
+        {
+                for (long i = 0; i < n; i += BATCH)
+                {
+                        size_t b = 0;
+
+                        for (; b < BATCH && i + (long)b < n; b++)
+                        {
+                                wires[b] = names[i + b].wire;
+                                lens[b] = names[i + b].len;
+                        }
+                        blocked += bhd_bl_match_batch(bl,
+                                                      wires,
+                                                      lens,
+                                                      verdicts,
+                                                      b);
+                }
+        }
+        report("match_batch", n, timing_dur_usec(&t), blocked);
+
+        for (long i = 0; i < n; i++)
+        {
+                while (names[i].labels)
+                {
+                        struct bhd_dns_q_label* next = names[i].labels->next;
+
+                        free(names[i].labels);
+                        names[i].labels = next;
+                }
+        }
+        free(names);
+        bhd_bl_free(bl);
+
+        return 0;
+}
+
+static long read_names(const char* p, struct name** names)
+{
+        char line[MAX_LINE];
+        FILE* f = fopen(p, "r");
+        long cap = 1024;
+        long n = 0;
+
+        if (!f)
+        {
+                syslog(LOG_ERR, "Could not open '%s': %m", p);
+                return -1;
+        }
+        *names = malloc(cap * sizeof(struct name));
+        if (!*names)
+        {
+                fclose(f);
+                return -1;
+        }
+
+        while (fgets(line, MAX_LINE, f))
+        {
+                line[strcspn(line, "\r\n")] = '\0';
+                if (line[0] == '\0' || strlen(line) >= BHD_DNS_MAX_NAME)
+                {
+                        continue;
+                }
+                if (n == cap)
+                {
+                        struct name* tmp;
+
+                        cap *= 2;
+                        tmp = realloc(*names, cap * sizeof(struct name));
+                        if (!tmp)
+                        {
+                                break;
+                        }
+                        *names = tmp;
+                }
+
+                strcpy((*names)[n++].text, line);
+        }
+        fclose(f);
+
+        /* The names are not moved anymore */
+        for (long i = 0; i < n; i++)
+        {
+                struct name* name = &(*names)[i];
+                struct bhd_dns_q_label** next = &name->labels;
+                char* label;
+                char* save;
+
+                name->labels = NULL;
+                name->len = 0;
+                for (label = strtok_r(name->text, ".", &save);
+                     label;
+                     label = strtok_r(NULL, ".", &save))
+                {
+                        size_t l = strlen(label);
+
+                        *next = malloc(sizeof(struct bhd_dns_q_label));
+                        if (!*next)
+                        {
+                                break;
+                        }
+                        (*next)->label = label;
+                        (*next)->next = NULL;
+                        next = &(*next)->next;
+                        name->wire[name->len++] = (unsigned char)l;
+                        memcpy(name->wire + name->len, label, l);
+                        name->len += l;
+                }
+                name->wire[name->len++] = 0;
+        }
+
+        return n;
+}
+
+static int bench_load(const char* p, int max)
+{
+        if (max <= 0)
+        {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+                max = cpus > 0 ? (int)cpus : 1;
+        }
+        if (max > BHD_BL_MAX_THREADS)
+        {
+                max = BHD_BL_MAX_THREADS;
+        }
+
+        for (int n = 1; n <= max; n = n * 2 > max && n < max ? max : n * 2)
+        {
+                struct timing t;
+                struct bhd_bl* bl;
+                long ms;
+
+                timing_start(&t);
+                bl = bhd_bl_create(p, BHD_BL_TRIE, n);
+                ms = timing_dur_msec(&t);
+                if (!bl)
+                {
+                        return 1;
+                }
+                bhd_bl_free(bl);
+                printf("threads %2d %6ld ms\n", n, ms);
+        }
+
+        return 0;
+}
+
+static void report(const char* what, long n, long usec, long blocked)
+{
+        printf("%-12s %8.2f M lookups/s, %ld blocked\n",
+               what,
+               (double)n * ROUNDS / (double)(usec ? usec : 1),
+               blocked);
+}
+
+static int bench_msg(void)
+{
+        unsigned char buf[512];
+        struct timing t;
+        size_t len = 0;
+        long nrr = 0;
+
+        timing_start(&t);
+        for (long i = 0; i < MSGS; i++)
+        {
+                len = write_msg(buf, sizeof(buf));
+                if (len == 0)
+                {
+                        fprintf(stderr, "Failed to write message\n");
+                        return 1;
+                }
+        }
+        printf("%-12s %8.2f M msgs/s, %zu bytes\n",
+               "write",
+               (double)MSGS / (double)(timing_dur_usec(&t) | 1),
+               len);
+
+        timing_start(&t);
+        for (long i = 0; i < MSGS; i++)
+        {
+                unsigned char name[BHD_DNS_MAX_NAME];
+                struct bhd_dns_rr_reader r;
+                struct bhd_dns_msg msg;
+                struct bhd_dns_rr rr;
+                struct bhd_dns_rr_soa soa;
+                struct bhd_dns_rr_opt opt;
+                unsigned char a6[16];
+                uint32_t a;
+
+                if (bhd_dns_msg_unpack(&msg, buf, len))
+                {
+                        fprintf(stderr, "Failed to read message\n");
+                        return 1;
+                }
+                bhd_dns_rr_reader_init(&r, &msg);
+                while (bhd_dns_rr_next(&r, &rr, NULL) == 1)
+                {
+                        int err = 0;
+
+                        switch (rr.type)
+                        {
+                        case BHD_DNS_QTYPE_A:
+                                err = bhd_dns_rr_a_unpack(&a, buf, &rr);
+                                break;
+                        case BHD_DNS_QTYPE_AAAA:
+                                err = bhd_dns_rr_aaaa_unpack(a6, buf, &rr);
+                                break;
+                        case BHD_DNS_QTYPE_CNAME:
+                                err = !bhd_dns_rr_cname_unpack(name,
+                                                               buf,
+                                                               len,
+                                                               &rr);
+                                break;
+                        case BHD_DNS_QTYPE_SOA:
+                                err = bhd_dns_rr_soa_unpack(&soa,
+                                                            buf,
+                                                            len,
+                                                            &rr);
+                                break;
+                        case BHD_DNS_QTYPE_OPT:
+                                err = bhd_dns_rr_opt_unpack(&opt, &rr);
+                                break;
+                        }
+                        if (err)
+                        {
+                                fprintf(stderr, "Failed to read record\n");
+                                return 1;
+                        }
+                        nrr++;
+                }
+        }
+        printf("%-12s %8.2f M msgs/s, %ld records\n",
+               "read",
+               (double)MSGS / (double)(timing_dur_usec(&t) | 1),
+               nrr / MSGS);
+
+        return 0;
+}
+
+static size_t write_msg(unsigned char* buf, size_t len)
+{
+        static const unsigned char qname[] = "\3www\7example\3com";
+        static const unsigned char cname[] = "\3www\7example\3com\3cdn\6akamai\3net";
+        static const unsigned char target[] = "\5e1234\1a\6akamai\3net";
+        static const unsigned char zone[] = "\6akamai\3net";
+        static const unsigned char mname[] = "\4n0a1\6akamai\3net";
+        static const unsigned char rname[] = "\12hostmaster\6akamai\3net";
+        static const unsigned char a6[16] = {0x20, 0x01, 0x0d, 0xb8};
+        const struct bhd_dns_rr_soa soa = {0, 0, 1, 1000, 1000, 1000, 180};
+        const struct bhd_dns_rr_opt opt = {1232, 0, 0, 0, 0, 0};
+        struct bhd_dns_writer w;
+        struct bhd_dns_h h;
+
+        memset(&h, 0, sizeof(h));
+        h.id = 0x1234;
+        h.qr = 1;
+        h.rd = 1;
+        h.ra = 1;
+
+        bhd_dns_writer_init(&w, buf, len, &h);
+        bhd_dns_write_question(&w, qname, BHD_DNS_QTYPE_A, BHD_DNS_CLASS_IN);
+        bhd_dns_write_cname(&w, BHD_DNS_SECTION_AN, qname, 300, cname);
+        bhd_dns_write_cname(&w, BHD_DNS_SECTION_AN, cname, 300, target);
+        bhd_dns_write_a(&w, BHD_DNS_SECTION_AN, target, 20, htonl(0x0a000001));
+        bhd_dns_write_a(&w, BHD_DNS_SECTION_AN, target, 20, htonl(0x0a000002));
+        bhd_dns_write_aaaa(&w, BHD_DNS_SECTION_AN, target, 20, a6);
+        bhd_dns_write_soa(&w, BHD_DNS_SECTION_NS, zone, 180, mname, rname, &soa);
+        bhd_dns_write_opt(&w, &opt, NULL);
+
+        return bhd_dns_writer_finish(&w);
+}
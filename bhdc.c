@@ -0,0 +1,46 @@
+/*
+* Copyright (C) 2020 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <stdio.h>
+#include <syslog.h>
+#include "bhd_bl.h"
+
+/**
+ * Compile a block list to an image that bhdns maps at startup.
+ */
+int main(int argc, char** argv)
+{
+        struct bhd_bl* bl;
+
+        if (argc != 3)
+        {
+                fprintf(stderr, "usage: %s blist image\n", argv[0]);
+                return 1;
+        }
+
+        openlog("bhdns-compile", LOG_PERROR, LOG_USER);
+
+        bl = bhd_bl_create(argv[1], BHD_BL_TRIE, 0);
+        if (!bl)
+        {
+                return 1;
+        }
+        if (bhd_bl_save(bl, argv[2]))
+        {
+                syslog(LOG_ERR, "Could not write '%s': %m", argv[2]);
+                bhd_bl_free(bl);
+                return 1;
+        }
+        bhd_bl_free(bl);
+
+        return 0;
+}